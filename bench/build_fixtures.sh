@@ -0,0 +1,19 @@
+#!/bin/sh
+# Compiles the benchmark fixtures in bench/ to HBC, next to their sources, and
+# writes what `hermesc -version` says to a .hbc.version file beside each one.
+# The suite copies that into its results, so runs over fixtures from
+# different compilers can be told apart.
+# Use the hermesc from the same Hermes build the binary links against, which
+# is external/hermesc unless another one is given:
+#   bench/build_fixtures.sh [path/to/hermesc]
+set -e
+
+root="$(cd "$(dirname "$0")/.." && pwd)"
+hermesc="${1:-$root/external/hermesc}"
+
+for source in "$root"/bench/*.js; do
+  output="${source%.js}.hbc"
+  "$hermesc" -emit-binary -out "$output" "$source"
+  "$hermesc" -version > "$output.version"
+  echo "$output"
+done
@@ -0,0 +1,10 @@
+// Fixture for `snapitjs bench pool`, a job that only uses the CPU. Compile
+// with `hermes -emit-binary -out cpu.hbc cpu.js`.
+
+function cpuBound() {
+  var sum = 0;
+  for (var i = 0; i < 200000; i++) {
+    sum += Math.sqrt(i) * Math.sin(i);
+  }
+  return sum;
+}
@@ -0,0 +1,27 @@
+// Fixture for `snapitjs bench native-call`. Compile with
+// `hermes -emit-binary -out native_call.hbc native_call.js`.
+
+function benchVirtualCall(calls) {
+  var value = 0;
+  for (var i = 0; i < calls; i++) {
+    value = nativeIncrement(value);
+  }
+  return value;
+}
+
+function benchFastCall(calls) {
+  var value = 0;
+  for (var i = 0; i < calls; i++) {
+    value = nativeIncrementFast(value);
+  }
+  return value;
+}
+
+// the loop without a native call, subtracted from both
+function benchEmptyLoop(calls) {
+  var value = 0;
+  for (var i = 0; i < calls; i++) {
+    value = value + 1;
+  }
+  return value;
+}
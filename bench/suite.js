@@ -0,0 +1,100 @@
+// Fixture for `snapitjs bench suite`. Compile it with bench/build_fixtures.sh,
+// which also records the compiler version in suite.hbc.version.
+// Every bench* function runs its loop inside JS and returns the number of
+// iterations, so the host can check that it ran.
+
+// an export to call from the host that does nothing
+function benchNothing() {
+  return 0;
+}
+
+// the loop without a native call, subtracted from the call benchmarks
+function benchEmptyLoop(calls) {
+  var value = 0;
+  for (var i = 0; i < calls; i++) {
+    value = value + 1;
+  }
+  return value;
+}
+
+function benchVirtualCall(calls) {
+  var value = 0;
+  for (var i = 0; i < calls; i++) {
+    value = nativeIncrement(value);
+  }
+  return value;
+}
+
+function benchFastCall(calls) {
+  var value = 0;
+  for (var i = 0; i < calls; i++) {
+    value = nativeIncrementFast(value);
+  }
+  return value;
+}
+
+// ASCII and non-ASCII strings through a native that decodes and returns them
+var asciiText = new Array(65).join("snapit-js ");
+var utf16Text = new Array(65).join("snäpit-js ");
+
+function benchStringAscii(calls) {
+  var count = 0;
+  for (var i = 0; i < calls; i++) {
+    if (nativeEchoString(asciiText).length === asciiText.length) {
+      count++;
+    }
+  }
+  return count;
+}
+
+function benchStringUtf16(calls) {
+  var count = 0;
+  for (var i = 0; i < calls; i++) {
+    if (nativeEchoString(utf16Text).length === utf16Text.length) {
+      count++;
+    }
+  }
+  return count;
+}
+
+// reads two {x, y} objects and returns a new one
+function benchObjects(calls) {
+  var a = {x: 1, y: 2};
+  var b = {x: 3, y: 4};
+  var count = 0;
+  for (var i = 0; i < calls; i++) {
+    if (midpoint(a, b).x === 2) {
+      count++;
+    }
+  }
+  return count;
+}
+
+// the host passes a string in and reads the result back as a string
+function echo(text) {
+  return text;
+}
+
+// short lived objects, arrays and strings, mostly young generation work
+function benchAllocate(count) {
+  var kept = null;
+  for (var i = 0; i < count; i++) {
+    var item = {id: i, name: "item" + i, tags: [i, i + 1, i + 2]};
+    if ((i & 1023) === 0) {
+      kept = item;
+    }
+  }
+  return kept === null ? 0 : count;
+}
+
+// a large live set that survives collections, so old generation work
+function benchRetain(count) {
+  var live = [];
+  for (var i = 0; i < count; i++) {
+    live.push({id: i, value: "v" + (i % 100)});
+    if (live.length > 100000) {
+      live = live.slice(50000);
+    }
+  }
+  return count;
+}
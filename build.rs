@@ -1,12 +1,97 @@
 use std::path::PathBuf;
 use std::env;
+use std::process::Command;
+
+// The VM profilers that change the interpreter, they only work against a
+// Hermes built with the same defines.
+const PROFILERS: &[(&str, &str)] = &[
+    ("opcode", "-DHERMESVM_PROFILER_OPCODE"),
+    ("jsfunction", "-DHERMESVM_PROFILER_JSFUNCTION"),
+    ("bb", "-DHERMESVM_PROFILER_BB"),
+    ("nativecall", "-DHERMESVM_PROFILER_NATIVECALL"),
+];
+
+// SNAPIT_HERMES_PROFILERS is a comma separated list of PROFILERS names, or
+// "all". Panics on an unknown name so a typo doesn't build a release binary.
+fn profiler_defines() -> Vec<&'static str> {
+    let list = env::var("SNAPIT_HERMES_PROFILERS").unwrap_or_default();
+    let mut defines = Vec::new();
+    for name in list.split(',').map(str::trim).filter(|name| !name.is_empty()) {
+        if name == "all" {
+            return PROFILERS.iter().map(|profiler| profiler.1).collect();
+        }
+        match PROFILERS.iter().find(|profiler| profiler.0 == name) {
+            Some(profiler) => defines.push(profiler.1),
+            None => panic!("unknown profiler {} in SNAPIT_HERMES_PROFILERS", name),
+        }
+    }
+    defines
+}
+
+// The major LLVM version of a compiler, from "LLVM version: 17.0.6" in
+// rustc -vV or "clang version 17.0.6" in clang --version.
+fn llvm_major_version(compiler: &str, args: &[&str], prefix: &str) -> Option<u32> {
+    let output = Command::new(compiler).args(args).output().ok()?;
+    let text = String::from_utf8_lossy(&output.stdout).into_owned();
+    let version = text.lines()
+        .find_map(|line| line.find(prefix).map(|start| &line[start + prefix.len()..]))?;
+    version.split('.').next()?.trim().parse().ok()
+}
+
+// SNAPIT_LTO=thin or fat compiles the C++ to LLVM bitcode so that the linker
+// can optimize it together with the Rust code, and the Rust side has to be
+// built with -Clinker-plugin-lto. Panics on a setup that would silently
+// leave either side out, or that the linker would reject.
+fn lto_flag(compiler: &cc::Tool) -> Option<&'static str> {
+    let flag = match env::var("SNAPIT_LTO").unwrap_or_default().as_str() {
+        "" | "off" => return None,
+        "thin" => "-flto=thin",
+        "fat" => "-flto",
+        other => panic!("unknown SNAPIT_LTO mode {}, use thin, fat or off", other),
+    };
+    if !compiler.is_like_clang() {
+        panic!("SNAPIT_LTO needs clang as the C++ compiler, set CXX=clang++");
+    }
+    let rustflags = env::var("CARGO_ENCODED_RUSTFLAGS").unwrap_or_default();
+    if !rustflags.split('\x1f').any(|flag| flag.contains("linker-plugin-lto")) {
+        panic!("SNAPIT_LTO needs RUSTFLAGS=\"-Clinker-plugin-lto -Clinker=clang -Clink-arg=-fuse-ld=lld\"");
+    }
+    // bitcode from different LLVM versions can't be linked together
+    let rustc = env::var("RUSTC").unwrap_or("rustc".to_string());
+    let clang = compiler.path().to_string_lossy().into_owned();
+    let rust_llvm = llvm_major_version(&rustc, &["-vV"], "LLVM version: ");
+    let clang_llvm = llvm_major_version(&clang, &["--version"], "clang version ");
+    if rust_llvm.is_none() || rust_llvm != clang_llvm {
+        panic!("SNAPIT_LTO needs clang built on the same LLVM as rustc, rustc has {:?} and {} has {:?}",
+            rust_llvm, clang, clang_llvm);
+    }
+    Some(flag)
+}
 
 fn main() -> miette::Result<()>  {
-    println!("cargo:rustc-link-search=./external");
+    // a profiling build links against a Hermes built with the same profilers,
+    // SNAPIT_HERMES_LIB_DIR points at it
+    println!("cargo:rerun-if-env-changed=SNAPIT_HERMES_LIB_DIR");
+    println!("cargo:rerun-if-env-changed=SNAPIT_HERMES_PROFILERS");
+    let hermes_lib_dir = env::var("SNAPIT_HERMES_LIB_DIR").unwrap_or("./external".to_string());
+    let profiler_defines = profiler_defines();
+    println!("cargo:rustc-link-search={}", hermes_lib_dir);
     println!("cargo:rustc-link-lib=hermesVMRuntime");
 
     let target_arch = env::var("CARGO_CFG_TARGET_ARCH").expect("CARGO_CFG_TARGET_ARCH was not set");
     let target_os = env::var("CARGO_CFG_TARGET_OS").expect("CARGO_CFG_TARGET_OS was not set");
+    if target_os != "windows" && target_os != "linux" {
+        panic!("building for {} isn't supported, only windows and linux", target_os);
+    }
+    println!("cargo:rerun-if-env-changed=SNAPIT_LTO");
+    // SNAPIT_NATIVE_INSTRUMENTATION=0 compiles the native call stats out
+    println!("cargo:rerun-if-env-changed=SNAPIT_NATIVE_INSTRUMENTATION");
+    let native_instrumentation = env::var("SNAPIT_NATIVE_INSTRUMENTATION").map_or(true, |value| value != "0");
+    // SNAPIT_CONCURRENT_GC=0 builds against a Hermes built without the
+    // concurrent GC, from SNAPIT_HERMES_LIB_DIR. The zygote needs it, the GC
+    // thread wouldn't survive fork.
+    println!("cargo:rerun-if-env-changed=SNAPIT_CONCURRENT_GC");
+    let concurrent_gc = env::var("SNAPIT_CONCURRENT_GC").map_or(true, |value| value != "0");
 
     let mut b = autocxx_build::Builder::new("src/main.rs",
         &[
@@ -19,17 +104,18 @@ fn main() -> miette::Result<()>  {
         "-D HERMESVM_HEAP_SEGMENT_SIZE_KB=4096",
         "-D HERMESVM_GC_HADES",
         "-D HERMESVM_ALLOW_COMPRESSED_POINTERS",
-        "-D HERMESVM_ALLOW_CONCURRENT_GC",
         //"-D HERMESVM_ALLOW_CONTIGUOUS_HEAP",
         "-D HERMESVM_ALLOW_INLINE_ASM",
         "-D HERMES_ENABLE_DEBUGGER",
         //"-D HERMES_LLVM",
         "-D HERMES_MEMORY_INSTRUMENTATION",
         "-D HERMES_RELEASE_VERSION=\"0.12.0\"",
-        "-D _WINDOWS",
-        "-D WIN32",
-        "-DNDEBUG",
-        "-D USE_WIN10_ICU",],
+        "-DNDEBUG",],
+        if target_os == "windows" {vec![
+            "-D _WINDOWS",
+            "-D WIN32",
+            "-D USE_WIN10_ICU",
+        ]} else {vec![]},
         if target_os == "windows" && target_arch == "x86_64" {vec![
         "-D _CRT_NONSTDC_NO_DEPRECATE",
         "-D _CRT_NONSTDC_NO_WARNINGS",
@@ -39,7 +125,14 @@ fn main() -> miette::Result<()>  {
         "-D _SCL_SECURE_NO_WARNINGS",
         ]} else if target_os == "windows" && target_arch == "aarch64" {vec![
             "-D _CRT_USE_BUILTIN_OFFSETOF",
-        ]} else {vec![]}
+        ]} else {vec![]},
+        if native_instrumentation {vec![]} else {vec![
+            "-D SNAPIT_NATIVE_INSTRUMENTATION=0",
+        ]},
+        if concurrent_gc {vec![
+            "-D HERMESVM_ALLOW_CONCURRENT_GC",
+        ]} else {vec![]},
+        profiler_defines.clone(),
         //"-fms-runtime-lib=dll",
     ].concat()))
     .build()?;
@@ -47,18 +140,28 @@ fn main() -> miette::Result<()>  {
         .flag_if_supported("-DHERMESVM_HEAP_SEGMENT_SIZE_KB=4096")
         .flag_if_supported("-DHERMESVM_GC_HADES")
         .flag_if_supported("-DHERMESVM_ALLOW_COMPRESSED_POINTERS")
-        .flag_if_supported("-DHERMESVM_ALLOW_CONCURRENT_GC")
         //.flag_if_supported("-DHERMESVM_ALLOW_CONTIGUOUS_HEAP")
         .flag_if_supported("-DHERMESVM_ALLOW_INLINE_ASM")
         .flag_if_supported("-DHERMES_ENABLE_DEBUGGER")
         //.flag_if_supported("-DHERMES_LLVM")
         .flag_if_supported("-DHERMES_MEMORY_INSTRUMENTATION")
         .flag_if_supported("-DHERMES_RELEASE_VERSION=\"0.12.0\"")
-        .flag_if_supported("/D_WINDOWS")
-        .flag_if_supported("/DWIN32")
-        .flag_if_supported("/std:c++17")
-        .flag_if_supported("/DNDEBUG")
-        .flag_if_supported("-DUSE_WIN10_ICU");
+        .flag_if_supported("-DNDEBUG");
+    if target_os == "windows" {
+        b
+            .flag_if_supported("/D_WINDOWS")
+            .flag_if_supported("/DWIN32")
+            .flag_if_supported("/std:c++17")
+            .flag_if_supported("/DNDEBUG")
+            .flag_if_supported("-DUSE_WIN10_ICU");
+    } else {
+        b
+            .flag("-std=c++17")
+            // Hermes' static libs are built without RTTI, classes derived
+            // from its classes would otherwise need typeinfo it doesn't have
+            .flag_if_supported("-fno-rtti")
+            .flag_if_supported("-Wno-unused-parameter");
+    }
     if target_os == "windows" && target_arch == "aarch64" {
         b
             .flag_if_supported("-D_CRT_USE_BUILTIN_OFFSETOF");
@@ -72,8 +175,38 @@ fn main() -> miette::Result<()>  {
             .flag_if_supported("-D_SCL_SECURE_NO_DEPRECATE")
             .flag_if_supported("-D_SCL_SECURE_NO_WARNINGS");
     }
+    if !native_instrumentation {
+        b.define("SNAPIT_NATIVE_INSTRUMENTATION", "0");
+    }
+    if concurrent_gc {
+        b.define("HERMESVM_ALLOW_CONCURRENT_GC", None);
+    }
+    for define in &profiler_defines {
+        b.flag_if_supported(define);
+    }
+    if let Some(flag) = lto_flag(&b.get_compiler()) {
+        b.flag(flag);
+    }
     b
         .file("src/wrapper.cpp")
+        .file("src/event_loop.cpp")
+        .file("src/binding_table.cpp")
+        .file("src/string_bridge.cpp")
+        .file("src/array_buffer.cpp")
+        .file("src/runtime_pool.cpp")
+        .file("src/zygote.cpp")
+        .file("src/compile_service.cpp")
+        .file("src/module_loader.cpp")
+        .file("src/bundle.cpp")
+        .file("src/native_stats.cpp")
+        .file("src/metrics.cpp")
+        .file("src/memory_budget.cpp")
+        .file("src/heap_snapshot.cpp")
+        .file("src/watchdog.cpp")
+        .file("src/async_native.cpp")
+        .file("src/object_shape.cpp")
+        .file("src/pending_promises.cpp")
+        .file("src/unix_socket.cpp")
         .compile("snapitjs");
 
     println!("cargo:rustc-link-lib=hermesAST");
@@ -97,20 +230,66 @@ fn main() -> miette::Result<()>  {
     println!("cargo:rustc-link-lib=LLVHSupport");
     println!("cargo:rustc-link-lib=LLVHDemangle");
 
-    println!("cargo:rustc-link-lib=icuuc");
-    println!("cargo:rustc-link-lib=icuin");
-    println!("cargo:rustc-link-lib=user32");
-    println!("cargo:rustc-link-lib=gdi32");
-    println!("cargo:rustc-link-lib=winspool");
-    println!("cargo:rustc-link-lib=shell32");
-    println!("cargo:rustc-link-lib=ole32");
-    println!("cargo:rustc-link-lib=oleaut32");
-    println!("cargo:rustc-link-lib=uuid");
-    println!("cargo:rustc-link-lib=comdlg32");
-    println!("cargo:rustc-link-lib=advapi32");
+    if target_os == "windows" {
+        println!("cargo:rustc-link-lib=icuuc");
+        println!("cargo:rustc-link-lib=icuin");
+        println!("cargo:rustc-link-lib=user32");
+        println!("cargo:rustc-link-lib=gdi32");
+        println!("cargo:rustc-link-lib=winspool");
+        println!("cargo:rustc-link-lib=shell32");
+        println!("cargo:rustc-link-lib=ole32");
+        println!("cargo:rustc-link-lib=oleaut32");
+        println!("cargo:rustc-link-lib=uuid");
+        println!("cargo:rustc-link-lib=comdlg32");
+        println!("cargo:rustc-link-lib=advapi32");
+    } else {
+        // the system ICU, which hermesPlatformUnicode is built against on Linux
+        println!("cargo:rustc-link-lib=icui18n");
+        println!("cargo:rustc-link-lib=icuuc");
+        println!("cargo:rustc-link-lib=icudata");
+        println!("cargo:rustc-link-lib=pthread");
+        println!("cargo:rustc-link-lib=dl");
+        println!("cargo:rustc-link-lib=m");
+    }
 
     println!("cargo:rerun-if-changed=src/main.rs");
     println!("cargo:rerun-if-changed=src/wrapper.hpp");
     println!("cargo:rerun-if-changed=src/wrapper.cpp");
+    println!("cargo:rerun-if-changed=src/event_loop.hpp");
+    println!("cargo:rerun-if-changed=src/event_loop.cpp");
+    println!("cargo:rerun-if-changed=src/binding_table.hpp");
+    println!("cargo:rerun-if-changed=src/binding_table.cpp");
+    println!("cargo:rerun-if-changed=src/string_bridge.hpp");
+    println!("cargo:rerun-if-changed=src/string_bridge.cpp");
+    println!("cargo:rerun-if-changed=src/array_buffer.hpp");
+    println!("cargo:rerun-if-changed=src/array_buffer.cpp");
+    println!("cargo:rerun-if-changed=src/runtime_pool.hpp");
+    println!("cargo:rerun-if-changed=src/runtime_pool.cpp");
+    println!("cargo:rerun-if-changed=src/zygote.hpp");
+    println!("cargo:rerun-if-changed=src/zygote.cpp");
+    println!("cargo:rerun-if-changed=src/compile_service.hpp");
+    println!("cargo:rerun-if-changed=src/compile_service.cpp");
+    println!("cargo:rerun-if-changed=src/module_loader.hpp");
+    println!("cargo:rerun-if-changed=src/module_loader.cpp");
+    println!("cargo:rerun-if-changed=src/bundle.hpp");
+    println!("cargo:rerun-if-changed=src/bundle.cpp");
+    println!("cargo:rerun-if-changed=src/native_stats.hpp");
+    println!("cargo:rerun-if-changed=src/native_stats.cpp");
+    println!("cargo:rerun-if-changed=src/metrics.hpp");
+    println!("cargo:rerun-if-changed=src/metrics.cpp");
+    println!("cargo:rerun-if-changed=src/memory_budget.hpp");
+    println!("cargo:rerun-if-changed=src/memory_budget.cpp");
+    println!("cargo:rerun-if-changed=src/heap_snapshot.hpp");
+    println!("cargo:rerun-if-changed=src/heap_snapshot.cpp");
+    println!("cargo:rerun-if-changed=src/watchdog.hpp");
+    println!("cargo:rerun-if-changed=src/watchdog.cpp");
+    println!("cargo:rerun-if-changed=src/async_native.hpp");
+    println!("cargo:rerun-if-changed=src/async_native.cpp");
+    println!("cargo:rerun-if-changed=src/object_shape.hpp");
+    println!("cargo:rerun-if-changed=src/object_shape.cpp");
+    println!("cargo:rerun-if-changed=src/pending_promises.hpp");
+    println!("cargo:rerun-if-changed=src/pending_promises.cpp");
+    println!("cargo:rerun-if-changed=src/unix_socket.hpp");
+    println!("cargo:rerun-if-changed=src/unix_socket.cpp");
     Ok(())
 }
@@ -0,0 +1,96 @@
+#include "array_buffer.hpp"
+
+hermes::vm::CallResult<hermes::vm::HermesValue> createExternalArrayBuffer(
+  hermes::vm::Runtime& runtime,
+  uint8_t* data,
+  size_t length,
+  void* context,
+  ExternalBufferFinalizer finalize
+) {
+  using namespace hermes;
+  auto buffer = runtime.makeHandle(vm::JSArrayBuffer::create(
+      runtime, vm::Handle<vm::JSObject>::vmcast(&runtime.arrayBufferPrototype)));
+  // the finalizer is owned by the buffer from here on, so if this fails it
+  // still runs when the buffer is collected
+  if (LLVM_UNLIKELY(
+          vm::JSArrayBuffer::setExternalDataBlock(
+              runtime, buffer, data, length, context, finalize) ==
+          vm::ExecutionStatus::EXCEPTION)) {
+    return vm::ExecutionStatus::EXCEPTION;
+  }
+  return buffer.getHermesValue();
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> createExternalUint8Array(
+  hermes::vm::Runtime& runtime,
+  uint8_t* data,
+  size_t length,
+  void* context,
+  ExternalBufferFinalizer finalize
+) {
+  using namespace hermes;
+  vm::GCScopeMarkerRAII marker{runtime};
+  auto buffer = createExternalArrayBuffer(runtime, data, length, context, finalize);
+  if (LLVM_UNLIKELY(buffer == vm::ExecutionStatus::EXCEPTION)) {
+    return vm::ExecutionStatus::EXCEPTION;
+  }
+  auto bufferHandle = runtime.makeHandle(vm::vmcast<vm::JSArrayBuffer>(*buffer));
+  auto array = runtime.makeHandle(vm::Uint8Array::create(
+      runtime, vm::Handle<vm::JSObject>::vmcast(&runtime.Uint8ArrayPrototype)));
+  vm::JSTypedArrayBase::setBuffer(
+      runtime, array.get(), bufferHandle.get(), 0, length, sizeof(uint8_t));
+  return array.getHermesValue();
+}
+
+bool getBufferBytes(
+  hermes::vm::Runtime& runtime,
+  hermes::vm::HermesValue value,
+  ByteSpan& bytes
+) {
+  using namespace hermes;
+  if (auto* buffer = vm::dyn_vmcast<vm::JSArrayBuffer>(value)) {
+    if (!buffer->attached()) {
+      return false;
+    }
+    bytes = ByteSpan{buffer->getDataBlock(runtime), buffer->size()};
+    return true;
+  }
+  if (auto* array = vm::dyn_vmcast<vm::JSTypedArrayBase>(value)) {
+    if (!array->attached(runtime)) {
+      return false;
+    }
+    bytes = ByteSpan{array->begin(runtime), array->getByteLength()};
+    return true;
+  }
+  return false;
+}
+
+extern "C" {
+bool snapit_external_array_buffer(hermes::vm::Runtime* runtime, uint8_t* data, size_t length, void* context, ExternalBufferFinalizer finalize, uint64_t* value) {
+  auto buffer = createExternalArrayBuffer(*runtime, data, length, context, finalize);
+  if (LLVM_UNLIKELY(buffer == hermes::vm::ExecutionStatus::EXCEPTION)) {
+    return false;
+  }
+  *value = buffer->getRaw();
+  return true;
+}
+
+bool snapit_external_uint8_array(hermes::vm::Runtime* runtime, uint8_t* data, size_t length, void* context, ExternalBufferFinalizer finalize, uint64_t* value) {
+  auto array = createExternalUint8Array(*runtime, data, length, context, finalize);
+  if (LLVM_UNLIKELY(array == hermes::vm::ExecutionStatus::EXCEPTION)) {
+    return false;
+  }
+  *value = array->getRaw();
+  return true;
+}
+
+bool snapit_buffer_bytes(hermes::vm::Runtime* runtime, uint64_t value, uint8_t** data, size_t* length) {
+  ByteSpan bytes{nullptr, 0};
+  if (!getBufferBytes(*runtime, hermes::vm::HermesValue::fromRaw(value), bytes)) {
+    return false;
+  }
+  *data = bytes.data;
+  *length = bytes.length;
+  return true;
+}
+}
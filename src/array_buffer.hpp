@@ -0,0 +1,65 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+#include "hermes/VM/JSArrayBuffer.h"
+#include "hermes/VM/JSTypedArray.h"
+
+#include "wrapper.hpp"
+
+// Called with the context once the buffer it was given to is collected or
+// its runtime is destroyed. This is where the host gets the memory back.
+typedef void (*ExternalBufferFinalizer)(void* context);
+
+// Wraps memory the host owns in an ArrayBuffer without copying it. The
+// memory has to stay valid and fixed until finalize is called, which always
+// happens exactly once, even if creating the buffer fails.
+hermes::vm::CallResult<hermes::vm::HermesValue> createExternalArrayBuffer(
+    hermes::vm::Runtime& runtime,
+    uint8_t* data,
+    size_t length,
+    void* context,
+    ExternalBufferFinalizer finalize
+);
+
+// same as createExternalArrayBuffer but returns a Uint8Array over all of it
+hermes::vm::CallResult<hermes::vm::HermesValue> createExternalUint8Array(
+    hermes::vm::Runtime& runtime,
+    uint8_t* data,
+    size_t length,
+    void* context,
+    ExternalBufferFinalizer finalize
+);
+
+// The bytes behind an ArrayBuffer or typed array. Backing stores live outside
+// the GC heap, so data stays valid until the buffer is detached or collected.
+struct ByteSpan {
+    uint8_t* data;
+    size_t length;
+};
+
+// returns false if value isn't an ArrayBuffer or typed array, or is detached
+bool getBufferBytes(hermes::vm::Runtime& runtime, hermes::vm::HermesValue value, ByteSpan& bytes);
+
+// lets typed native functions take buffers
+template<>
+struct TypedArg<ByteSpan> {
+    static constexpr const char* expected = "an ArrayBuffer or typed array";
+    static bool check(hermes::vm::HermesValue value) {
+        return hermes::vm::vmisa<hermes::vm::JSArrayBuffer>(value) ||
+            hermes::vm::vmisa<hermes::vm::JSTypedArrayBase>(value);
+    }
+    static ByteSpan get(hermes::vm::Runtime& runtime, hermes::vm::NativeArgs& args, unsigned index) {
+        // detached buffers are empty
+        ByteSpan bytes{nullptr, 0};
+        getBufferBytes(runtime, args.getArg(index), bytes);
+        return bytes;
+    }
+};
+
+extern "C" {
+// return false if an exception was raised, otherwise value is the new object
+bool snapit_external_array_buffer(hermes::vm::Runtime* runtime, uint8_t* data, size_t length, void* context, ExternalBufferFinalizer finalize, uint64_t* value);
+bool snapit_external_uint8_array(hermes::vm::Runtime* runtime, uint8_t* data, size_t length, void* context, ExternalBufferFinalizer finalize, uint64_t* value);
+bool snapit_buffer_bytes(hermes::vm::Runtime* runtime, uint64_t value, uint8_t** data, size_t* length);
+}
@@ -0,0 +1,262 @@
+#include "async_native.hpp"
+
+#include "event_loop.hpp"
+#include "object_shape.hpp"
+#include "string_bridge.hpp"
+
+struct AsyncNativeCalls::Queue {
+  std::mutex mutex;
+  // both null once the AsyncNativeCalls is gone
+  AsyncNativeCalls* calls;
+  EventLoop* eventLoop;
+  std::vector<std::unique_ptr<AsyncCompletion>> done;
+};
+
+struct AsyncCompletion {
+  enum class Kind : uint8_t {
+    Undefined,
+    Number,
+    Bool,
+    String,
+    Bytes,
+    Error,
+  };
+
+  std::shared_ptr<AsyncNativeCalls::Queue> queue;
+  uint32_t id;
+  Kind kind = Kind::Undefined;
+  double number = 0.0;
+  bool flag = false;
+  // the string or the error message
+  std::string text;
+  uint8_t* data = nullptr;
+  size_t length = 0;
+  void* context = nullptr;
+  // cleared once the bytes are handed to an ArrayBuffer
+  ExternalBufferFinalizer finalize = nullptr;
+
+  ~AsyncCompletion() {
+    if (finalize) {
+      finalize(context);
+    }
+  }
+};
+
+namespace {
+std::mutex registryMutex;
+std::unordered_map<hermes::vm::Runtime*, AsyncNativeCalls*> registry;
+} // namespace
+
+AsyncNativeCalls::AsyncNativeCalls(hermes::vm::Runtime& _runtime, EventLoop& eventLoop):
+  runtime(_runtime),
+  queue(std::make_shared<Queue>()),
+  promises(_runtime)
+{
+  queue->calls = this;
+  queue->eventLoop = &eventLoop;
+  std::lock_guard<std::mutex> lock(registryMutex);
+  registry[&runtime] = this;
+}
+
+AsyncNativeCalls::~AsyncNativeCalls() {
+  {
+    // another runtime may have been created at the same address once this
+    // one was freed, its entry isn't ours
+    std::lock_guard<std::mutex> lock(registryMutex);
+    auto found = registry.find(&runtime);
+    if (found != registry.end() && found->second == this) {
+      registry.erase(found);
+    }
+  }
+  std::vector<std::unique_ptr<AsyncCompletion>> done;
+  {
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    queue->calls = nullptr;
+    queue->eventLoop = nullptr;
+    done.swap(queue->done);
+  }
+}
+
+AsyncNativeCalls* AsyncNativeCalls::forRuntime(hermes::vm::Runtime& runtime) {
+  std::lock_guard<std::mutex> lock(registryMutex);
+  auto found = registry.find(&runtime);
+  return found == registry.end() ? nullptr : found->second;
+}
+
+void AsyncNativeCalls::deliver(AsyncCompletion* raw) {
+  // destroyed after the lock is released, the finalizer can take a while
+  std::unique_ptr<AsyncCompletion> completion{raw};
+  std::shared_ptr<Queue> queue = completion->queue;
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  if (!queue->eventLoop) {
+    return;
+  }
+  const bool first = queue->done.empty();
+  queue->done.push_back(std::move(completion));
+  if (first) {
+    postDrain(queue);
+  }
+  queue->eventLoop->unref();
+}
+
+void AsyncNativeCalls::postDrain(const std::shared_ptr<Queue>& queue) {
+  queue->eventLoop->postHostTask(
+      [queue](hermes::vm::Runtime&) {
+        AsyncNativeCalls* calls;
+        {
+          std::lock_guard<std::mutex> lock(queue->mutex);
+          calls = queue->calls;
+        }
+        return calls ? calls->settleAll() : hermes::vm::ExecutionStatus::RETURNED;
+      });
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> AsyncNativeCalls::start(AsyncCompletion*& completion) {
+  uint32_t id;
+  auto promise = promises.create(id);
+  if (LLVM_UNLIKELY(promise == hermes::vm::ExecutionStatus::EXCEPTION)) {
+    return hermes::vm::ExecutionStatus::EXCEPTION;
+  }
+  completion = new AsyncCompletion();
+  completion->queue = queue;
+  completion->id = id;
+  queue->eventLoop->ref();
+  return promise;
+}
+
+void AsyncNativeCalls::cancel(AsyncCompletion* completion) {
+  promises.drop(completion->id);
+  delete completion;
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  queue->eventLoop->unref();
+}
+
+hermes::vm::ExecutionStatus AsyncNativeCalls::settleAll() {
+  std::vector<std::unique_ptr<AsyncCompletion>> done;
+  {
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    done.swap(queue->done);
+  }
+  for (size_t i = 0; i < done.size(); ++i) {
+    if (settle(std::move(done[i])) == hermes::vm::ExecutionStatus::RETURNED) {
+      continue;
+    }
+    // one exception per task, the rest are settled in the next one
+    if (i + 1 < done.size()) {
+      std::lock_guard<std::mutex> lock(queue->mutex);
+      const bool first = queue->done.empty();
+      queue->done.insert(
+          queue->done.begin(),
+          std::make_move_iterator(done.begin() + i + 1),
+          std::make_move_iterator(done.end()));
+      if (first) {
+        postDrain(queue);
+      }
+    }
+    return hermes::vm::ExecutionStatus::EXCEPTION;
+  }
+  return hermes::vm::ExecutionStatus::RETURNED;
+}
+
+hermes::vm::ExecutionStatus AsyncNativeCalls::settle(std::unique_ptr<AsyncCompletion> completion) {
+  using namespace hermes;
+  vm::GCScope scope(runtime);
+  vm::CallResult<vm::HermesValue> value{vm::HermesValue::encodeUndefinedValue()};
+  switch (completion->kind) {
+    case AsyncCompletion::Kind::Undefined:
+      break;
+    case AsyncCompletion::Kind::Number:
+      value = vm::HermesValue::encodeUntrustedNumberValue(completion->number);
+      break;
+    case AsyncCompletion::Kind::Bool:
+      value = vm::HermesValue::encodeBoolValue(completion->flag);
+      break;
+    case AsyncCompletion::Kind::String:
+      value = createStringFromUTF8(runtime, completion->text.data(), completion->text.size());
+      break;
+    case AsyncCompletion::Kind::Bytes: {
+      // the buffer owns the bytes from here on, even if it can't be created
+      ExternalBufferFinalizer finalize = completion->finalize;
+      completion->finalize = nullptr;
+      value = createExternalArrayBuffer(
+          runtime, completion->data, completion->length, completion->context, finalize);
+      break;
+    }
+    case AsyncCompletion::Kind::Error:
+      value = runtime.raiseError(vm::TwineChar16(utf8ToUTF16String(completion->text).c_str()));
+      break;
+  }
+  return promises.settle(completion->id, value);
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> callAsyncFunctionContext(void *context, hermes::vm::Runtime &runtime, hermes::vm::NativeArgs args)
+{
+  const RuntimeFunctionContext& runtimeContext =
+      *static_cast<const RuntimeFunctionContext*>(context);
+  const AsyncFunctionContext& functionContext =
+      *static_cast<const AsyncFunctionContext*>(runtimeContext.function);
+  NativeCallScope scope{functionContext.getStats(), runtime};
+  AsyncNativeCalls* calls = runtimeContext.asyncCalls;
+  if (!calls) {
+    return runtime.raiseTypeError("async native functions need an event loop");
+  }
+  ObjectShapes::CallScope shapes{runtimeContext.objectShapes};
+  hermes::vm::GCScope gcScope(runtime);
+  AsyncCompletion* completion = nullptr;
+  auto promise = calls->start(completion);
+  if (LLVM_UNLIKELY(promise == hermes::vm::ExecutionStatus::EXCEPTION)) {
+    return hermes::vm::ExecutionStatus::EXCEPTION;
+  }
+  auto promiseHandle = runtime.makeHandle(*promise);
+  NativeCallResult result = functionContext.call(runtime, args, completion);
+  if (LLVM_UNLIKELY(result.status == NativeCallStatus::Exception)) {
+    calls->cancel(completion);
+    return hermes::vm::ExecutionStatus::EXCEPTION;
+  }
+  return promiseHandle.getHermesValue();
+}
+
+extern "C" {
+void snapit_async_resolve_undefined(AsyncCompletion* completion) {
+  AsyncNativeCalls::deliver(completion);
+}
+
+void snapit_async_resolve_number(AsyncCompletion* completion, double number) {
+  completion->kind = AsyncCompletion::Kind::Number;
+  completion->number = number;
+  AsyncNativeCalls::deliver(completion);
+}
+
+void snapit_async_resolve_bool(AsyncCompletion* completion, bool value) {
+  completion->kind = AsyncCompletion::Kind::Bool;
+  completion->flag = value;
+  AsyncNativeCalls::deliver(completion);
+}
+
+void snapit_async_resolve_string(AsyncCompletion* completion, const char* chars, size_t length) {
+  completion->kind = AsyncCompletion::Kind::String;
+  completion->text.assign(chars, length);
+  AsyncNativeCalls::deliver(completion);
+}
+
+void snapit_async_resolve_bytes(
+  AsyncCompletion* completion,
+  uint8_t* data,
+  size_t length,
+  void* context,
+  ExternalBufferFinalizer finalize
+) {
+  completion->kind = AsyncCompletion::Kind::Bytes;
+  completion->data = data;
+  completion->length = length;
+  completion->context = context;
+  completion->finalize = finalize;
+  AsyncNativeCalls::deliver(completion);
+}
+
+void snapit_async_reject(AsyncCompletion* completion, const char* message, size_t length) {
+  completion->kind = AsyncCompletion::Kind::Error;
+  completion->text.assign(message, length);
+  AsyncNativeCalls::deliver(completion);
+}
+}
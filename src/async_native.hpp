@@ -0,0 +1,129 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "array_buffer.hpp"
+#include "pending_promises.hpp"
+#include "wrapper.hpp"
+
+class EventLoop;
+struct AsyncCompletion;
+
+extern "C" {
+// A native function that returns a promise and finishes its work on another
+// thread. It runs on the JS thread like a FastNativeFunction, reads what it
+// needs out of args, hands the work and completion off and returns. Whatever
+// thread finishes the work settles completion exactly once with one of the
+// snapit_async_* functions below, which also frees it.
+// If it raises an exception instead, it must not have handed completion off,
+// the caller frees it. The value it returns is ignored.
+typedef NativeCallResult (*AsyncNativeFunction)(
+    void* userData,
+    hermes::vm::Runtime* runtime,
+    const hermes::vm::NativeArgs* args,
+    AsyncCompletion* completion
+);
+
+// Any thread. Settling after the runtime is gone does nothing.
+void snapit_async_resolve_undefined(AsyncCompletion* completion);
+void snapit_async_resolve_number(AsyncCompletion* completion, double number);
+void snapit_async_resolve_bool(AsyncCompletion* completion, bool value);
+// chars is UTF-8 and copied
+void snapit_async_resolve_string(AsyncCompletion* completion, const char* chars, size_t length);
+// Resolves with an ArrayBuffer over data without copying it, see
+// createExternalArrayBuffer. finalize is called exactly once, also if the
+// runtime is gone.
+void snapit_async_resolve_bytes(
+    AsyncCompletion* completion,
+    uint8_t* data,
+    size_t length,
+    void* context,
+    ExternalBufferFinalizer finalize);
+// rejects with an Error, message is UTF-8
+void snapit_async_reject(AsyncCompletion* completion, const char* message, size_t length);
+}
+
+// Has to outlive every function defined with it.
+class AsyncFunctionContext {
+public:
+    // function is an AsyncNativeFunction, passed as void* like in
+    // FastFunctionContext
+    AsyncFunctionContext(void* _function, void* _userData):
+        function(reinterpret_cast<AsyncNativeFunction>(_function)),
+        userData(_userData)
+    {}
+
+    inline NativeCallResult call(
+        hermes::vm::Runtime& runtime,
+        const hermes::vm::NativeArgs& args,
+        AsyncCompletion* completion
+    ) const {
+        return function(userData, &runtime, &args, completion);
+    }
+
+    // see FastFunctionContext
+    NativeCallStats* getStats() const { return stats.load(std::memory_order_acquire); }
+    void setStats(NativeCallStats* _stats) const {
+        NativeCallStats* unset = nullptr;
+        stats.compare_exchange_strong(unset, _stats, std::memory_order_acq_rel);
+    }
+
+private:
+    AsyncNativeFunction function;
+    void* userData;
+    mutable std::atomic<NativeCallStats*> stats{nullptr};
+};
+
+// The promises of one runtime's async native calls.
+// Every call holds a ref on the event loop until it's settled, so run() and
+// awaitResult() wait for it. Completions from other threads go into one
+// queue, and a single host task drains everything that has arrived by the
+// time it runs, so a burst of completions costs one task and one microtask
+// checkpoint instead of one each.
+// BindingTable hands it to the natives of its runtime through their context,
+// and finds it by runtime to do that, so there's at most one per runtime.
+class AsyncNativeCalls {
+public:
+    AsyncNativeCalls(hermes::vm::Runtime& runtime, EventLoop& eventLoop);
+    AsyncNativeCalls(const AsyncNativeCalls&) = delete;
+    AsyncNativeCalls& operator=(const AsyncNativeCalls&) = delete;
+    // calls still running are settled into nothing
+    ~AsyncNativeCalls();
+
+    // null if the runtime has none
+    static AsyncNativeCalls* forRuntime(hermes::vm::Runtime& runtime);
+
+    // JS thread, creates the promise and the completion for one call
+    hermes::vm::CallResult<hermes::vm::HermesValue> start(AsyncCompletion*& completion);
+    // JS thread, for a call that threw before handing completion off
+    void cancel(AsyncCompletion* completion);
+
+    // Any thread, takes ownership of completion. What the snapit_async_*
+    // functions end in.
+    static void deliver(AsyncCompletion* completion);
+
+    // shared with the completions, which can outlive this
+    struct Queue;
+
+private:
+    // Posts the host task that settles the queue. Needs the queue's lock, and
+    // only whoever makes the queue non-empty posts one.
+    static void postDrain(const std::shared_ptr<Queue>& queue);
+    // the host task, settles every completion in the queue
+    hermes::vm::ExecutionStatus settleAll();
+    hermes::vm::ExecutionStatus settle(std::unique_ptr<AsyncCompletion> completion);
+
+    hermes::vm::Runtime& runtime;
+    std::shared_ptr<Queue> queue;
+    // by the completions' ids
+    PendingPromises promises;
+};
+
+// context is a RuntimeFunctionContext around an AsyncFunctionContext
+hermes::vm::CallResult<hermes::vm::HermesValue> callAsyncFunctionContext(void *context, hermes::vm::Runtime &runtime, hermes::vm::NativeArgs args);
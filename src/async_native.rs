@@ -0,0 +1,246 @@
+// Async native functions, see AsyncNativeFunction in async_native.hpp. The
+// JS thread decodes the arguments and gets a promise back right away, the
+// work runs on a shared pool of host threads and settles the promise through
+// a Completion once it's done.
+
+use autocxx::c_void;
+use std::panic::{self, AssertUnwindSafe};
+use std::sync::mpsc;
+use std::sync::{Arc, Mutex};
+use std::thread;
+
+use crate::native::{NativeArgs, NativeCallResult, Runtime};
+
+pub type AsyncNativeFunction = extern "C" fn(
+    user_data: *mut c_void,
+    runtime: *mut Runtime,
+    args: *const NativeArgs,
+    completion: *mut c_void,
+) -> NativeCallResult;
+
+extern "C" {
+    fn snapit_async_resolve_undefined(completion: *mut c_void);
+    fn snapit_async_resolve_number(completion: *mut c_void, number: f64);
+    fn snapit_async_resolve_bool(completion: *mut c_void, value: bool);
+    fn snapit_async_resolve_string(completion: *mut c_void, chars: *const u8, length: usize);
+    fn snapit_async_resolve_bytes(
+        completion: *mut c_void,
+        data: *mut u8,
+        length: usize,
+        context: *mut c_void,
+        finalize: extern "C" fn(*mut c_void),
+    );
+    fn snapit_async_reject(completion: *mut c_void, message: *const u8, length: usize);
+}
+
+// The promise of one call. It can be sent to any thread and settles exactly
+// once: dropping it without settling rejects the promise, so a panic in the
+// work doesn't leave it pending and the event loop waiting forever.
+pub struct Completion {
+    raw: *mut c_void,
+}
+
+// the C++ side locks around everything it shares
+unsafe impl Send for Completion {}
+
+impl Completion {
+    // raw has to be the completion an AsyncNativeFunction was called with,
+    // and the function must not raise an exception once this exists
+    pub unsafe fn from_raw(raw: *mut c_void) -> Completion {
+        Completion { raw: raw }
+    }
+
+    pub fn resolve<T: AsyncResult>(self, value: T) {
+        value.settle(self.take());
+    }
+
+    // rejects with an Error
+    pub fn reject(self, message: &str) {
+        let raw = self.take();
+        unsafe { snapit_async_reject(raw, message.as_ptr(), message.len()) }
+    }
+
+    fn take(self) -> *mut c_void {
+        let raw = self.raw;
+        std::mem::forget(self);
+        raw
+    }
+}
+
+impl Drop for Completion {
+    fn drop(&mut self) {
+        let message = "the async native function never settled its promise";
+        unsafe { snapit_async_reject(self.raw, message.as_ptr(), message.len()) }
+    }
+}
+
+// What the work of an async native function can resolve with
+pub trait AsyncResult: Send + 'static {
+    fn settle(self, completion: *mut c_void);
+}
+
+impl AsyncResult for () {
+    fn settle(self, completion: *mut c_void) {
+        unsafe { snapit_async_resolve_undefined(completion) }
+    }
+}
+
+impl AsyncResult for f64 {
+    fn settle(self, completion: *mut c_void) {
+        unsafe { snapit_async_resolve_number(completion, self) }
+    }
+}
+
+impl AsyncResult for bool {
+    fn settle(self, completion: *mut c_void) {
+        unsafe { snapit_async_resolve_bool(completion, self) }
+    }
+}
+
+impl AsyncResult for String {
+    fn settle(self, completion: *mut c_void) {
+        unsafe { snapit_async_resolve_string(completion, self.as_ptr(), self.len()) }
+    }
+}
+
+extern "C" fn drop_bytes(context: *mut c_void) {
+    unsafe { drop(Box::from_raw(context as *mut Vec<u8>)) }
+}
+
+// an ArrayBuffer over the bytes, without copying them
+impl AsyncResult for Vec<u8> {
+    fn settle(self, completion: *mut c_void) {
+        let mut owner = Box::new(self);
+        let (data, length) = (owner.as_mut_ptr(), owner.len());
+        let context = Box::into_raw(owner) as *mut c_void;
+        unsafe { snapit_async_resolve_bytes(completion, data, length, context, drop_bytes) }
+    }
+}
+
+// an error rejects with its message
+impl<T: AsyncResult> AsyncResult for Result<T, String> {
+    fn settle(self, completion: *mut c_void) {
+        match self {
+            Ok(value) => value.settle(completion),
+            Err(message) => unsafe { snapit_async_reject(completion, message.as_ptr(), message.len()) },
+        }
+    }
+}
+
+type Job = Box<dyn FnOnce() + Send + 'static>;
+
+// Worker threads that run the work of every async native function in the
+// process. Sized to the machine unless SNAPIT_ASYNC_THREADS says otherwise,
+// and started on first use.
+struct HostPool {
+    sender: mpsc::Sender<Job>,
+    // threads don't survive fork, a zygote child starts its own pool
+    pid: u32,
+}
+
+impl HostPool {
+    fn new() -> HostPool {
+        let threads = std::env::var("SNAPIT_ASYNC_THREADS").ok()
+            .and_then(|value| value.parse::<usize>().ok())
+            .filter(|&threads| threads > 0)
+            .unwrap_or_else(|| thread::available_parallelism().map_or(4, |threads| threads.get()));
+        let (sender, receiver) = mpsc::channel::<Job>();
+        let receiver = Arc::new(Mutex::new(receiver));
+        for index in 0..threads {
+            let receiver = Arc::clone(&receiver);
+            thread::Builder::new()
+                .name(format!("snapit-async-{}", index))
+                .spawn(move || loop {
+                    let job = match receiver.lock().unwrap().recv() {
+                        Ok(job) => job,
+                        Err(_) => return,
+                    };
+                    // a panic drops the job's Completion, which rejects its
+                    // promise, and the thread carries on
+                    let _ = panic::catch_unwind(AssertUnwindSafe(job));
+                })
+                .expect("failed to start an async native thread");
+        }
+        HostPool { sender: sender, pid: std::process::id() }
+    }
+}
+
+static POOL: Mutex<Option<HostPool>> = Mutex::new(None);
+
+// runs work on the host pool
+pub fn spawn<F: FnOnce() + Send + 'static>(work: F) {
+    let mut pool = POOL.lock().unwrap();
+    if pool.as_ref().map_or(true, |pool| pool.pid != std::process::id()) {
+        // a pool from before a fork has no threads left, it's leaked rather
+        // than dropped
+        std::mem::forget(pool.take());
+        *pool = Some(HostPool::new());
+    }
+    pool.as_ref().unwrap().sender.send(Box::new(work)).expect("async native threads stopped");
+}
+
+// Declares an async native function. The arguments are decoded like in
+// typed_native!, then the body runs on the JS thread, where it can still
+// read them, and returns the work as a closure that runs on the host pool.
+// The work can't borrow the arguments, copy what it needs like below.
+// Whatever the closure returns settles the promise through AsyncResult:
+//   async_native! {
+//       fn read_file_async(path: JsStr) -> Result<Vec<u8>, String> {
+//           let path = path.to_string();
+//           move || std::fs::read(&path).map_err(|error| error.to_string())
+//       }
+//   }
+// read_file_async is then an AsyncNativeFunction for an AsyncFunctionContext.
+// An argument with the wrong type throws a TypeError instead of returning a
+// promise.
+macro_rules! async_native {
+    ($(#[$meta:meta])* fn $name:ident($($arg:ident: $type:ty),* $(,)?) -> $ret:ty $body:block) => {
+        $(#[$meta])*
+        extern "C" fn $name(
+            _user_data: *mut autocxx::c_void,
+            runtime: *mut $crate::native::Runtime,
+            args: *const $crate::native::NativeArgs,
+            completion: *mut autocxx::c_void,
+        ) -> $crate::native::NativeCallResult {
+            let args = unsafe { $crate::native::FastArgs::from_raw(args) };
+            // arguments that allocate first, see FromArg::ALLOCATES
+            let mut _index: u32 = 0;
+            $(
+                let $arg: Option<$type> = match <$type as $crate::native::FromArg>::ALLOCATES {
+                    true => match $crate::native::decode_arg::<$type>(runtime, &args, _index) {
+                        Ok(value) => Some(value),
+                        Err(error) => return error,
+                    },
+                    false => None,
+                };
+                _index += 1;
+            )*
+            let mut _index: u32 = 0;
+            $(
+                let $arg: $type = match $arg {
+                    Some(value) => value,
+                    None => match $crate::native::decode_arg::<$type>(runtime, &args, _index) {
+                        Ok(value) => value,
+                        Err(error) => return error,
+                    },
+                };
+                _index += 1;
+            )*
+            // like typed_native!, nothing borrowed from the arguments outlives
+            // the body
+            let work = (move || $body)();
+            let completion = unsafe { $crate::async_native::Completion::from_raw(completion) };
+            $crate::async_native::spawn(move || {
+                let result: $ret = work();
+                completion.resolve(result);
+            });
+            $crate::native::NativeCallResult::undefined()
+        }
+    };
+}
+pub(crate) use async_native;
+
+// AsyncFunctionContext takes the function as void*
+pub fn function_pointer(function: AsyncNativeFunction) -> *mut c_void {
+    function as *mut c_void
+}
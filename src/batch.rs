@@ -0,0 +1,168 @@
+// Batch mode: loads the bundle once and pushes newline delimited records
+// from a file or stdin through an exported handler, writing what it returns
+// as lines of output.
+// With a batch size of 1 the handler is called as handler(record). With a
+// larger one it's called as handler(records, count) where records is up to
+// that many records joined by "\n", so a call into the engine and a string
+// conversion each way are paid per batch instead of per record. Either way
+// it returns a string to write as one line, which can hold several lines, or
+// undefined to write nothing. A promise is awaited first.
+
+use core::pin::Pin;
+use std::fs::File;
+use std::io::{self, BufRead, BufReader, BufWriter, Write};
+use std::time::Instant;
+
+use autocxx::prelude::*;
+
+use crate::ffi;
+
+const BUFFER_BYTES: usize = 256 * 1024;
+
+pub struct BatchOptions {
+    pub export_name: String,
+    // None for stdin and stdout
+    pub input_path: Option<String>,
+    pub output_path: Option<String>,
+    pub batch_size: u32,
+}
+
+struct Counts {
+    records: u64,
+    calls: u64,
+    failed_records: u64,
+}
+
+// Returns false if the handler threw for any record, or if reading or
+// writing failed. The records/sec report goes to stderr.
+pub fn run(mut engine: Pin<&mut ffi::Engine>, options: &BatchOptions) -> bool {
+    let input: Box<dyn BufRead> = match &options.input_path {
+        Some(path) => match File::open(path) {
+            Ok(file) => Box::new(BufReader::with_capacity(BUFFER_BYTES, file)),
+            Err(error) => {
+                eprintln!("failed to open {}: {}", path, error);
+                return false;
+            }
+        },
+        None => Box::new(BufReader::with_capacity(BUFFER_BYTES, io::stdin())),
+    };
+    let output: Box<dyn Write> = match &options.output_path {
+        Some(path) => match File::create(path) {
+            Ok(file) => Box::new(BufWriter::with_capacity(BUFFER_BYTES, file)),
+            Err(error) => {
+                eprintln!("failed to create {}: {}", path, error);
+                return false;
+            }
+        },
+        None => Box::new(BufWriter::with_capacity(BUFFER_BYTES, io::stdout())),
+    };
+
+    let mut counts = Counts { records: 0, calls: 0, failed_records: 0 };
+    let start = Instant::now();
+    let result = process(engine.as_mut(), options, input, output, &mut counts);
+    let elapsed = start.elapsed().as_secs_f64();
+    eprintln!(
+        "batch: records={} calls={} failed={} seconds={:.3} records_per_sec={:.0}",
+        counts.records,
+        counts.calls,
+        counts.failed_records,
+        elapsed,
+        if elapsed > 0.0 { counts.records as f64 / elapsed } else { 0.0 },
+    );
+    match result {
+        Ok(()) => counts.failed_records == 0,
+        Err(error) => {
+            eprintln!("batch stopped: {}", error);
+            false
+        }
+    }
+}
+
+fn process(
+    mut engine: Pin<&mut ffi::Engine>,
+    options: &BatchOptions,
+    mut input: Box<dyn BufRead>,
+    mut output: Box<dyn Write>,
+    counts: &mut Counts,
+) -> io::Result<()> {
+    let mut args = ffi::CallArguments::new().within_unique_ptr();
+    let mut line: Vec<u8> = Vec::new();
+    // the records of the current batch, joined by "\n"
+    let mut batch = String::new();
+    let mut batched: u32 = 0;
+    loop {
+        line.clear();
+        let at_end = input.read_until(b'\n', &mut line)? == 0;
+        if !at_end {
+            while line.last().map_or(false, |&byte| byte == b'\n' || byte == b'\r') {
+                line.pop();
+            }
+            // blank lines aren't records, not even in NDJSON
+            if line.is_empty() {
+                continue;
+            }
+            if batched != 0 {
+                batch.push('\n');
+            }
+            batch.push_str(&String::from_utf8_lossy(&line));
+            batched += 1;
+            if batched < options.batch_size {
+                continue;
+            }
+        }
+        if batched != 0 {
+            args.pin_mut().clear();
+            args.pin_mut().pushString(batch.as_str());
+            if options.batch_size > 1 {
+                args.pin_mut().pushNumber(batched as f64);
+            }
+            call(engine.as_mut(), &options.export_name, &args, batched, counts, &mut output)?;
+            batch.clear();
+            batched = 0;
+        }
+        if at_end {
+            return output.flush();
+        }
+    }
+}
+
+fn call(
+    mut engine: Pin<&mut ffi::Engine>,
+    export_name: &str,
+    args: &ffi::CallArguments,
+    records: u32,
+    counts: &mut Counts,
+    output: &mut Box<dyn Write>,
+) -> io::Result<()> {
+    let first_record = counts.records + 1;
+    counts.records += records as u64;
+    counts.calls += 1;
+    let mut status = engine.as_mut().call(export_name, args);
+    if status == ffi::EngineStatus::Returned {
+        status = engine.as_mut().awaitResult();
+    }
+    match status {
+        ffi::EngineStatus::Returned => {
+            if !engine.resultIsUndefined() {
+                output.write_all(engine.as_mut().resultString().as_bytes())?;
+                output.write_all(b"\n")?;
+            }
+            Ok(())
+        }
+        ffi::EngineStatus::NotFound => {
+            Err(io::Error::new(io::ErrorKind::NotFound, format!("{} is not a function", export_name)))
+        }
+        _ => {
+            counts.failed_records += records as u64;
+            let error = match status {
+                ffi::EngineStatus::Exception => engine.as_mut().resultString().to_string_lossy().into_owned(),
+                ffi::EngineStatus::Pending => "the result never settled".to_string(),
+                ffi::EngineStatus::OutOfMemory => "out of memory".to_string(),
+                ffi::EngineStatus::TimedOut => "timed out".to_string(),
+                _ => "failed".to_string(),
+            };
+            eprintln!("records {}-{}: {}", first_record, first_record + records as u64 - 1, error);
+            Ok(())
+        }
+    }
+}
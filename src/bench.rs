@@ -0,0 +1,879 @@
+// Benchmarks for the paths we care about, run with
+// `snapitjs bench <benchmark> [arguments]`.
+// Each benchmark prints one line per measurement as space separated
+// key=value pairs so results are easy to diff between builds. The suite
+// benchmark runs a fixed set over bench/suite.js and also writes JSON, which
+// compare diffs between two runs.
+
+use std::cell::RefCell;
+use std::env;
+use std::process::Command;
+use std::rc::Rc;
+use std::thread;
+use std::time::Duration;
+use std::time::Instant;
+
+use autocxx::prelude::*;
+
+use crate::ffi;
+use crate::load_bytecode;
+use crate::make_bindings;
+use crate::make_empty_bindings;
+use crate::make_runtime_options;
+use crate::LoadMode;
+use crate::RustBindingsDefine;
+
+fn print_bench_usage(program: &str) {
+    eprintln!("Usage: {} bench <benchmark> [arguments]", program);
+    eprintln!("Benchmarks:");
+    eprintln!("  startup <input.hbc> [runs]    compare startup time and peak RSS of mmap and read loading");
+    eprintln!("  engine <input.hbc> <export> [calls]    compare a cold engine per call against one warm engine");
+    eprintln!("  presets <input.hbc> [runs] [export]    executions per second, and calls per second of export, for each preset");
+    eprintln!("  pool <input.hbc> <export> [jobs] [max_workers]    jobs per second of a runtime pool from 1 worker up to max_workers, and memory per worker");
+    eprintln!("  native-call <native_call.hbc> [calls]    calls per second of the virtual and fast native call paths, see bench/native_call.js");
+    eprintln!("  zygote <input.hbc> <export> [requests]    per request latency of a forked zygote child against a fresh process (Linux)");
+    eprintln!("  suite <suite.hbc> <output.json> [samples]    startup, binding installation, native calls, strings, objects and GC, see bench/suite.js");
+    eprintln!("  compare <baseline.json> <current.json> [threshold_percent]    diff two suite results, fails if a median got slower by more than the threshold, 5 by default");
+}
+
+pub fn run(args: &[String]) -> i32 {
+    let rest = &args[2..];
+    match rest.first().map(|name| name.as_str()) {
+        Some("startup") if rest.len() >= 2 => startup(&rest[1], parse_count(rest.get(2), 20)),
+        Some("engine") if rest.len() >= 3 => engine(&rest[1], &rest[2], parse_count(rest.get(3), 1000)),
+        Some("presets") if rest.len() >= 2 => presets(&rest[1], parse_count(rest.get(2), 50), rest.get(3)),
+        Some("pool") if rest.len() >= 3 => pool(
+            &rest[1],
+            &rest[2],
+            parse_count(rest.get(3), 10_000),
+            parse_count(rest.get(4), thread::available_parallelism().map_or(1, |count| count.get() as u32)),
+        ),
+        Some("native-call") if rest.len() >= 2 => native_call(&rest[1], parse_count(rest.get(2), 10_000_000)),
+        Some("zygote") if rest.len() >= 3 => zygote(&rest[1], &rest[2], parse_count(rest.get(3), 200)),
+        Some("suite") if rest.len() >= 3 => suite(&rest[1], &rest[2], parse_count(rest.get(3), 10)),
+        Some("compare") if rest.len() >= 3 => compare(&rest[1], &rest[2], parse_count(rest.get(3), 5)),
+        _ => {
+            print_bench_usage(&args[0]);
+            1
+        }
+    }
+}
+
+fn parse_count(arg: Option<&String>, default: u32) -> u32 {
+    arg.and_then(|count| count.parse().ok())
+        .filter(|&count| count > 0)
+        .unwrap_or(default)
+}
+
+#[derive(Default)]
+struct StartupSample {
+    load_us: u64,
+    total_us: u64,
+    peak_rss_kb: u64,
+}
+
+fn parse_startup_report(stderr: &str) -> Option<StartupSample> {
+    let line = stderr.lines().rev().find(|line| line.starts_with("startup: "))?;
+    let mut sample = StartupSample::default();
+    for field in line["startup: ".len()..].split(' ') {
+        let (key, value) = field.split_once('=')?;
+        match key {
+            "load_us" => sample.load_us = value.parse().ok()?,
+            "total_us" => sample.total_us = value.parse().ok()?,
+            "peak_rss_kb" => sample.peak_rss_kb = value.parse().ok()?,
+            _ => {}
+        }
+    }
+    Some(sample)
+}
+
+// Every run is a fresh process so that page cache sharing and RSS are
+// measured the same way they are in production.
+fn startup(input_file_path: &str, runs: u32) -> i32 {
+    let exe = env::current_exe().expect("couldn't find the current executable");
+    for mode in [LoadMode::Read, LoadMode::Mapped] {
+        let mut samples: Vec<StartupSample> = Vec::new();
+        for _ in 0..runs {
+            let output = Command::new(&exe)
+                .arg(format!("--load={}", mode.name()))
+                .arg("--report-startup")
+                .arg(input_file_path)
+                .output()
+                .expect("failed to run benchmark process");
+            match parse_startup_report(&String::from_utf8_lossy(&output.stderr)) {
+                Some(sample) => samples.push(sample),
+                None => {
+                    eprintln!("{} run didn't report startup stats", mode.name());
+                    return 1;
+                }
+            }
+        }
+        let count = samples.len() as u64;
+        let mut total_us: Vec<u64> = samples.iter().map(|sample| sample.total_us).collect();
+        total_us.sort_unstable();
+        println!(
+            "bench=startup load={} runs={} load_us_avg={} total_us_avg={} total_us_p50={} peak_rss_kb_avg={}",
+            mode.name(),
+            count,
+            samples.iter().map(|sample| sample.load_us).sum::<u64>() / count,
+            total_us.iter().sum::<u64>() / count,
+            total_us[total_us.len() / 2],
+            samples.iter().map(|sample| sample.peak_rss_kb).sum::<u64>() / count,
+        );
+    }
+    0
+}
+
+fn per_call_ns(elapsed: Duration, calls: u32) -> u128 {
+    elapsed.as_nanos() / calls as u128
+}
+
+// The engine keeps pointers into the bindings, so they have to outlive it:
+// declare them before the engine so they're dropped after it. They can be
+// shared by several engines.
+fn create_engine(
+    input_file_path: &str,
+    preset: &str,
+    bindings: &Rc<RefCell<RustBindingsDefine>>,
+) -> Option<UniquePtr<ffi::Engine>> {
+    let mut loaded = load_bytecode(input_file_path, LoadMode::Mapped, true)?;
+    let runtime_options = make_runtime_options(preset)?;
+    let engine = ffi::Engine::create(
+        std::mem::replace(&mut loaded.buffer, UniquePtr::null()),
+        input_file_path,
+        bindings.as_ref().borrow().as_ref(),
+        runtime_options.as_ref().expect("runtime options are null"),
+    );
+    if engine.is_null() {
+        return None;
+    }
+    Some(engine)
+}
+
+// cold: create an engine, call the export once and throw the engine away,
+// which is what executeHBCBytecode costs per request.
+// warm: call the export on an engine that is already running.
+fn engine(input_file_path: &str, export_name: &str, calls: u32) -> i32 {
+    let args = ffi::CallArguments::new().within_unique_ptr();
+
+    let cold_calls = (calls / 10).max(1);
+    let start = Instant::now();
+    for _ in 0..cold_calls {
+        let bindings = make_bindings();
+        let mut engine = match create_engine(input_file_path, "throughput", &bindings) {
+            Some(engine) => engine,
+            None => return 1,
+        };
+        if engine.pin_mut().call(export_name, &args) != ffi::EngineStatus::Returned {
+            eprintln!("calling {} failed", export_name);
+            return 1;
+        }
+    }
+    let cold = start.elapsed();
+
+    let bindings = make_bindings();
+    let mut engine = match create_engine(input_file_path, "throughput", &bindings) {
+        Some(engine) => engine,
+        None => return 1,
+    };
+    let start = Instant::now();
+    for _ in 0..calls {
+        if engine.pin_mut().call(export_name, &args) != ffi::EngineStatus::Returned {
+            eprintln!("calling {} failed", export_name);
+            return 1;
+        }
+    }
+    let warm = start.elapsed();
+
+    println!("bench=engine mode=cold calls={} ns_per_call={}", cold_calls, per_call_ns(cold, cold_calls));
+    println!("bench=engine mode=warm calls={} ns_per_call={}", calls, per_call_ns(warm, calls));
+    0
+}
+
+const PRESETS: [&str; 3] = ["throughput", "low-memory", "debug"];
+
+fn execute(input_file_path: &str, preset: &str) -> bool {
+    let mut loaded = match load_bytecode(input_file_path, LoadMode::Mapped, true) {
+        Some(loaded) => loaded,
+        None => return false,
+    };
+    let bindings = make_bindings();
+    let runtime_options = make_runtime_options(preset).expect("unknown preset");
+    ffi::executeHBCBytecode(
+        std::mem::replace(&mut loaded.buffer, UniquePtr::null()),
+        input_file_path,
+        bindings.as_ref().borrow().as_ref(),
+        runtime_options.as_ref().expect("runtime options are null"),
+    )
+}
+
+fn presets(input_file_path: &str, runs: u32, export_name: Option<&String>) -> i32 {
+    for preset in PRESETS {
+        let start = Instant::now();
+        for _ in 0..runs {
+            if !execute(input_file_path, preset) {
+                eprintln!("executing {} failed", input_file_path);
+                return 1;
+            }
+        }
+        let elapsed = start.elapsed();
+        println!(
+            "bench=presets preset={} mode=execute runs={} runs_per_sec={:.1}",
+            preset,
+            runs,
+            runs as f64 / elapsed.as_secs_f64(),
+        );
+
+        let export_name = match export_name {
+            Some(export_name) => export_name,
+            None => continue,
+        };
+        let bindings = make_bindings();
+        let mut engine = match create_engine(input_file_path, preset, &bindings) {
+            Some(engine) => engine,
+            None => return 1,
+        };
+        let args = ffi::CallArguments::new().within_unique_ptr();
+        let calls = runs * 100;
+        let start = Instant::now();
+        for _ in 0..calls {
+            if engine.pin_mut().call(export_name, &args) != ffi::EngineStatus::Returned {
+                eprintln!("calling {} failed", export_name);
+                return 1;
+            }
+        }
+        let elapsed = start.elapsed();
+        println!(
+            "bench=presets preset={} mode=call calls={} calls_per_sec={:.1}",
+            preset,
+            calls,
+            calls as f64 / elapsed.as_secs_f64(),
+        );
+    }
+    0
+}
+
+// Runs a loop of native calls inside JS so that only the call itself is
+// measured, not the host calling into the engine.
+fn native_call(input_file_path: &str, calls: u32) -> i32 {
+    let bindings = make_bindings();
+    let mut engine = match create_engine(input_file_path, "throughput", &bindings) {
+        Some(engine) => engine,
+        None => return 1,
+    };
+    let mut args = ffi::CallArguments::new().within_unique_ptr();
+    args.pin_mut().pushNumber(calls as f64);
+
+    let mut time_loop = |export_name: &str| -> Option<Duration> {
+        let start = Instant::now();
+        if engine.pin_mut().call(export_name, &args) != ffi::EngineStatus::Returned {
+            eprintln!("calling {} failed", export_name);
+            return None;
+        }
+        let elapsed = start.elapsed();
+        if engine.resultNumber() != calls as f64 {
+            eprintln!("{} returned the wrong value", export_name);
+            return None;
+        }
+        Some(elapsed)
+    };
+
+    let empty = match time_loop("benchEmptyLoop") {
+        Some(elapsed) => elapsed,
+        None => return 1,
+    };
+    for (path, export_name) in [("virtual", "benchVirtualCall"), ("fast", "benchFastCall")] {
+        let elapsed = match time_loop(export_name) {
+            Some(elapsed) => elapsed,
+            None => return 1,
+        };
+        let call_time = elapsed.saturating_sub(empty);
+        println!(
+            "bench=native-call path={} calls={} ns_per_call={} calls_per_sec={:.0}",
+            path,
+            calls,
+            per_call_ns(call_time, calls),
+            calls as f64 / call_time.as_secs_f64(),
+        );
+    }
+    0
+}
+
+// Starts a pool with 1, 2, 4 ... max_workers workers and pushes the same jobs
+// through each. The export should be CPU bound for the scaling to mean
+// anything. Memory per worker is the RSS a pool grows by per worker, next to
+// the peak RSS of one process running the bundle.
+fn pool(input_file_path: &str, export_name: &str, jobs: u32, max_workers: u32) -> i32 {
+    let exe = env::current_exe().expect("couldn't find the current executable");
+    let output = Command::new(&exe)
+        .arg("--report-startup")
+        .arg(input_file_path)
+        .output()
+        .expect("failed to run benchmark process");
+    let process_rss_kb = match parse_startup_report(&String::from_utf8_lossy(&output.stderr)) {
+        Some(sample) => sample.peak_rss_kb,
+        None => {
+            eprintln!("the process run didn't report startup stats");
+            return 1;
+        }
+    };
+    println!("bench=pool mode=process peak_rss_kb={}", process_rss_kb);
+
+    let args = ffi::CallArguments::new().within_unique_ptr();
+    let mut single_worker_rate: Option<f64> = None;
+    let mut workers: u32 = 1;
+    loop {
+        // one set of bindings per worker, they aren't thread safe
+        let bindings: Vec<_> = (0..workers).map(|_| make_bindings()).collect();
+        let runtime_options = make_runtime_options("throughput").expect("unknown preset");
+        let mut loaded = match load_bytecode(input_file_path, LoadMode::Mapped, true) {
+            Some(loaded) => loaded,
+            None => return 1,
+        };
+        let rss_before = ffi::currentResidentSetBytes();
+        let mut runtime_pool = ffi::RuntimePool::new(
+            std::mem::replace(&mut loaded.buffer, UniquePtr::null()),
+            input_file_path,
+            runtime_options.as_ref().expect("runtime options are null"),
+            autocxx::c_uint::from(workers),
+        ).within_unique_ptr();
+        for (index, worker_bindings) in bindings.iter().enumerate() {
+            runtime_pool.pin_mut().setWorkerBindings(
+                autocxx::c_uint::from(index as u32),
+                worker_bindings.as_ref().borrow().as_ref(),
+            );
+        }
+        if !runtime_pool.pin_mut().start() {
+            eprintln!("starting a pool of {} failed", workers);
+            return 1;
+        }
+        let rss_kb_per_worker = ffi::currentResidentSetBytes().saturating_sub(rss_before) / 1024 / workers as u64;
+
+        let start = Instant::now();
+        for _ in 0..jobs {
+            if !runtime_pool.pin_mut().submit(export_name, &args) {
+                eprintln!("the pool stopped taking jobs");
+                return 1;
+            }
+        }
+        runtime_pool.pin_mut().waitIdle();
+        let elapsed = start.elapsed();
+        if runtime_pool.getFailedJobs() != 0 {
+            eprintln!("{} jobs failed", runtime_pool.getFailedJobs());
+            return 1;
+        }
+        // the workers use the bindings until they are joined
+        drop(runtime_pool);
+        drop(bindings);
+
+        let rate = jobs as f64 / elapsed.as_secs_f64();
+        let baseline = *single_worker_rate.get_or_insert(rate);
+        println!(
+            "bench=pool workers={} jobs={} jobs_per_sec={:.1} speedup={:.2} rss_kb_per_worker={}",
+            workers,
+            jobs,
+            rate,
+            rate / baseline,
+            rss_kb_per_worker,
+        );
+        if workers >= max_workers {
+            break;
+        }
+        workers = (workers * 2).min(max_workers);
+    }
+    0
+}
+
+// Sends one request to a zygote and waits for the child's response.
+#[cfg(target_os = "linux")]
+fn zygote_request(socket_path: &std::path::Path, request: &str) -> std::io::Result<String> {
+    use std::io::{Read, Write};
+    let mut stream = std::os::unix::net::UnixStream::connect(socket_path)?;
+    stream.write_all(request.as_bytes())?;
+    let mut response = String::new();
+    stream.read_to_string(&mut response)?;
+    Ok(response)
+}
+
+// Wall clock time from asking for a request to having its result, for a
+// child forked off a warm zygote, next to a fresh process that has to load
+// the bundle and run its top level code first.
+#[cfg(target_os = "linux")]
+fn zygote(input_file_path: &str, export_name: &str, requests: u32) -> i32 {
+    let exe = env::current_exe().expect("couldn't find the current executable");
+    let mut process_us: Vec<u64> = Vec::new();
+    for _ in 0..(requests / 10).max(5) {
+        let start = Instant::now();
+        let status = Command::new(&exe)
+            .arg(input_file_path)
+            .output()
+            .expect("failed to run benchmark process")
+            .status;
+        if !status.success() {
+            eprintln!("the process run failed");
+            return 1;
+        }
+        process_us.push(start.elapsed().as_micros() as u64);
+    }
+    process_us.sort_unstable();
+    println!(
+        "bench=zygote mode=process runs={} us_avg={} us_p50={}",
+        process_us.len(),
+        process_us.iter().sum::<u64>() / process_us.len() as u64,
+        process_us[process_us.len() / 2],
+    );
+
+    let socket_path = env::temp_dir().join(format!("snapitjs-bench-{}.sock", std::process::id()));
+    let mut server = Command::new(&exe)
+        .arg(format!("--zygote={}", socket_path.display()))
+        .arg(input_file_path)
+        .spawn()
+        .expect("failed to start the zygote");
+    let request = format!("{}\n", export_name);
+    // the first request waits for the zygote to start listening
+    let ready = Instant::now();
+    while zygote_request(&socket_path, &request).is_err() {
+        if ready.elapsed() > Duration::from_secs(30) || server.try_wait().map_or(true, |status| status.is_some()) {
+            eprintln!("the zygote didn't start");
+            let _ = server.kill();
+            return 1;
+        }
+        thread::sleep(Duration::from_millis(10));
+    }
+
+    let mut fork_us: Vec<u64> = Vec::new();
+    let start = Instant::now();
+    for _ in 0..requests {
+        let request_start = Instant::now();
+        match zygote_request(&socket_path, &request) {
+            Ok(response) if response.starts_with("ok\t") => {}
+            Ok(response) => {
+                eprintln!("request failed: {}", response.trim_end());
+                let _ = server.kill();
+                return 1;
+            }
+            Err(error) => {
+                eprintln!("request failed: {}", error);
+                let _ = server.kill();
+                return 1;
+            }
+        }
+        fork_us.push(request_start.elapsed().as_micros() as u64);
+    }
+    let elapsed = start.elapsed();
+    let _ = server.kill();
+    let _ = server.wait();
+    let _ = std::fs::remove_file(&socket_path);
+
+    fork_us.sort_unstable();
+    println!(
+        "bench=zygote mode=fork requests={} us_avg={} us_p50={} us_p99={} requests_per_sec={:.1}",
+        requests,
+        fork_us.iter().sum::<u64>() / requests as u64,
+        fork_us[fork_us.len() / 2],
+        fork_us[fork_us.len() * 99 / 100],
+        requests as f64 / elapsed.as_secs_f64(),
+    );
+    0
+}
+
+#[cfg(not(target_os = "linux"))]
+fn zygote(_input_file_path: &str, _export_name: &str, _requests: u32) -> i32 {
+    eprintln!("the zygote benchmark needs Linux");
+    1
+}
+
+// One measurement of the suite, lower is better for all of them
+struct SuiteResult {
+    name: &'static str,
+    unit: &'static str,
+    values: Vec<f64>,
+}
+
+impl SuiteResult {
+    fn sorted(&self) -> Vec<f64> {
+        let mut values = self.values.clone();
+        values.sort_by(|a, b| a.partial_cmp(b).unwrap());
+        values
+    }
+
+    fn median(&self) -> f64 {
+        let sorted = self.sorted();
+        sorted[sorted.len() / 2]
+    }
+
+    fn mean(&self) -> f64 {
+        self.values.iter().sum::<f64>() / self.values.len() as f64
+    }
+
+    fn stddev(&self) -> f64 {
+        let mean = self.mean();
+        let variance = self.values.iter().map(|value| (value - mean) * (value - mean)).sum::<f64>()
+            / self.values.len() as f64;
+        variance.sqrt()
+    }
+
+    fn to_json(&self) -> String {
+        let sorted = self.sorted();
+        let values: Vec<String> = self.values.iter().map(|value| format!("{:.1}", value)).collect();
+        format!(
+            "{{\"name\": \"{}\", \"unit\": \"{}\", \"median\": {:.1}, \"mean\": {:.1}, \"min\": {:.1}, \"max\": {:.1}, \"stddev\": {:.1}, \"values\": [{}]}}",
+            self.name,
+            self.unit,
+            self.median(),
+            self.mean(),
+            sorted[0],
+            sorted[sorted.len() - 1],
+            self.stddev(),
+            values.join(", "),
+        )
+    }
+}
+
+fn json_string(value: &str) -> String {
+    let mut escaped = String::with_capacity(value.len() + 2);
+    escaped.push('"');
+    for c in value.chars() {
+        match c {
+            '"' => escaped.push_str("\\\""),
+            '\\' => escaped.push_str("\\\\"),
+            c if (c as u32) < 0x20 => escaped.push_str(&format!("\\u{:04x}", c as u32)),
+            c => escaped.push(c),
+        }
+    }
+    escaped.push('"');
+    escaped
+}
+
+// Calls a bench* export of the fixture, which loops count times inside JS,
+// and returns the nanoseconds per iteration
+fn time_js_loop(engine: &mut UniquePtr<ffi::Engine>, export_name: &str, count: u32) -> Option<f64> {
+    let mut args = ffi::CallArguments::new().within_unique_ptr();
+    args.pin_mut().pushNumber(count as f64);
+    let start = Instant::now();
+    if engine.pin_mut().call(export_name, &args) != ffi::EngineStatus::Returned {
+        eprintln!("calling {} failed", export_name);
+        return None;
+    }
+    let elapsed = start.elapsed();
+    if engine.resultNumber() != count as f64 {
+        eprintln!("{} returned the wrong value", export_name);
+        return None;
+    }
+    Some(elapsed.as_nanos() as f64 / count as f64)
+}
+
+// The compiler that made a fixture, from the .version file that
+// bench/build_fixtures.sh writes next to it, like "Hermes release version:
+// 0.12.0; HBC bytecode version: 96". "unknown" without one.
+fn fixture_compiler(input_file_path: &str) -> String {
+    let text = match std::fs::read_to_string(format!("{}.version", input_file_path)) {
+        Ok(text) => text,
+        Err(_) => return "unknown".to_string(),
+    };
+    let versions: Vec<&str> = text.lines()
+        .map(str::trim)
+        .filter(|line| line.contains("version:"))
+        .collect();
+    match versions.is_empty() {
+        true => "unknown".to_string(),
+        // not a comma, json_field stops at one
+        false => versions.join("; "),
+    }
+}
+
+// Runs the same measurements over bench/suite.js every time, so the numbers
+// can be compared between builds. Every measurement is taken samples times,
+// after one warmup, and the JSON has every sample next to the median, mean,
+// min, max and standard deviation. Native call measurements have the empty
+// loop subtracted, so they are the cost of the call alone.
+fn suite(input_file_path: &str, output_path: &str, samples: u32) -> i32 {
+    const LOADS: u32 = 100;
+    const ENGINES: u32 = 10;
+    const HOST_CALLS: u32 = 10_000;
+    const NATIVE_CALLS: u32 = 1_000_000;
+    const MARSHAL_CALLS: u32 = 200_000;
+    const ALLOCATIONS: u32 = 200_000;
+
+    let mut results: Vec<SuiteResult> = Vec::new();
+    let mut record = |name: &'static str, unit: &'static str, values: Vec<f64>| {
+        let result = SuiteResult { name, unit, values };
+        println!(
+            "bench=suite name={} unit={} median={:.1} stddev={:.1}",
+            result.name,
+            result.unit,
+            result.median(),
+            result.stddev(),
+        );
+        results.push(result);
+    };
+
+    // a fresh process per run, from exec to exit
+    let exe = env::current_exe().expect("couldn't find the current executable");
+    let mut total_us: Vec<f64> = Vec::new();
+    let mut peak_rss_kb: Vec<f64> = Vec::new();
+    for run in 0..=samples {
+        let output = Command::new(&exe)
+            .arg("--report-startup")
+            .arg(input_file_path)
+            .output()
+            .expect("failed to run benchmark process");
+        let sample = match parse_startup_report(&String::from_utf8_lossy(&output.stderr)) {
+            Some(sample) => sample,
+            None => {
+                eprintln!("the process run didn't report startup stats");
+                return 1;
+            }
+        };
+        if run != 0 {
+            total_us.push(sample.total_us as f64);
+            peak_rss_kb.push(sample.peak_rss_kb as f64);
+        }
+    }
+    record("startup.process", "us", total_us);
+    record("startup.peak_rss", "kb", peak_rss_kb);
+
+    for (name, mode) in [("load.mapped", LoadMode::Mapped), ("load.read", LoadMode::Read)] {
+        let mut values: Vec<f64> = Vec::new();
+        for run in 0..=samples {
+            let start = Instant::now();
+            for _ in 0..LOADS {
+                if load_bytecode(input_file_path, mode, true).is_none() {
+                    eprintln!("loading {} failed", input_file_path);
+                    return 1;
+                }
+            }
+            if run != 0 {
+                values.push(start.elapsed().as_nanos() as f64 / LOADS as f64);
+            }
+        }
+        record(name, "ns", values);
+    }
+
+    // load, runtime creation, bindings and the top level code, then teardown
+    let mut values: Vec<f64> = Vec::new();
+    for run in 0..=samples {
+        let start = Instant::now();
+        for _ in 0..ENGINES {
+            if !execute(input_file_path, "throughput") {
+                eprintln!("executing {} failed", input_file_path);
+                return 1;
+            }
+        }
+        if run != 0 {
+            values.push(start.elapsed().as_nanos() as f64 / ENGINES as f64);
+        }
+    }
+    record("execute", "ns", values);
+
+    // the same engine with and without bindings, the difference is what
+    // installing them costs
+    let bindings = make_bindings();
+    let empty_bindings = make_empty_bindings();
+    let mut with_bindings: Vec<f64> = Vec::new();
+    let mut without_bindings: Vec<f64> = Vec::new();
+    for run in 0..=samples {
+        for (engine_bindings, values) in [(&bindings, &mut with_bindings), (&empty_bindings, &mut without_bindings)] {
+            let start = Instant::now();
+            for _ in 0..ENGINES {
+                if create_engine(input_file_path, "throughput", engine_bindings).is_none() {
+                    return 1;
+                }
+            }
+            if run != 0 {
+                values.push(start.elapsed().as_nanos() as f64 / ENGINES as f64);
+            }
+        }
+    }
+    let install: Vec<f64> = with_bindings.iter().zip(&without_bindings)
+        .map(|(with, without)| (with - without).max(0.0))
+        .collect();
+    record("engine.create", "ns", with_bindings);
+    record("engine.create_without_bindings", "ns", without_bindings);
+    record("bindings.install", "ns", install);
+
+    let mut engine = match create_engine(input_file_path, "throughput", &bindings) {
+        Some(engine) => engine,
+        None => return 1,
+    };
+
+    let args = ffi::CallArguments::new().within_unique_ptr();
+    let mut values: Vec<f64> = Vec::new();
+    for run in 0..=samples {
+        let start = Instant::now();
+        for _ in 0..HOST_CALLS {
+            if engine.pin_mut().call("benchNothing", &args) != ffi::EngineStatus::Returned {
+                eprintln!("calling benchNothing failed");
+                return 1;
+            }
+        }
+        if run != 0 {
+            values.push(start.elapsed().as_nanos() as f64 / HOST_CALLS as f64);
+        }
+    }
+    record("engine.call", "ns", values);
+
+    // a 640 byte string into an export and back out as UTF-8
+    let mut args = ffi::CallArguments::new().within_unique_ptr();
+    let text = "snapit-js ".repeat(64);
+    let mut values: Vec<f64> = Vec::new();
+    for run in 0..=samples {
+        let start = Instant::now();
+        for _ in 0..HOST_CALLS {
+            args.pin_mut().clear();
+            args.pin_mut().pushString(text.as_str());
+            if engine.pin_mut().call("echo", &args) != ffi::EngineStatus::Returned ||
+                engine.pin_mut().resultString().len() != text.len() {
+                eprintln!("calling echo failed");
+                return 1;
+            }
+        }
+        if run != 0 {
+            values.push(start.elapsed().as_nanos() as f64 / HOST_CALLS as f64);
+        }
+    }
+    record("string.host_call", "ns", values);
+
+    let loops: [(&'static str, &'static str, u32); 5] = [
+        ("native.virtual_call", "benchVirtualCall", NATIVE_CALLS),
+        ("native.fast_call", "benchFastCall", NATIVE_CALLS),
+        ("string.native_ascii", "benchStringAscii", MARSHAL_CALLS),
+        ("string.native_utf16", "benchStringUtf16", MARSHAL_CALLS),
+        ("object.native", "benchObjects", MARSHAL_CALLS),
+    ];
+    for (name, export_name, count) in loops {
+        let mut values: Vec<f64> = Vec::new();
+        for run in 0..=samples {
+            let empty = match time_js_loop(&mut engine, "benchEmptyLoop", count) {
+                Some(empty) => empty,
+                None => return 1,
+            };
+            let total = match time_js_loop(&mut engine, export_name, count) {
+                Some(total) => total,
+                None => return 1,
+            };
+            if run != 0 {
+                values.push((total - empty).max(0.0));
+            }
+        }
+        record(name, "ns", values);
+    }
+
+    for (name, export_name) in [("gc.allocate", "benchAllocate"), ("gc.retain", "benchRetain")] {
+        let mut values: Vec<f64> = Vec::new();
+        for run in 0..=samples {
+            match time_js_loop(&mut engine, export_name, ALLOCATIONS) {
+                Some(value) if run != 0 => values.push(value),
+                Some(_) => {}
+                None => return 1,
+            }
+        }
+        record(name, "ns", values);
+    }
+    drop(engine);
+    record("process.peak_rss", "kb", vec![(ffi::peakResidentSetBytes() / 1024) as f64]);
+
+    let timestamp = std::time::SystemTime::now()
+        .duration_since(std::time::UNIX_EPOCH)
+        .map_or(0, |elapsed| elapsed.as_secs());
+    let lines: Vec<String> = results.iter().map(|result| format!("    {}", result.to_json())).collect();
+    // one result per line, compare reads them back line by line
+    let json = format!(
+        "{{\n  \"suite\": \"snapitjs\",\n  \"version\": {},\n  \"os\": {},\n  \"arch\": {},\n  \"fixture\": {},\n  \"compiler\": {},\n  \"samples\": {},\n  \"timestamp\": {},\n  \"results\": [\n{}\n  ]\n}}\n",
+        json_string(env!("CARGO_PKG_VERSION")),
+        json_string(env::consts::OS),
+        json_string(env::consts::ARCH),
+        json_string(input_file_path),
+        json_string(&fixture_compiler(input_file_path)),
+        samples,
+        timestamp,
+        lines.join(",\n"),
+    );
+    if let Err(error) = std::fs::write(output_path, json) {
+        eprintln!("failed to write {}: {}", output_path, error);
+        return 1;
+    }
+    0
+}
+
+// the text after "key": up to the next comma or brace
+fn json_field<'a>(line: &'a str, key: &str) -> Option<&'a str> {
+    let pattern = format!("\"{}\": ", key);
+    let start = line.find(&pattern)? + pattern.len();
+    let rest = &line[start..];
+    let end = rest.find(|c: char| c == ',' || c == '}').unwrap_or(rest.len());
+    Some(rest[..end].trim_matches('"'))
+}
+
+// name and median of every result in a file written by suite
+fn read_suite_results(path: &str) -> Option<Vec<(String, f64)>> {
+    let text = match std::fs::read_to_string(path) {
+        Ok(text) => text,
+        Err(error) => {
+            eprintln!("failed to read {}: {}", path, error);
+            return None;
+        }
+    };
+    let results: Vec<(String, f64)> = text.lines()
+        .filter_map(|line| {
+            let name = json_field(line, "name")?;
+            let median = json_field(line, "median")?.parse().ok()?;
+            Some((name.to_string(), median))
+        })
+        .collect();
+    if results.is_empty() {
+        eprintln!("{} has no suite results", path);
+        return None;
+    }
+    Some(results)
+}
+
+// the compiler field of a file written by suite, "unknown" if it has none
+fn read_suite_compiler(path: &str) -> String {
+    std::fs::read_to_string(path)
+        .ok()
+        .and_then(|text| text.lines().find_map(|line| json_field(line, "compiler").map(str::to_string)))
+        .unwrap_or("unknown".to_string())
+}
+
+// Compares the medians of two suite runs. Every measurement is a time or a
+// size, so a positive change is a regression.
+fn compare(baseline_path: &str, current_path: &str, threshold_percent: u32) -> i32 {
+    let (baseline, current) = match (read_suite_results(baseline_path), read_suite_results(current_path)) {
+        (Some(baseline), Some(current)) => (baseline, current),
+        _ => return 1,
+    };
+    // fixtures from different compilers aren't the same code
+    let baseline_compiler = read_suite_compiler(baseline_path);
+    let current_compiler = read_suite_compiler(current_path);
+    if baseline_compiler != current_compiler {
+        eprintln!(
+            "warning: the fixtures were compiled by different compilers, the baseline by {} and the current run by {}",
+            baseline_compiler, current_compiler
+        );
+    }
+    let mut regressions = 0;
+    for (name, median) in &current {
+        let base = match baseline.iter().find(|(base_name, _)| base_name == name) {
+            Some((_, base)) => *base,
+            None => {
+                println!("bench=compare name={} current={:.1} baseline=none", name, median);
+                continue;
+            }
+        };
+        let change = if base > 0.0 { (median - base) / base * 100.0 } else { 0.0 };
+        let regressed = change > threshold_percent as f64;
+        if regressed {
+            regressions += 1;
+        }
+        println!(
+            "bench=compare name={} baseline={:.1} current={:.1} change_percent={:+.1}{}",
+            name,
+            base,
+            median,
+            change,
+            if regressed { " regression" } else { "" },
+        );
+    }
+    if regressions != 0 { 1 } else { 0 }
+}
@@ -0,0 +1,414 @@
+#include "binding_table.hpp"
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "hermes/VM/PropertyAccessor.h"
+
+#include "object_shape.hpp"
+
+namespace {
+// returns false if a part is empty
+bool splitPath(const std::string& path, std::vector<std::string>& parts) {
+  size_t start = 0;
+  while (true) {
+    const size_t end = path.find('.', start);
+    std::string part = path.substr(start, end == std::string::npos ? std::string::npos : end - start);
+    if (part.empty()) {
+      return false;
+    }
+    parts.push_back(std::move(part));
+    if (end == std::string::npos) {
+      return true;
+    }
+    start = end + 1;
+  }
+}
+
+std::string joinPath(const std::vector<std::string>& path, size_t length) {
+  std::string joined;
+  for (size_t i = 0; i < length; ++i) {
+    if (i != 0) {
+      joined += '.';
+    }
+    joined += path[i];
+  }
+  return joined;
+}
+
+// true if path is longer than prefix and starts with it
+bool isBelow(const std::vector<std::string>& path, const std::vector<std::string>& prefix) {
+  return path.size() > prefix.size() &&
+      std::equal(prefix.begin(), prefix.end(), path.begin());
+}
+} // namespace
+
+bool BindingTable::addFunction(
+  const std::string& path,
+  const BindingsDefine::FunctionContext& function,
+  unsigned paramCount
+) {
+  // a context added under two paths keeps the first one's stats
+  if (!function.getStats()) {
+    function.setStats(NativeStatsRegistry::getShared().forFunction(path));
+  }
+  return add(
+      path,
+      const_cast<BindingsDefine::FunctionContext*>(&function),
+      callFunctionContext,
+      paramCount,
+      false);
+}
+
+bool BindingTable::addFastFunction(
+  const std::string& path,
+  const FastFunctionContext& function,
+  unsigned paramCount
+) {
+  if (!function.getStats()) {
+    function.setStats(NativeStatsRegistry::getShared().forFunction(path));
+  }
+  return add(
+      path,
+      const_cast<FastFunctionContext*>(&function),
+      callRuntimeFastFunction,
+      paramCount,
+      true);
+}
+
+bool BindingTable::addAsyncFunction(
+  const std::string& path,
+  const AsyncFunctionContext& function,
+  unsigned paramCount
+) {
+  if (!function.getStats()) {
+    function.setStats(NativeStatsRegistry::getShared().forFunction(path));
+  }
+  return add(
+      path,
+      const_cast<AsyncFunctionContext*>(&function),
+      callAsyncFunctionContext,
+      paramCount,
+      true);
+}
+
+bool BindingTable::add(
+  const std::string& path,
+  void* context,
+  hermes::vm::NativeFunctionPtr callback,
+  unsigned paramCount,
+  bool perRuntime
+) {
+  Entry entry{{}, context, callback, paramCount, perRuntime};
+  if (!splitPath(path, entry.path)) {
+    return false;
+  }
+  // install would define the name twice on the same object, once as the
+  // function and once as the namespace, lazy or not
+  for (const Entry& existing : entries) {
+    if (isBelow(existing.path, entry.path) || isBelow(entry.path, existing.path)) {
+      llvh::errs() << "Binding " << path << " is both a function and a namespace of "
+                   << joinPath(existing.path, existing.path.size()) << "\n";
+      return false;
+    }
+  }
+  entries.push_back(std::move(entry));
+  return true;
+}
+
+bool BindingTable::setLazyNamespace(const std::string& path) {
+  auto lazy = std::make_unique<LazyNamespace>(LazyNamespace{this, {}});
+  if (!splitPath(path, lazy->path)) {
+    return false;
+  }
+  for (const auto& existing : lazyNamespaces) {
+    if (existing->path == lazy->path) {
+      return true;
+    }
+  }
+  lazyNamespaces.push_back(std::move(lazy));
+  return true;
+}
+
+const BindingTable::LazyNamespace* BindingTable::findLazyNamespace(
+  const std::vector<std::string>& path,
+  size_t depth
+) const {
+  const LazyNamespace* outermost = nullptr;
+  for (const auto& lazy : lazyNamespaces) {
+    // the function has to be inside the namespace, not the namespace itself
+    if (lazy->path.size() > depth && isBelow(path, lazy->path) &&
+        (!outermost || lazy->path.size() < outermost->path.size())) {
+      outermost = lazy.get();
+    }
+  }
+  return outermost;
+}
+
+bool BindingTable::install(hermes::vm::Runtime& runtime) const {
+  return installUnder(runtime, {}, runtime.getGlobal(), false);
+}
+
+bool BindingTable::installUnder(
+  hermes::vm::Runtime& runtime,
+  const std::vector<std::string>& prefix,
+  hermes::vm::Handle<hermes::vm::JSObject> root,
+  bool rootCreated
+) const {
+  using namespace hermes;
+  vm::GCScope scope(runtime);
+  const size_t depth = prefix.size();
+
+  // everything below a lazy namespace waits for its getter
+  std::vector<const Entry*> functions;
+  std::vector<const LazyNamespace*> getters;
+  for (const Entry& entry : entries) {
+    if (!isBelow(entry.path, prefix)) {
+      continue;
+    }
+    const LazyNamespace* lazy = findLazyNamespace(entry.path, depth);
+    if (!lazy) {
+      functions.push_back(&entry);
+    } else if (std::find(getters.begin(), getters.end(), lazy) == getters.end()) {
+      getters.push_back(lazy);
+    }
+  }
+
+  // intern every name once, the handles keep them alive until they are
+  // property names
+  std::unordered_map<std::string, vm::Handle<vm::SymbolID>> symbols;
+  auto intern = [&](const std::vector<std::string>& path) -> bool {
+    for (size_t i = depth; i < path.size(); ++i) {
+      if (symbols.count(path[i]) != 0) {
+        continue;
+      }
+      auto symbol = runtime.getIdentifierTable().getSymbolHandle(
+          runtime, vm::createASCIIRef(path[i].c_str()));
+      if (LLVM_UNLIKELY(symbol == vm::ExecutionStatus::EXCEPTION)) {
+        llvh::errs() << "Failed to intern binding name " << path[i] << "\n";
+        return false;
+      }
+      symbols.emplace(path[i], *symbol);
+    }
+    return true;
+  };
+  for (const Entry* entry : functions) {
+    if (!intern(entry->path)) {
+      return false;
+    }
+  }
+  for (const LazyNamespace* lazy : getters) {
+    if (!intern(lazy->path)) {
+      return false;
+    }
+  }
+
+  const vm::DefinePropertyFlags existingFlags =
+      vm::DefinePropertyFlags::getNewNonEnumerableFlags();
+  vm::PropertyFlags newFlags = vm::PropertyFlags::defaultNewNamedPropertyFlags();
+  newFlags.enumerable = 0;
+
+  // Namespaces by their joined path. The global object and namespaces that
+  // already existed can have properties with the same names, so they go
+  // through defineOwnProperty. Namespaces made here start out empty and use
+  // defineNewOwnProperty, which skips the lookup.
+  struct Namespace {
+    vm::Handle<vm::JSObject> object;
+    bool created;
+  };
+  std::unordered_map<std::string, Namespace> namespaces;
+  namespaces.emplace(joinPath(prefix, depth), Namespace{root, rootCreated});
+  std::unordered_set<std::string> defined;
+
+  auto defineProperty = [&](const Namespace& target,
+                            vm::SymbolID name,
+                            vm::Handle<> value) -> bool {
+    if (target.created) {
+      return vm::JSObject::defineNewOwnProperty(
+                 target.object, runtime, name, newFlags, value) !=
+          vm::ExecutionStatus::EXCEPTION;
+    }
+    auto res = vm::JSObject::defineOwnProperty(
+        target.object, runtime, name, existingFlags, value);
+    return res != vm::ExecutionStatus::EXCEPTION && *res;
+  };
+
+  auto getNamespace = [&](const std::vector<std::string>& path,
+                          size_t length) -> const Namespace* {
+    const Namespace* parent = &namespaces.find(joinPath(prefix, depth))->second;
+    for (size_t i = depth + 1; i <= length; ++i) {
+      std::string key = joinPath(path, i);
+      auto found = namespaces.find(key);
+      if (found != namespaces.end()) {
+        parent = &found->second;
+        continue;
+      }
+      vm::SymbolID name = symbols.find(path[i - 1])->second.get();
+      Namespace child{vm::Runtime::makeNullHandle<vm::JSObject>(), true};
+      if (!parent->created) {
+        // reuse an object that is already there, like one from another table
+        auto existing = vm::JSObject::getNamed_RJS(parent->object, runtime, name);
+        if (LLVM_UNLIKELY(existing == vm::ExecutionStatus::EXCEPTION)) {
+          return nullptr;
+        }
+        if (vm::vmisa<vm::JSObject>(existing->get())) {
+          child = Namespace{runtime.makeHandle(vm::vmcast<vm::JSObject>(existing->get())), false};
+        } else if (!existing->get().isUndefined()) {
+          llvh::errs() << "Binding namespace " << key << " is not an object\n";
+          return nullptr;
+        }
+      }
+      if (child.created) {
+        child.object = runtime.makeHandle(vm::JSObject::create(runtime));
+        if (!defineProperty(*parent, name, child.object)) {
+          return nullptr;
+        }
+      }
+      parent = &namespaces.emplace(std::move(key), child).first->second;
+    }
+    return parent;
+  };
+
+  // looked up once here rather than on every call
+  ObjectShapes* objectShapes = ObjectShapes::forRuntime(runtime);
+  AsyncNativeCalls* asyncCalls = AsyncNativeCalls::forRuntime(runtime);
+
+  for (const Entry* entry : functions) {
+    if (!defined.insert(joinPath(entry->path, entry->path.size())).second) {
+      llvh::errs() << "Binding " << joinPath(entry->path, entry->path.size())
+                   << " was added twice\n";
+      return false;
+    }
+    const Namespace* target = getNamespace(entry->path, entry->path.size() - 1);
+    if (!target) {
+      return false;
+    }
+
+    vm::GCScopeMarkerRAII marker{runtime};
+    vm::SymbolID name = symbols.find(entry->path.back())->second.get();
+    vm::Handle<> function;
+    if (entry->perRuntime) {
+      // the function object owns the context and deletes it when collected
+      auto created = vm::FinalizableNativeFunction::createWithoutPrototype(
+          runtime,
+          new RuntimeFunctionContext{entry->context, objectShapes, asyncCalls},
+          entry->callback,
+          [](void* context) { delete static_cast<RuntimeFunctionContext*>(context); },
+          name,
+          entry->paramCount);
+      if (LLVM_UNLIKELY(created == vm::ExecutionStatus::EXCEPTION)) {
+        return false;
+      }
+      function = runtime.makeHandle(*created);
+    } else {
+      function = vm::NativeFunction::create(
+          runtime,
+          vm::Handle<vm::JSObject>::vmcast(&runtime.functionPrototype),
+          entry->context,
+          entry->callback,
+          name,
+          entry->paramCount,
+          vm::Runtime::makeNullHandle<vm::JSObject>());
+    }
+    if (!defineProperty(*target, name, function)) {
+      return false;
+    }
+  }
+
+  // Getters are configurable so materialize() can replace them. A getter is
+  // a function object too, so laziness only pays off for whole namespaces.
+  vm::DefinePropertyFlags getterFlags{};
+  getterFlags.setEnumerable = 1;
+  getterFlags.setConfigurable = 1;
+  getterFlags.configurable = 1;
+  getterFlags.setGetter = 1;
+  getterFlags.setSetter = 1;
+  for (const LazyNamespace* lazy : getters) {
+    const Namespace* target = getNamespace(lazy->path, lazy->path.size() - 1);
+    if (!target) {
+      return false;
+    }
+
+    vm::GCScopeMarkerRAII marker{runtime};
+    vm::SymbolID name = symbols.find(lazy->path.back())->second.get();
+    auto getter = vm::NativeFunction::create(
+        runtime,
+        vm::Handle<vm::JSObject>::vmcast(&runtime.functionPrototype),
+        const_cast<LazyNamespace*>(lazy),
+        materialize,
+        name,
+        0,
+        vm::Runtime::makeNullHandle<vm::JSObject>());
+    auto accessor = vm::PropertyAccessor::create(
+        runtime, getter, vm::Runtime::makeNullHandle<vm::Callable>());
+    if (LLVM_UNLIKELY(accessor == vm::ExecutionStatus::EXCEPTION)) {
+      return false;
+    }
+    auto res = vm::JSObject::defineOwnProperty(
+        target->object, runtime, name, getterFlags, runtime.makeHandle(*accessor));
+    if (res == vm::ExecutionStatus::EXCEPTION || !*res) {
+      return false;
+    }
+  }
+  return true;
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> BindingTable::materialize(
+  void* context,
+  hermes::vm::Runtime& runtime,
+  hermes::vm::NativeArgs args
+) {
+  using namespace hermes;
+  const LazyNamespace& lazy = *static_cast<const LazyNamespace*>(context);
+  vm::GCScope scope(runtime);
+
+  // the table is shared between runtimes, so the parent is found again from
+  // the global object instead of being stored
+  vm::Handle<vm::JSObject> parent = runtime.getGlobal();
+  // the symbol handles stay in scope, which keeps name alive
+  vm::SymbolID name;
+  for (size_t i = 0; i < lazy.path.size(); ++i) {
+    auto symbol = runtime.getIdentifierTable().getSymbolHandle(
+        runtime, vm::createASCIIRef(lazy.path[i].c_str()));
+    if (LLVM_UNLIKELY(symbol == vm::ExecutionStatus::EXCEPTION)) {
+      return vm::ExecutionStatus::EXCEPTION;
+    }
+    name = **symbol;
+    if (i + 1 == lazy.path.size()) {
+      break;
+    }
+    auto value = vm::JSObject::getNamed_RJS(parent, runtime, name);
+    if (LLVM_UNLIKELY(value == vm::ExecutionStatus::EXCEPTION)) {
+      return vm::ExecutionStatus::EXCEPTION;
+    }
+    if (!vm::vmisa<vm::JSObject>(value->get())) {
+      const std::string message =
+          "binding namespace " + joinPath(lazy.path, i + 1) + " is not an object";
+      return runtime.raiseTypeError(vm::TwineChar16(message.c_str()));
+    }
+    parent = runtime.makeHandle(vm::vmcast<vm::JSObject>(value->get()));
+  }
+
+  auto object = runtime.makeHandle(vm::JSObject::create(runtime));
+  if (!lazy.table->installUnder(runtime, lazy.path, object, true)) {
+    if (runtime.getThrownValue().isEmpty()) {
+      const std::string message =
+          "failed to install binding namespace " + joinPath(lazy.path, lazy.path.size());
+      return runtime.raiseError(vm::TwineChar16(message.c_str()));
+    }
+    return vm::ExecutionStatus::EXCEPTION;
+  }
+
+  // replace the getter so later reads are a plain property lookup
+  auto res = vm::JSObject::defineOwnProperty(
+      parent,
+      runtime,
+      name,
+      vm::DefinePropertyFlags::getNewNonEnumerableFlags(),
+      object);
+  if (LLVM_UNLIKELY(res == vm::ExecutionStatus::EXCEPTION)) {
+    return vm::ExecutionStatus::EXCEPTION;
+  }
+  return object.getHermesValue();
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "async_native.hpp"
+#include "wrapper.hpp"
+
+// A list of native functions that is built once and installed into every
+// runtime in one pass. install() interns every name up front, creates the
+// namespace objects and defines all the functions inside one GCScope, instead
+// of a NativeFunctionDefine and a symbol lookup per function.
+// Paths are dot separated, "host.fs.readFile" defines readFile on the object
+// at host.fs and creates host and host.fs if they don't exist. A path without
+// dots defines a function on the global object.
+// Namespaces can be made lazy with setLazyNamespace. A lazy namespace starts
+// out as a getter on its parent and the object, its functions and anything
+// nested in it are only created the first time it's read. The getter then
+// replaces itself with a plain property, so later reads cost nothing extra.
+// The table and the contexts passed in have to outlive every runtime the
+// table is installed into. Every function added gets NativeCallStats under
+// its path, see native_stats.hpp. Fast and async functions get the runtime's
+// ObjectShapes and AsyncNativeCalls through a RuntimeFunctionContext made at
+// install, so their calls don't look them up.
+class BindingTable {
+public:
+    BindingTable() {}
+
+    // Return false if the path is empty or has an empty part, or if it's a
+    // namespace of a function already added or the other way around, like
+    // "host.fs" and "host.fs.read".
+    bool addFunction(const std::string& path, const BindingsDefine::FunctionContext& function, unsigned paramCount);
+    bool addFastFunction(const std::string& path, const FastFunctionContext& function, unsigned paramCount);
+    // the function returns a promise, see AsyncNativeFunction
+    bool addAsyncFunction(const std::string& path, const AsyncFunctionContext& function, unsigned paramCount);
+
+    template<auto Function>
+    bool addTypedFunction(const std::string& path) {
+        if (!TypedFunction<Function>::stats.load(std::memory_order_acquire)) {
+            NativeCallStats* unset = nullptr;
+            TypedFunction<Function>::stats.compare_exchange_strong(
+                unset,
+                NativeStatsRegistry::getShared().forFunction(path),
+                std::memory_order_acq_rel);
+        }
+        return add(path, nullptr, TypedFunction<Function>::call, TypedFunction<Function>::paramCount, false);
+    }
+
+    // returns false if the path is invalid, setting it twice does nothing
+    bool setLazyNamespace(const std::string& path);
+
+    size_t size() const { return entries.size(); }
+
+    // Returns false and stops if a name couldn't be interned, a namespace is
+    // already defined as something other than an object, or a path was added
+    // twice.
+    bool install(hermes::vm::Runtime& runtime) const;
+
+private:
+    struct Entry {
+        // namespaces, then the function's name
+        std::vector<std::string> path;
+        void* context;
+        hermes::vm::NativeFunctionPtr callback;
+        unsigned paramCount;
+        // callback takes a RuntimeFunctionContext around context
+        bool perRuntime;
+    };
+
+    struct LazyNamespace {
+        const BindingTable* table;
+        std::vector<std::string> path;
+    };
+
+    bool add(const std::string& path, void* context, hermes::vm::NativeFunctionPtr callback, unsigned paramCount, bool perRuntime);
+
+    // Defines everything below prefix on root, root being the object at
+    // prefix. Lazy namespaces below prefix get a getter instead.
+    bool installUnder(
+        hermes::vm::Runtime& runtime,
+        const std::vector<std::string>& prefix,
+        hermes::vm::Handle<hermes::vm::JSObject> root,
+        bool rootCreated) const;
+
+    // the outermost lazy namespace that path is in, below the first depth parts
+    const LazyNamespace* findLazyNamespace(const std::vector<std::string>& path, size_t depth) const;
+
+    // the getter of a lazy namespace
+    static hermes::vm::CallResult<hermes::vm::HermesValue> materialize(
+        void* context, hermes::vm::Runtime& runtime, hermes::vm::NativeArgs args);
+
+    std::vector<Entry> entries;
+    // pointers to these are the getters' contexts
+    std::vector<std::unique_ptr<LazyNamespace>> lazyNamespaces;
+};
@@ -0,0 +1,268 @@
+#include "bundle.hpp"
+
+#include <cstring>
+
+#include "hermes/BCGen/HBC/BytecodeFileFormat.h"
+#include "llvh/Support/FileSystem.h"
+#include "llvh/Support/MathExtras.h"
+#include "llvh/Support/MemoryBuffer.h"
+#include "llvh/Support/SHA1.h"
+
+#include "string_bridge.hpp"
+
+namespace {
+// One module's bytes inside a bundle, keeps the whole bundle alive.
+class SliceBuffer : public hermes::Buffer {
+public:
+  SliceBuffer(std::shared_ptr<hermes::Buffer> _owner, uint64_t offset, uint64_t length):
+    hermes::Buffer(_owner->data() + offset, length),
+    owner(std::move(_owner))
+  {}
+
+private:
+  std::shared_ptr<hermes::Buffer> owner;
+};
+
+std::string hashKey(const std::array<uint8_t, 20>& hash) {
+  return std::string(reinterpret_cast<const char*>(hash.data()), hash.size());
+}
+} // namespace
+
+bool Bundle::isBundle(const hermes::Buffer& bytes) {
+  return bytes.size() >= sizeof(BundleHeader) &&
+      std::memcmp(bytes.data(), kBundleMagic, sizeof(kBundleMagic)) == 0;
+}
+
+Bundle::Bundle(std::shared_ptr<hermes::Buffer> _bytes, std::string _sourceURL):
+  bytes(std::move(_bytes)),
+  sourceURL(std::move(_sourceURL))
+{}
+
+std::shared_ptr<Bundle> Bundle::open(
+  std::unique_ptr<hermes::Buffer> buffer,
+  const std::string& sourceURL
+) {
+  auto invalid = [&sourceURL](const char* reason) {
+    llvh::errs() << "Invalid bundle " << sourceURL << ": " << reason << "\n";
+    return nullptr;
+  };
+  if (!buffer || !isBundle(*buffer)) {
+    return invalid("bad magic");
+  }
+  const uint8_t* data = buffer->data();
+  const uint64_t size = buffer->size();
+  const auto* header = reinterpret_cast<const BundleHeader*>(data);
+  if (header->version != kBundleVersion) {
+    return invalid("unsupported version");
+  }
+  if (header->moduleCount == 0) {
+    return invalid("no modules");
+  }
+  if (header->moduleCount > (size - sizeof(BundleHeader)) / sizeof(BundleEntry)) {
+    return invalid("index is truncated");
+  }
+  if (header->idsOffset > size || header->idsLength > size - header->idsOffset) {
+    return invalid("module ids are truncated");
+  }
+
+  std::shared_ptr<Bundle> bundle{new Bundle(std::move(buffer), sourceURL)};
+  bundle->entries = reinterpret_cast<const BundleEntry*>(data + sizeof(BundleHeader));
+  const char* ids = reinterpret_cast<const char*>(data + header->idsOffset);
+  bundle->ids.reserve(header->moduleCount);
+  for (uint32_t i = 0; i < header->moduleCount; ++i) {
+    const BundleEntry& entry = bundle->entries[i];
+    if (entry.idOffset > header->idsLength || entry.idLength > header->idsLength - entry.idOffset) {
+      return invalid("module id out of range");
+    }
+    // only the range is checked, the bytecode itself is checked when the
+    // module is loaded so that opening doesn't read every module
+    if (entry.offset % kBundleAlignment != 0 || entry.offset > size || entry.length > size - entry.offset) {
+      return invalid("module out of range");
+    }
+    std::string id(ids + entry.idOffset, entry.idLength);
+    if (!bundle->indexById.emplace(id, i).second) {
+      return invalid("duplicate module id");
+    }
+    bundle->ids.push_back(std::move(id));
+  }
+  return bundle;
+}
+
+int64_t Bundle::findModule(const std::string& id) const {
+  auto found = indexById.find(id);
+  return found == indexById.end() ? -1 : static_cast<int64_t>(found->second);
+}
+
+std::shared_ptr<hermes::hbc::BCProvider> Bundle::loadModule(size_t index) const {
+  const BundleEntry& entry = entries[index];
+  auto bytecode = hermes::hbc::BCProviderFromBuffer::createBCProviderFromBuffer(
+      std::make_unique<SliceBuffer>(bytes, entry.offset, entry.length));
+  if (!bytecode.first) {
+    llvh::errs() << "Failed to load " << ids[index] << " from " << sourceURL
+                 << ": " << bytecode.second << "\n";
+    return nullptr;
+  }
+  return std::move(bytecode.first);
+}
+
+BundleLoader::BundleLoader(hermes::vm::Runtime& _runtime, std::shared_ptr<Bundle> _bundle):
+  runtime(_runtime),
+  bundle(std::move(_bundle)),
+  states(bundle->getModuleCount(), ModuleState::NotLoaded),
+  values(bundle->getModuleCount(), hermes::vm::HermesValue::encodeUndefinedValue())
+{
+  states[0] = ModuleState::Loading;
+  runtime.addCustomRootsFunction(
+      [this](hermes::vm::GC*, hermes::vm::RootAcceptor& acceptor) {
+        for (auto& value : values) {
+          acceptor.accept(value);
+        }
+      });
+}
+
+bool BundleLoader::install() {
+  return defineGlobalFunction(runtime, "require", require, this, 1);
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> BundleLoader::require(
+  void* context,
+  hermes::vm::Runtime& runtime,
+  hermes::vm::NativeArgs args
+) {
+  using namespace hermes;
+  BundleLoader& loader = *static_cast<BundleLoader*>(context);
+  auto id = args.dyncastArg<vm::StringPrimitive>(0);
+  if (!id) {
+    return runtime.raiseTypeError("require expects a module id as a string");
+  }
+  const std::string idString = stringPrimitiveToUTF8(runtime, id);
+  const int64_t index = loader.bundle->findModule(idString);
+  if (index < 0) {
+    return runtime.raiseError(
+        vm::TwineChar16(utf8ToUTF16String("Cannot find module '" + idString + "'").c_str()));
+  }
+  return loader.requireModule(static_cast<size_t>(index));
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> BundleLoader::requireModule(size_t index) {
+  using namespace hermes;
+  const std::string& id = bundle->getModuleId(index);
+  if (states[index] == ModuleState::Loaded) {
+    return values[index];
+  }
+  if (states[index] == ModuleState::Loading) {
+    return runtime.raiseError(
+        vm::TwineChar16(utf8ToUTF16String("Circular require of '" + id + "'").c_str()));
+  }
+
+  std::shared_ptr<hbc::BCProvider> bytecode = bundle->loadModule(index);
+  if (!bytecode) {
+    return runtime.raiseError(
+        vm::TwineChar16(utf8ToUTF16String("Module '" + id + "' isn't valid bytecode").c_str()));
+  }
+  states[index] = ModuleState::Loading;
+  vm::RuntimeModuleFlags flags;
+  flags.persistent = true;
+  vm::CallResult<vm::HermesValue> result = runtime.runBytecode(
+      std::move(bytecode),
+      flags,
+      id,
+      vm::Runtime::makeNullHandle<vm::Environment>());
+  if (LLVM_UNLIKELY(result == vm::ExecutionStatus::EXCEPTION)) {
+    // a later require runs it again
+    states[index] = ModuleState::NotLoaded;
+    return vm::ExecutionStatus::EXCEPTION;
+  }
+  values[index] = *result;
+  states[index] = ModuleState::Loaded;
+  return *result;
+}
+
+bool BundleWriter::addModule(const std::string& id, const std::string& path) {
+  using namespace hermes::hbc;
+  for (const Module& module : modules) {
+    if (module.id == id) {
+      llvh::errs() << "Module id " << id << " is already used\n";
+      return false;
+    }
+  }
+  auto file = llvh::MemoryBuffer::getFile(path, -1, false);
+  if (!file) {
+    llvh::errs() << "Failed to read " << path << ": " << file.getError().message() << "\n";
+    return false;
+  }
+  llvh::StringRef bytes = (*file)->getBuffer();
+  if (bytes.size() < sizeof(BytecodeFileHeader) ||
+      reinterpret_cast<const BytecodeFileHeader*>(bytes.data())->magic != MAGIC) {
+    llvh::errs() << path << " isn't HBC bytecode\n";
+    return false;
+  }
+
+  Module module;
+  module.id = id;
+  module.bytes = bytes.str();
+  llvh::SHA1 hasher;
+  hasher.update(bytes);
+  llvh::StringRef hash = hasher.final();
+  std::memcpy(module.hash.data(), hash.data(), module.hash.size());
+  modules.push_back(std::move(module));
+  return true;
+}
+
+bool BundleWriter::write(const std::string& path) const {
+  if (modules.empty()) {
+    llvh::errs() << "A bundle needs at least one module\n";
+    return false;
+  }
+  BundleHeader header{};
+  std::memcpy(header.magic, kBundleMagic, sizeof(kBundleMagic));
+  header.version = kBundleVersion;
+  header.moduleCount = static_cast<uint32_t>(modules.size());
+  header.idsOffset = sizeof(BundleHeader) + modules.size() * sizeof(BundleEntry);
+
+  std::vector<BundleEntry> entries(modules.size());
+  std::string ids;
+  for (size_t i = 0; i < modules.size(); ++i) {
+    entries[i].idOffset = static_cast<uint32_t>(ids.size());
+    entries[i].idLength = static_cast<uint32_t>(modules[i].id.size());
+    std::memcpy(entries[i].hash, modules[i].hash.data(), modules[i].hash.size());
+    ids += modules[i].id;
+  }
+  header.idsLength = ids.size();
+
+  // modules with the same bytes share one copy
+  std::unordered_map<std::string, uint64_t> offsetByHash;
+  std::vector<const Module*> stored;
+  uint64_t offset = llvh::alignTo(header.idsOffset + header.idsLength, kBundleAlignment);
+  for (size_t i = 0; i < modules.size(); ++i) {
+    auto inserted = offsetByHash.emplace(hashKey(modules[i].hash), offset);
+    entries[i].offset = inserted.first->second;
+    entries[i].length = modules[i].bytes.size();
+    if (inserted.second) {
+      stored.push_back(&modules[i]);
+      offset = llvh::alignTo(offset + modules[i].bytes.size(), kBundleAlignment);
+    }
+  }
+
+  std::error_code error;
+  llvh::raw_fd_ostream file{path, error, llvh::sys::fs::F_None};
+  if (error) {
+    llvh::errs() << "Failed to open " << path << ": " << error.message() << "\n";
+    return false;
+  }
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(BundleEntry));
+  file << ids;
+  const char padding[kBundleAlignment] = {};
+  for (const Module* module : stored) {
+    file.write(padding, llvh::alignTo(file.tell(), kBundleAlignment) - file.tell());
+    file << module->bytes;
+  }
+  file.close();
+  if (file.has_error()) {
+    file.clear_error();
+    llvh::errs() << "Failed to write " << path << "\n";
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,123 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "wrapper.hpp"
+
+// Many HBC modules packed into one file that is mapped once. Layout, little
+// endian like HBC itself:
+//   BundleHeader
+//   BundleEntry for every module, the first one is the entry module
+//   module ids, UTF-8, back to back
+//   module bytecode, each starting at a multiple of kBundleAlignment
+// Identical modules are stored once and share an offset.
+constexpr char kBundleMagic[8] = {'S', 'N', 'A', 'P', 'B', 'N', 'D', 'L'};
+constexpr uint32_t kBundleVersion = 1;
+constexpr uint64_t kBundleAlignment = 16;
+
+struct BundleHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t moduleCount;
+    uint64_t idsOffset;
+    uint64_t idsLength;
+};
+static_assert(sizeof(BundleHeader) == 32, "BundleHeader is part of the file format");
+
+struct BundleEntry {
+    uint64_t offset;
+    uint64_t length;
+    // into the ids
+    uint32_t idOffset;
+    uint32_t idLength;
+    // SHA1 of the module's bytecode
+    uint8_t hash[20];
+    uint8_t padding[4];
+};
+static_assert(sizeof(BundleEntry) == 48, "BundleEntry is part of the file format");
+
+// A bundle's index, read once. Modules are only touched when they're loaded,
+// so the pages of modules that never run are never read.
+class Bundle {
+public:
+    static bool isBundle(const hermes::Buffer& bytes);
+
+    // returns null if the index is invalid
+    static std::shared_ptr<Bundle> open(std::unique_ptr<hermes::Buffer> bytes, const std::string& sourceURL);
+
+    Bundle(const Bundle&) = delete;
+    Bundle& operator=(const Bundle&) = delete;
+
+    size_t getModuleCount() const { return ids.size(); }
+    const std::string& getModuleId(size_t index) const { return ids[index]; }
+    // -1 if there's no such module
+    int64_t findModule(const std::string& id) const;
+
+    // The provider reads straight out of the bundle's bytes, which it keeps
+    // alive. Returns null if the module isn't valid bytecode.
+    std::shared_ptr<hermes::hbc::BCProvider> loadModule(size_t index) const;
+
+private:
+    Bundle(std::shared_ptr<hermes::Buffer> bytes, std::string sourceURL);
+
+    std::shared_ptr<hermes::Buffer> bytes;
+    std::string sourceURL;
+    const BundleEntry* entries = nullptr;
+    std::vector<std::string> ids;
+    std::unordered_map<std::string, size_t> indexById;
+};
+
+// Defines require(id) on the global object of one runtime. The first
+// require of a module creates its RuntimeModule and runs it as a global
+// script, its completion value is the module's value, so bundlers should
+// end each module with its exports. Later requires return the same value.
+class BundleLoader {
+public:
+    // the entry module runs outside the loader, so it can't be required
+    BundleLoader(hermes::vm::Runtime& runtime, std::shared_ptr<Bundle> bundle);
+    BundleLoader(const BundleLoader&) = delete;
+    BundleLoader& operator=(const BundleLoader&) = delete;
+
+    bool install();
+
+private:
+    enum class ModuleState : uint8_t {
+        NotLoaded,
+        Loading,
+        Loaded,
+    };
+
+    static hermes::vm::CallResult<hermes::vm::HermesValue> require(
+        void* context, hermes::vm::Runtime& runtime, hermes::vm::NativeArgs args);
+
+    hermes::vm::CallResult<hermes::vm::HermesValue> requireModule(size_t index);
+
+    hermes::vm::Runtime& runtime;
+    std::shared_ptr<Bundle> bundle;
+    std::vector<ModuleState> states;
+    // marked as roots
+    std::vector<hermes::vm::PinnedHermesValue> values;
+};
+
+// Packs HBC files into a bundle.
+class BundleWriter {
+public:
+    // The first module added is the entry module. Returns false if the file
+    // can't be read, isn't bytecode, or the id is already used.
+    bool addModule(const std::string& id, const std::string& path);
+
+    bool write(const std::string& path) const;
+
+private:
+    struct Module {
+        std::string id;
+        std::string bytes;
+        std::array<uint8_t, 20> hash;
+    };
+
+    std::vector<Module> modules;
+};
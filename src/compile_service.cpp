@@ -0,0 +1,269 @@
+#include "compile_service.hpp"
+
+#include <algorithm>
+
+#include "hermes/BCGen/HBC/BytecodeFileFormat.h"
+#include "hermes/BCGen/HBC/BytecodeProviderFromSrc.h"
+#include "llvh/ADT/StringExtras.h"
+#include "llvh/Support/FileSystem.h"
+#include "llvh/Support/MemoryBuffer.h"
+#include "llvh/Support/Path.h"
+#include "llvh/Support/SHA1.h"
+
+namespace {
+// Generated sources would otherwise keep adding entries forever. Evicting
+// only drops the cache's reference, runtimes keep what they are running.
+constexpr size_t kMaxMemoryCacheEntries = 256;
+// Part of every cache key. Change it whenever compile() changes its flags,
+// so bytecode cached by an older build is compiled again instead of being
+// served. "b" is emitAsyncBreakCheck.
+constexpr const char* kCompileFlagsTag = "b";
+
+// Owns its bytes. The compiler needs source to be followed by a 0, which a
+// std::string always is.
+class StringBuffer : public hermes::Buffer {
+public:
+  explicit StringBuffer(std::string _storage):
+    storage(std::move(_storage))
+  {
+    data_ = reinterpret_cast<const uint8_t*>(storage.data());
+    size_ = storage.size();
+  }
+
+private:
+  std::string storage;
+};
+
+std::shared_ptr<hermes::hbc::BCProvider> providerFromBuffer(
+  std::unique_ptr<hermes::Buffer> buffer,
+  std::string& error
+) {
+  auto bytecode = hermes::hbc::BCProviderFromBuffer::createBCProviderFromBuffer(
+      std::move(buffer));
+  if (!bytecode.first) {
+    error = bytecode.second;
+    return nullptr;
+  }
+  return std::move(bytecode.first);
+}
+
+std::string cachePath(const std::string& cacheDirectory, const std::string& key) {
+  llvh::SmallString<256> path{cacheDirectory};
+  llvh::sys::path::append(path, key + ".hbc");
+  return path.str().str();
+}
+
+bool endsWith(const std::string& str, const std::string& suffix) {
+  return str.size() >= suffix.size() &&
+      str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+} // namespace
+
+CompileService::CompileService(unsigned _threadCount):
+  threadCount(std::max(_threadCount, 1u))
+{}
+
+CompileService::~CompileService() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wakeup.notify_all();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+CompileService& CompileService::getShared() {
+  // compiling is CPU bound, leave most cores to the runtimes
+  static CompileService shared{std::max(std::thread::hardware_concurrency() / 4, 1u)};
+  return shared;
+}
+
+void CompileService::compileSource(
+  std::string source,
+  std::string sourceURL,
+  std::string cacheDirectory,
+  Callback done
+) {
+  push(Job{std::move(source), false, std::move(sourceURL), std::move(cacheDirectory), std::move(done)});
+}
+
+void CompileService::compileFile(std::string path, std::string cacheDirectory, Callback done) {
+  std::string sourceURL = path;
+  push(Job{std::move(path), true, std::move(sourceURL), std::move(cacheDirectory), std::move(done)});
+}
+
+std::string CompileService::cacheKey(const std::string& source, const std::string& sourceURL) {
+  llvh::SHA1 hasher;
+  // the URL is compiled into the bytecode, so it's part of what's cached
+  hasher.update(sourceURL);
+  hasher.update(llvh::StringRef("\0", 1));
+  hasher.update(source);
+  return llvh::toHex(hasher.final(), true) + "-v" +
+      std::to_string(hermes::hbc::BYTECODE_VERSION) + "-" + kCompileFlagsTag;
+}
+
+void CompileService::push(Job job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push_back(std::move(job));
+    if (threads.size() < threadCount) {
+      threads.emplace_back([this]() { runWorker(); });
+    }
+  }
+  wakeup.notify_one();
+}
+
+void CompileService::runWorker() {
+  while (true) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wakeup.wait(lock, [this]() { return stopping || !jobs.empty(); });
+      if (jobs.empty()) {
+        return;
+      }
+      job = std::move(jobs.front());
+      jobs.pop_front();
+    }
+    std::string error;
+    std::shared_ptr<hermes::hbc::BCProvider> bytecode = load(job, error);
+    job.done(std::move(bytecode), error);
+  }
+}
+
+std::shared_ptr<hermes::hbc::BCProvider> CompileService::load(Job& job, std::string& error) {
+  if (job.isPath) {
+    if (endsWith(job.input, ".hbc")) {
+      std::unique_ptr<hermes::Buffer> buffer = mapHBCFile(job.input, true);
+      if (!buffer) {
+        error = "Failed to map " + job.input;
+        return nullptr;
+      }
+      return providerFromBuffer(std::move(buffer), error);
+    }
+    auto file = llvh::MemoryBuffer::getFile(job.input);
+    if (!file) {
+      error = "Failed to read " + job.input + ": " + file.getError().message();
+      return nullptr;
+    }
+    job.input = (*file)->getBuffer().str();
+  }
+
+  const std::string key = cacheKey(job.input, job.sourceURL);
+  {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    auto found = memoryCache.find(key);
+    if (found != memoryCache.end()) {
+      ++memoryHits;
+      memoryCacheOrder.splice(memoryCacheOrder.begin(), memoryCacheOrder, found->second.use);
+      return found->second.bytecode;
+    }
+  }
+  std::shared_ptr<hermes::hbc::BCProvider> bytecode = loadCached(key, job.cacheDirectory);
+  if (bytecode) {
+    ++diskHits;
+  } else {
+    bytecode = compile(key, job, error);
+    if (!bytecode) {
+      return nullptr;
+    }
+    ++compiles;
+  }
+  std::lock_guard<std::mutex> lock(cacheMutex);
+  // another thread may have got here first, keep one provider per key
+  auto found = memoryCache.find(key);
+  if (found != memoryCache.end()) {
+    memoryCacheOrder.splice(memoryCacheOrder.begin(), memoryCacheOrder, found->second.use);
+    return found->second.bytecode;
+  }
+  if (memoryCache.size() >= kMaxMemoryCacheEntries) {
+    memoryCache.erase(memoryCacheOrder.back());
+    memoryCacheOrder.pop_back();
+  }
+  memoryCacheOrder.push_front(key);
+  memoryCache.emplace(key, CacheEntry{bytecode, memoryCacheOrder.begin()});
+  return bytecode;
+}
+
+std::shared_ptr<hermes::hbc::BCProvider> CompileService::loadCached(
+  const std::string& key,
+  const std::string& cacheDirectory
+) {
+  if (cacheDirectory.empty()) {
+    return nullptr;
+  }
+  const std::string path = cachePath(cacheDirectory, key);
+  if (!llvh::sys::fs::exists(path)) {
+    return nullptr;
+  }
+  std::unique_ptr<hermes::Buffer> buffer = mapHBCFile(path, true);
+  if (!buffer) {
+    return nullptr;
+  }
+  // a file that doesn't load, from a crashed write or another build, is
+  // compiled again and replaced
+  std::string error;
+  return providerFromBuffer(std::move(buffer), error);
+}
+
+std::shared_ptr<hermes::hbc::BCProvider> CompileService::compile(
+  const std::string& key,
+  Job& job,
+  std::string& error
+) {
+  using namespace hermes;
+  hbc::CompileFlags flags;
+  // lazily compiled functions can't be serialized
+  flags.lazy = false;
+  // so that call time limits can interrupt loops in code compiled at runtime
+  flags.emitAsyncBreakCheck = true;
+  auto compiled = hbc::BCProviderFromSrc::createBCProviderFromSrc(
+      std::make_unique<StringBuffer>(std::move(job.input)),
+      job.sourceURL,
+      nullptr,
+      flags);
+  if (!compiled.first) {
+    error = compiled.second;
+    return nullptr;
+  }
+
+  // Serialized and loaded back so every runtime runs the same kind of
+  // provider whether it came from the compiler or from the disk cache.
+  std::string bytes;
+  {
+    llvh::raw_string_ostream os{bytes};
+    hbc::BytecodeSerializer serializer{os, BytecodeGenerationOptions::defaults()};
+    serializer.serialize(
+        *compiled.first->getBytecodeModule(), compiled.first->getSourceHash());
+  }
+
+  if (!job.cacheDirectory.empty()) {
+    // written to a temporary file and renamed over the old one so that
+    // readers never see a partial file, even from other processes
+    const std::string path = cachePath(job.cacheDirectory, key);
+    llvh::sys::fs::create_directories(job.cacheDirectory);
+    int fd;
+    llvh::SmallString<256> temporaryPath;
+    bool written = false;
+    if (!llvh::sys::fs::createUniqueFile(path + ".%%%%%%.tmp", fd, temporaryPath)) {
+      {
+        llvh::raw_fd_ostream file{fd, true};
+        file << bytes;
+        file.close();
+        written = !file.has_error();
+        file.clear_error();
+      }
+      written = written && !llvh::sys::fs::rename(temporaryPath, path);
+      if (!written) {
+        llvh::sys::fs::remove(temporaryPath);
+      }
+    }
+    if (!written) {
+      llvh::errs() << "Failed to write " << path << " to the bytecode cache\n";
+    }
+  }
+
+  return providerFromBuffer(std::make_unique<StringBuffer>(std::move(bytes)), error);
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "wrapper.hpp"
+
+// Compiles JS source to bytecode on background threads so that a runtime
+// never waits on the compiler on its own thread.
+// Results are cached by the SHA1 of the source and the bytecode version, in
+// memory for the 256 most recently used sources and optionally on disk in a
+// directory that is shared between runs, so only the first request for some
+// source pays for compiling it. Providers are immutable once created and can be run by any
+// number of runtimes.
+class CompileService {
+public:
+    // called on a compile thread, bytecode is null if loading or compiling
+    // failed and error says why
+    using Callback = std::function<void(
+        std::shared_ptr<hermes::hbc::BCProvider> bytecode,
+        const std::string& error)>;
+
+    explicit CompileService(unsigned threadCount);
+    CompileService(const CompileService&) = delete;
+    CompileService& operator=(const CompileService&) = delete;
+    // finishes every queued job first
+    ~CompileService();
+
+    // one service for the whole process, its threads start on the first job
+    static CompileService& getShared();
+
+    // cacheDirectory can be empty to only cache in memory, thread safe
+    void compileSource(std::string source, std::string sourceURL, std::string cacheDirectory, Callback done);
+    // Reads the file on a compile thread. Files ending in .hbc are loaded as
+    // they are, anything else is compiled like compileSource.
+    void compileFile(std::string path, std::string cacheDirectory, Callback done);
+
+    // "<sha1 of the URL and source>-v<bytecode version>-<compile flags>",
+    // the name of the cache file without .hbc
+    static std::string cacheKey(const std::string& source, const std::string& sourceURL);
+
+    uint64_t getMemoryHits() const { return memoryHits; }
+    uint64_t getDiskHits() const { return diskHits; }
+    uint64_t getCompiles() const { return compiles; }
+
+private:
+    struct Job {
+        // source, or a path if isPath
+        std::string input;
+        bool isPath;
+        std::string sourceURL;
+        std::string cacheDirectory;
+        Callback done;
+    };
+
+    void push(Job job);
+    void runWorker();
+    std::shared_ptr<hermes::hbc::BCProvider> load(Job& job, std::string& error);
+    std::shared_ptr<hermes::hbc::BCProvider> loadCached(const std::string& key, const std::string& cacheDirectory);
+    std::shared_ptr<hermes::hbc::BCProvider> compile(
+        const std::string& key, Job& job, std::string& error);
+
+    const unsigned threadCount;
+
+    // guards everything below
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<Job> jobs;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+
+    struct CacheEntry {
+        std::shared_ptr<hermes::hbc::BCProvider> bytecode;
+        // its key in memoryCacheOrder
+        std::list<std::string>::iterator use;
+    };
+
+    // guards memoryCache and memoryCacheOrder
+    std::mutex cacheMutex;
+    std::unordered_map<std::string, CacheEntry> memoryCache;
+    // keys, most recently used first, the last one is evicted when it's full
+    std::list<std::string> memoryCacheOrder;
+
+    std::atomic<uint64_t> memoryHits{0};
+    std::atomic<uint64_t> diskHits{0};
+    std::atomic<uint64_t> compiles{0};
+};
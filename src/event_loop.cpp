@@ -0,0 +1,330 @@
+#include "event_loop.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "string_bridge.hpp"
+
+namespace {
+// timers that repeat faster than this would starve everything else
+constexpr double kMinInterval = 1.0;
+
+std::chrono::steady_clock::duration toDuration(double milliseconds) {
+  return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double, std::milli>(milliseconds));
+}
+
+// missing, negative and NaN delays all mean run as soon as possible
+double getDelay(hermes::vm::NativeArgs& args) {
+  hermes::vm::HermesValue delay = args.getArg(1);
+  if (!delay.isNumber() || !(delay.getNumber() > 0)) {
+    return 0;
+  }
+  return delay.getNumber();
+}
+} // namespace
+
+EventLoop::EventLoop(hermes::vm::Runtime& _runtime):
+  runtime(_runtime)
+{
+  runtime.addCustomRootsFunction(
+      [this](hermes::vm::GC*, hermes::vm::RootAcceptor& acceptor) {
+        for (auto& entry : callbacks) {
+          acceptor.accept(entry.second.function);
+          for (auto& argument : entry.second.arguments) {
+            acceptor.accept(argument);
+          }
+        }
+      });
+}
+
+bool EventLoop::install() {
+  return defineGlobalFunction(runtime, "setTimeout", setTimeout, this, 2) &&
+      defineGlobalFunction(runtime, "setInterval", setInterval, this, 2) &&
+      defineGlobalFunction(runtime, "setImmediate", setImmediate, this, 1) &&
+      defineGlobalFunction(runtime, "clearTimeout", clearCallback, this, 1) &&
+      defineGlobalFunction(runtime, "clearInterval", clearCallback, this, 1) &&
+      defineGlobalFunction(runtime, "clearImmediate", clearCallback, this, 1);
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> EventLoop::setTimeout(
+  void* context,
+  hermes::vm::Runtime& runtime,
+  hermes::vm::NativeArgs args
+) {
+  return static_cast<EventLoop*>(context)->addCallback(
+      args, 2, getDelay(args), -1, false);
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> EventLoop::setInterval(
+  void* context,
+  hermes::vm::Runtime& runtime,
+  hermes::vm::NativeArgs args
+) {
+  const double interval = std::max(getDelay(args), kMinInterval);
+  return static_cast<EventLoop*>(context)->addCallback(
+      args, 2, interval, interval, false);
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> EventLoop::setImmediate(
+  void* context,
+  hermes::vm::Runtime& runtime,
+  hermes::vm::NativeArgs args
+) {
+  return static_cast<EventLoop*>(context)->addCallback(args, 1, 0, -1, true);
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> EventLoop::clearCallback(
+  void* context,
+  hermes::vm::Runtime& runtime,
+  hermes::vm::NativeArgs args
+) {
+  // cancelled timers and immediates are skipped when they come up
+  hermes::vm::HermesValue id = args.getArg(0);
+  // ids are uint32, anything else can't name a callback and casting it
+  // would be undefined
+  if (id.isNumber()) {
+    double number = id.getNumber();
+    if (number >= 0 && number <= std::numeric_limits<uint32_t>::max() &&
+        number == std::floor(number)) {
+      static_cast<EventLoop*>(context)->callbacks.erase(
+          static_cast<uint32_t>(number));
+    }
+  }
+  return hermes::vm::HermesValue::encodeUndefinedValue();
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> EventLoop::addCallback(
+  hermes::vm::NativeArgs args,
+  unsigned firstExtraArg,
+  double delay,
+  double interval,
+  bool immediate
+) {
+  using namespace hermes;
+  auto function = args.dyncastArg<vm::Callable>(0);
+  if (!function) {
+    return runtime.raiseTypeError("callback must be a function");
+  }
+
+  const uint32_t id = nextId++;
+  TimerCallback& callback = callbacks.emplace(
+      id,
+      TimerCallback{
+          vm::PinnedHermesValue(function.getHermesValue()), {}, interval})
+      .first->second;
+  for (unsigned i = firstExtraArg; i < args.getArgCount(); ++i) {
+    callback.arguments.push_back(vm::PinnedHermesValue(args.getArg(i)));
+  }
+
+  if (immediate) {
+    immediates.push_back(id);
+  } else {
+    timers.push(Timer{
+        std::chrono::steady_clock::now() + toDuration(delay),
+        nextSequence++,
+        id});
+  }
+  return vm::HermesValue::encodeUntrustedNumberValue(id);
+}
+
+bool EventLoop::runCallback(uint32_t id) {
+  using namespace hermes;
+  auto found = callbacks.find(id);
+  if (found == callbacks.end()) {
+    // cancelled
+    return true;
+  }
+
+  vm::GCScopeMarkerRAII marker{runtime};
+  // copy everything out of the entry since the callback can clear it
+  auto function =
+      runtime.makeHandle(vm::vmcast<vm::Callable>(found->second.function));
+  llvh::SmallVector<vm::Handle<>, 4> arguments;
+  for (const vm::PinnedHermesValue& argument : found->second.arguments) {
+    arguments.push_back(runtime.makeHandle(argument));
+  }
+  if (found->second.interval < 0) {
+    callbacks.erase(found);
+  } else {
+    // reschedule before calling so that clearInterval inside the callback
+    // cancels the next run
+    timers.push(Timer{
+        std::chrono::steady_clock::now() + toDuration(found->second.interval),
+        nextSequence++,
+        id});
+  }
+
+  auto callResult = callFunction(runtime, function, arguments);
+  if (LLVM_UNLIKELY(callResult == vm::ExecutionStatus::EXCEPTION)) {
+    return reportException();
+  }
+  return true;
+}
+
+bool EventLoop::reportException() {
+  // Make sure stdout catches up to stderr.
+  llvh::outs().flush();
+  runtime.printException(
+      llvh::errs(), runtime.makeHandle(runtime.getThrownValue()));
+  runtime.clearThrownValue();
+  return false;
+}
+
+bool EventLoop::performCheckpoint() {
+  using namespace hermes;
+  if (!runtime.useJobQueue()) {
+    return true;
+  }
+  vm::GCScope scope(runtime);
+  bool succeeded = true;
+  // draining stops at a job that throws, the jobs after it still have to run
+  while (LLVM_UNLIKELY(runtime.drainJobs() == vm::ExecutionStatus::EXCEPTION)) {
+    succeeded = reportException();
+  }
+  runtime.clearKeptObjects();
+  return succeeded;
+}
+
+bool EventLoop::hasLiveTimer() {
+  while (!timers.empty() &&
+         callbacks.find(timers.top().id) == callbacks.end()) {
+    timers.pop();
+  }
+  return !timers.empty();
+}
+
+bool EventLoop::runUntil(const std::function<bool()>& until) {
+  using namespace hermes;
+  vm::GCScope scope(runtime);
+  bool succeeded = performCheckpoint();
+
+  // every task is followed by a microtask checkpoint
+  auto finishTask = [&](bool taskSucceeded) {
+    succeeded = performCheckpoint() && taskSucceeded && succeeded;
+    if (taskHook) {
+      taskHook();
+    }
+    return stopping || (until && until());
+  };
+
+  while (!stopping && !(until && until())) {
+    vm::GCScopeMarkerRAII marker{scope};
+    bool ranTask = false;
+
+    // tasks posted during this iteration wait for the next one so that the
+    // host can't starve timers
+    size_t hostTaskCount;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      hostTaskCount = hostTasks.size();
+    }
+    for (size_t i = 0; i < hostTaskCount; ++i) {
+      HostTask task;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        task = std::move(hostTasks.front());
+        hostTasks.pop_front();
+      }
+      ranTask = true;
+      vm::GCScopeMarkerRAII taskMarker{scope};
+      bool taskSucceeded =
+          task(runtime) != vm::ExecutionStatus::EXCEPTION || reportException();
+      if (finishTask(taskSucceeded)) {
+        return succeeded;
+      }
+    }
+
+    const size_t immediateCount = immediates.size();
+    for (size_t i = 0; i < immediateCount; ++i) {
+      const uint32_t id = immediates.front();
+      immediates.pop_front();
+      ranTask = true;
+      if (finishTask(runCallback(id))) {
+        return succeeded;
+      }
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    while (hasLiveTimer() && timers.top().deadline <= now) {
+      const uint32_t id = timers.top().id;
+      timers.pop();
+      ranTask = true;
+      if (finishTask(runCallback(id))) {
+        return succeeded;
+      }
+    }
+
+    if (ranTask) {
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!hostTasks.empty() || !immediates.empty() || stopping) {
+      continue;
+    }
+    const bool timerPending = hasLiveTimer();
+    if (!timerPending && refs == 0) {
+      // idle
+      break;
+    }
+    if (timerPending) {
+      wakeup.wait_until(lock, timers.top().deadline);
+    } else {
+      wakeup.wait(lock);
+    }
+  }
+  return succeeded;
+}
+
+void EventLoop::postTask(const std::string& functionName, const CallArguments& args) {
+  postHostTask(
+      [functionName, args](hermes::vm::Runtime& runtime)
+          -> hermes::vm::ExecutionStatus {
+        auto function = getGlobalFunction(runtime, functionName);
+        if (LLVM_UNLIKELY(function == hermes::vm::ExecutionStatus::EXCEPTION)) {
+          return hermes::vm::ExecutionStatus::EXCEPTION;
+        }
+        if (!*function) {
+          const std::string message = functionName + " is not a function";
+          return runtime.raiseTypeError(
+              hermes::vm::TwineChar16(utf8ToUTF16String(message).c_str()));
+        }
+        return callFunction(runtime, *function, args).getStatus();
+      });
+}
+
+void EventLoop::postHostTask(HostTask task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    hostTasks.push_back(std::move(task));
+  }
+  wakeup.notify_one();
+}
+
+void EventLoop::ref() {
+  std::lock_guard<std::mutex> lock(mutex);
+  ++refs;
+}
+
+void EventLoop::unref() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    --refs;
+  }
+  wakeup.notify_one();
+}
+
+void EventLoop::resume() {
+  std::lock_guard<std::mutex> lock(mutex);
+  stopping = false;
+}
+
+void EventLoop::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wakeup.notify_one();
+}
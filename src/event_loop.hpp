@@ -0,0 +1,117 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+#include "wrapper.hpp"
+
+// Runs everything a runtime has queued once its script or call returns:
+// timers, immediates and tasks posted by the host, with a microtask
+// checkpoint after every task.
+// install() defines setTimeout, setInterval, setImmediate and the matching
+// clear functions on the global object.
+// Only run(), install() and performCheckpoint() have to be called on the JS
+// thread, posting tasks and ref counting are thread safe.
+class EventLoop {
+public:
+    using HostTask = std::function<hermes::vm::ExecutionStatus(hermes::vm::Runtime&)>;
+
+    explicit EventLoop(hermes::vm::Runtime& runtime);
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    bool install();
+
+    // Runs tasks until the loop is idle or stop() is called. Idle means there
+    // are no timers, immediates or host tasks left and the host holds no refs.
+    // Waits on a condition variable when the next task is a timer, it never
+    // spins. Returns false if a task threw, the loop keeps going after that.
+    bool run() { return runUntil(nullptr); }
+    // same as run() but also returns once until returns true
+    bool runUntil(const std::function<bool()>& until);
+
+    // Drains the microtask queue, returns false if a job threw.
+    bool performCheckpoint();
+
+    // Calls a function on the global object as a macrotask.
+    void postTask(const std::string& functionName, const CallArguments& args);
+    void postHostTask(HostTask task);
+
+    // While the host holds a ref, run() waits for tasks instead of returning
+    // when it's idle. Take one for every piece of work that will post a task
+    // back, and release it after posting.
+    void ref();
+    void unref();
+
+    // Makes run() return after the current task. It keeps returning right
+    // away until resume(), so a stop that comes in just before a run isn't
+    // lost.
+    void stop();
+    void resume();
+
+    // called on the JS thread after every task and its microtask checkpoint
+    void setTaskHook(std::function<void()> hook) { taskHook = std::move(hook); }
+
+private:
+    struct TimerCallback {
+        hermes::vm::PinnedHermesValue function;
+        std::vector<hermes::vm::PinnedHermesValue> arguments;
+        // negative for timeouts and immediates
+        double interval;
+    };
+
+    struct Timer {
+        std::chrono::steady_clock::time_point deadline;
+        // keeps timers with the same deadline in the order they were set
+        uint64_t sequence;
+        uint32_t id;
+
+        bool operator>(const Timer& other) const {
+            return deadline != other.deadline ? deadline > other.deadline : sequence > other.sequence;
+        }
+    };
+
+    static hermes::vm::CallResult<hermes::vm::HermesValue> setTimeout(
+        void* context, hermes::vm::Runtime& runtime, hermes::vm::NativeArgs args);
+    static hermes::vm::CallResult<hermes::vm::HermesValue> setInterval(
+        void* context, hermes::vm::Runtime& runtime, hermes::vm::NativeArgs args);
+    static hermes::vm::CallResult<hermes::vm::HermesValue> setImmediate(
+        void* context, hermes::vm::Runtime& runtime, hermes::vm::NativeArgs args);
+    static hermes::vm::CallResult<hermes::vm::HermesValue> clearCallback(
+        void* context, hermes::vm::Runtime& runtime, hermes::vm::NativeArgs args);
+
+    // interval is negative for anything that runs once, delay is ignored for
+    // immediates
+    hermes::vm::CallResult<hermes::vm::HermesValue> addCallback(
+        hermes::vm::NativeArgs args, unsigned firstExtraArg, double delay, double interval, bool immediate);
+
+    // returns false if the callback threw
+    bool runCallback(uint32_t id);
+    bool reportException();
+
+    // pops cancelled timers, returns true if a live timer is left
+    bool hasLiveTimer();
+
+    hermes::vm::Runtime& runtime;
+
+    // JS thread only, marked as roots
+    std::unordered_map<uint32_t, TimerCallback> callbacks;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+    std::deque<uint32_t> immediates;
+    uint32_t nextId = 1;
+    uint64_t nextSequence = 0;
+    std::function<void()> taskHook;
+
+    // shared with other threads
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<HostTask> hostTasks;
+    uint32_t refs = 0;
+    std::atomic<bool> stopping{false};
+};
@@ -0,0 +1,125 @@
+#include "heap_snapshot.hpp"
+
+#include <atomic>
+#include <mutex>
+
+#include "hermes/VM/Runtime.h"
+#include "llvh/Support/FileSystem.h"
+#include "llvh/Support/Process.h"
+
+#ifndef _WIN32
+#include <csignal>
+#endif
+
+namespace {
+// bumped by the signal handler, atomics without locks are safe to use there
+std::atomic<uint32_t> snapshotSignals{0};
+std::atomic<uint32_t> nextSnapshot{1};
+
+#ifndef _WIN32
+void onSnapshotSignal(int) {
+  snapshotSignals.fetch_add(1, std::memory_order_relaxed);
+}
+
+void installSignalHandler() {
+  static std::once_flag installed;
+  std::call_once(installed, []() {
+    struct sigaction action{};
+    action.sa_handler = onSnapshotSignal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &action, nullptr);
+  });
+}
+#endif
+} // namespace
+
+bool heapSnapshotSignalSupported() {
+#ifdef _WIN32
+  return false;
+#else
+  return true;
+#endif
+}
+
+HeapSnapshotter::HeapSnapshotter(
+  hermes::vm::Runtime& _runtime,
+  std::string _prefix,
+  uint32_t _everyCalls,
+  bool _onSignal,
+  bool _timeline
+):
+  runtime(_runtime),
+  prefix(std::move(_prefix)),
+  everyCalls(_everyCalls),
+  onSignal(_onSignal),
+  timeline(_timeline),
+  signalsSeen(snapshotSignals.load(std::memory_order_relaxed))
+{
+#ifndef _WIN32
+  if (onSignal) {
+    installSignalHandler();
+  }
+#endif
+#ifdef HERMES_MEMORY_INSTRUMENTATION
+  if (timeline) {
+    runtime.enableAllocationLocationTracker();
+  }
+#endif
+}
+
+void HeapSnapshotter::afterCall() {
+  if (everyCalls != 0 && ++calls == everyCalls) {
+    calls = 0;
+    write();
+    return;
+  }
+  poll();
+}
+
+void HeapSnapshotter::poll() {
+  if (!onSignal) {
+    return;
+  }
+  const uint32_t signals = snapshotSignals.load(std::memory_order_relaxed);
+  if (signals != signalsSeen) {
+    // signals that arrive while it's writing get one more snapshot
+    signalsSeen = signals;
+    write();
+  }
+}
+
+bool HeapSnapshotter::write() {
+#ifdef HERMES_MEMORY_INSTRUMENTATION
+  const std::string path = prefix + "-" +
+      std::to_string(llvh::sys::Process::getProcessId()) + "-" +
+      std::to_string(nextSnapshot.fetch_add(1, std::memory_order_relaxed)) +
+      (timeline ? ".heaptimeline" : ".heapsnapshot");
+  // renamed once it's complete so that nothing picks up half a snapshot
+  const std::string temporary = path + ".tmp";
+  {
+    std::error_code error;
+    llvh::raw_fd_ostream file{temporary, error, llvh::sys::fs::F_None};
+    if (error) {
+      llvh::errs() << "Failed to open " << temporary << ": " << error.message() << "\n";
+      return false;
+    }
+    runtime.getHeap().createSnapshot(file, false);
+    file.close();
+    if (file.has_error()) {
+      file.clear_error();
+      llvh::errs() << "Failed to write " << temporary << "\n";
+      return false;
+    }
+  }
+  if (std::error_code error = llvh::sys::fs::rename(temporary, path)) {
+    llvh::errs() << "Failed to rename " << temporary << ": " << error.message() << "\n";
+    return false;
+  }
+  llvh::errs() << "Wrote heap snapshot " << path << "\n";
+  return true;
+#else
+  llvh::errs() << "Heap snapshots need HERMES_MEMORY_INSTRUMENTATION\n";
+  return false;
+#endif
+}
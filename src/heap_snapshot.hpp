@@ -0,0 +1,52 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+namespace hermes {
+namespace vm {
+class Runtime;
+}
+}
+
+// Writes Chrome DevTools heap snapshots of one runtime, streamed straight
+// to disk. With the allocation timeline on they include allocation stacks
+// and are written as .heaptimeline instead of .heapsnapshot.
+// Files are named PREFIX-PID-N with N counting every snapshot in the
+// process, so runtimes in a pool don't overwrite each other.
+// Snapshots are only taken on the runtime's thread, between calls and
+// tasks, never in the middle of running JS.
+class HeapSnapshotter {
+public:
+    // everyCalls is 0 for no snapshots after calls. onSignal takes a
+    // snapshot after the next call or task once SIGUSR2 arrives.
+    HeapSnapshotter(
+        hermes::vm::Runtime& runtime,
+        std::string prefix,
+        uint32_t everyCalls,
+        bool onSignal,
+        bool timeline
+    );
+    HeapSnapshotter(const HeapSnapshotter&) = delete;
+    HeapSnapshotter& operator=(const HeapSnapshotter&) = delete;
+
+    // after every call the host makes
+    void afterCall();
+    // after every task, only checks for the signal
+    void poll();
+
+    // returns false if the file couldn't be written
+    bool write();
+
+private:
+    hermes::vm::Runtime& runtime;
+    const std::string prefix;
+    const uint32_t everyCalls;
+    const bool onSignal;
+    const bool timeline;
+    uint32_t calls = 0;
+    // signals already handled
+    uint32_t signalsSeen;
+};
+
+// the signal HeapSnapshotter listens to, false where there isn't one
+bool heapSnapshotSignalSupported();
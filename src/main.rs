@@ -11,9 +11,24 @@ use core::cell::RefCell;
 use std::env;
 use std::fs;
 use std::ops::DerefMut;
+use std::time::Instant;
+
+mod async_native;
+mod batch;
+mod bench;
+mod native;
+mod object_shape;
 
 include_cpp! {
     #include "wrapper.hpp"
+    #include "event_loop.hpp"
+    #include "binding_table.hpp"
+    #include "async_native.hpp"
+    #include "runtime_pool.hpp"
+    #include "zygote.hpp"
+    #include "bundle.hpp"
+    #include "native_stats.hpp"
+    #include "metrics.hpp"
     generate!("hermes::Buffer")
     safety!(unsafe_ffi)
     generate!("Handle")
@@ -33,6 +48,10 @@ include_cpp! {
     generate!("SymbolIDHandleResult")
     concrete!("hermes::vm::Handle<hermes::vm::NativeFunction>", NativeFunctionHandle)
     subclass!("NativeVFunction", BasicRustJSFunction)
+    subclass!("NativeVFunction", IncrementRustJSFunction)
+    generate!("FastFunctionContext")
+    generate!("AsyncFunctionContext")
+    generate!("BindingTable")
     //generate!("hermes::vm::NativeFunction")
     //generate!("hermes::vm::JSObject")
     //generate!("hermes::vm::ExecutionStatus")
@@ -41,6 +60,23 @@ include_cpp! {
     generate!("StringPrimitiveHandle")
     generate!("hermes::vm::StringView")
     generate!("executeHBCBytecode")
+    generate!("mapHBCFile")
+    generate!("RuntimeOptions")
+    generate!("GCReleaseUnused")
+    generate!("Engine")
+    generate!("EngineStatus")
+    generate!("MemoryPressureAction")
+    generate!("CallArguments")
+    generate!("EventLoop")
+    generate!("peakResidentSetBytes")
+    generate!("currentResidentSetBytes")
+    generate!("RuntimePool")
+    generate!("Zygote")
+    generate!("BundleWriter")
+    generate!("setNativeSampleRate")
+    generate!("dumpNativeStats")
+    generate!("MetricsExporter")
+    generate!("MetricsFormat")
 }
 
 #[subclass]
@@ -54,7 +90,7 @@ impl ffi::NativeVFunction_methods for BasicRustJSFunction {
         mut runtime: Pin<&mut ffi::hermes::vm::Runtime>,
         args: Pin<&mut ffi::hermes::vm::NativeArgs>
     ) -> cxx::UniquePtr<ffi::NativeVFunctionReturnValue> {
-        println!("invoke called with {} args", ffi::Arguments::getArgCount(args.borrow()).0);
+        eprintln!("invoke called with {} args", ffi::Arguments::getArgCount(args.borrow()).0);
         let undefined = ffi::NativeVFunctionReturnValue::encodeUndefined().within_unique_ptr();
         if ffi::Arguments::getArgCount(args.borrow()).0 < 1 {
             return undefined
@@ -67,7 +103,7 @@ impl ffi::NativeVFunction_methods for BasicRustJSFunction {
                     false => None,
                 }
             })(argument_value.borrow()).expect("expected argument to be a number");
-            println!("argment is {}", argument);
+            eprintln!("argment is {}", argument);
         }
         if ffi::Arguments::getArgCount(args.borrow()).0 < 2 {
             return undefined;
@@ -81,12 +117,12 @@ impl ffi::NativeVFunction_methods for BasicRustJSFunction {
         })(argument_handle.borrow()).expect("expected argument to be a string");
         let argument_string_view = argument_string.as_mut().expect("invalid pointer to string").createStringView(runtime.as_mut()).within_unique_ptr();
         let argument_encoding =  argument_string_view.as_ref().expect("invalid string view pointer").isASCII();
-        println!("argment is in {} encoding", if argument_encoding { "ASCII" } else { "UTF16" });
+        eprintln!("argment is in {} encoding", if argument_encoding { "ASCII" } else { "UTF16" });
         if argument_encoding == false {
             unsafe {
                 let argument_string_slice = core::slice::from_raw_parts(argument_string_view.castToChar16Ptr(), argument_string_view.length());
                 for argument_char16 in argument_string_slice.iter() {
-                    print!("{:X?} ", argument_char16.0);
+                    eprint!("{:X?} ", argument_char16.0);
                 }
             }
         }
@@ -94,11 +130,91 @@ impl ffi::NativeVFunction_methods for BasicRustJSFunction {
     }
 }
 
+// nativeIncrement, the same function as nativeIncrementFast on the virtual
+// call path, for comparing the two
+#[subclass]
+#[derive(Default)]
+pub struct IncrementRustJSFunction;
+
+impl ffi::NativeVFunction_methods for IncrementRustJSFunction {
+    fn invoke(
+        &self,
+        _context: &ffi::BindingsDefine,
+        _runtime: Pin<&mut ffi::hermes::vm::Runtime>,
+        args: Pin<&mut ffi::hermes::vm::NativeArgs>
+    ) -> cxx::UniquePtr<ffi::NativeVFunctionReturnValue> {
+        let argument_value = ffi::Arguments::getArg(args.borrow(), autocxx::c_uint::from(0)).within_unique_ptr();
+        let argument = unsafe {
+            match argument_value.isNumber() {
+                true => argument_value.getNumber(std::ptr::null_mut()),
+                false => f64::NAN,
+            }
+        };
+        ffi::NativeVFunctionReturnValue::encodeNumber(argument + 1.0).within_unique_ptr()
+    }
+}
+
+native::typed_native! {
+    fn native_increment_fast(value: f64) -> f64 {
+        value + 1.0
+    }
+}
+
+// nativeEchoString(value), decodes a string and returns a copy of it
+native::typed_native! {
+    fn native_echo_string(value: native::JsStr) -> String {
+        value.to_string()
+    }
+}
+
+object_shape::js_object! {
+    struct Point {
+        x: f64,
+        y: f64,
+    }
+}
+
+// midpoint(a, b) on {x, y} objects
+native::typed_native! {
+    fn native_midpoint(a: Point, b: Point) -> Point {
+        Point { x: (a.x + b.x) / 2.0, y: (a.y + b.y) / 2.0 }
+    }
+}
+
+// readFileAsync(path), resolves with the file's bytes in an ArrayBuffer
+async_native::async_native! {
+    fn read_file_async(path: native::JsStr) -> Result<Vec<u8>, String> {
+        let path = path.to_string();
+        move || fs::read(&path).map_err(|error| format!("{}: {}", path, error))
+    }
+}
+
 #[subclass]
 #[derive(Default)]
 pub struct RustBindingsDefine {
     basic_function: Rc<RefCell<BasicRustJSFunction>>,
     basic_function_context: Option<Pin<Box<ffi::BindingsDefine_FunctionContext>>>,
+    increment_function: Rc<RefCell<IncrementRustJSFunction>>,
+    increment_function_context: Option<Pin<Box<ffi::BindingsDefine_FunctionContext>>>,
+    increment_fast_context: Option<Pin<Box<ffi::FastFunctionContext>>>,
+    echo_string_context: Option<Pin<Box<ffi::FastFunctionContext>>>,
+    midpoint_context: Option<Pin<Box<ffi::FastFunctionContext>>>,
+    read_file_async_context: Option<Pin<Box<ffi::AsyncFunctionContext>>>,
+    // built in start() once the contexts exist, installed into every runtime
+    binding_table: Option<UniquePtr<ffi::BindingTable>>,
+}
+
+pub fn make_bindings() -> Rc<RefCell<RustBindingsDefine>> {
+    let bindings: Rc<RefCell<RustBindingsDefine>> = RustBindingsDefine::new_rust_owned(make_rust_bindings_define());
+    bindings.as_ref().borrow_mut().deref_mut().start();
+    bindings
+}
+
+// Bindings that install nothing, to measure what installing the others costs
+pub fn make_empty_bindings() -> Rc<RefCell<RustBindingsDefine>> {
+    let mut define = make_rust_bindings_define();
+    define.binding_table = Some(ffi::BindingTable::new().within_unique_ptr());
+    RustBindingsDefine::new_rust_owned(define)
 }
 
 fn make_rust_bindings_define() -> RustBindingsDefine {
@@ -106,59 +222,526 @@ fn make_rust_bindings_define() -> RustBindingsDefine {
     RustBindingsDefine {
         basic_function: basic_function,
         basic_function_context: Default::default(),
+        increment_function: IncrementRustJSFunction::default_rust_owned(),
+        increment_function_context: Default::default(),
+        increment_fast_context: Default::default(),
+        echo_string_context: Default::default(),
+        midpoint_context: Default::default(),
+        read_file_async_context: Default::default(),
+        binding_table: None,
         cpp_peer: Default::default(), // to do: figure out how to make this a argument
     }
 }
 
 impl BindingsDefine_methods for RustBindingsDefine {
     fn start(&mut self) {
-        println!("start called");
+        eprintln!("start called");
         self.basic_function_context = Some(self.as_ref().makeFunctionContext(self.basic_function.as_ref().borrow().as_ref()).within_box());
+        self.increment_function_context = Some(self.as_ref().makeFunctionContext(self.increment_function.as_ref().borrow().as_ref()).within_box());
+        self.increment_fast_context = Some(ffi::FastFunctionContext::new(
+            native::function_pointer(native_increment_fast),
+            std::ptr::null_mut()).within_box());
+        self.echo_string_context = Some(ffi::FastFunctionContext::new(
+            native::function_pointer(native_echo_string),
+            std::ptr::null_mut()).within_box());
+        self.midpoint_context = Some(ffi::FastFunctionContext::new(
+            native::function_pointer(native_midpoint),
+            std::ptr::null_mut()).within_box());
+        self.read_file_async_context = Some(ffi::AsyncFunctionContext::new(
+            async_native::function_pointer(read_file_async),
+            std::ptr::null_mut()).within_box());
+
+        let mut binding_table = ffi::BindingTable::new().within_unique_ptr();
+        let added = binding_table.pin_mut().addFunction(
+            "nativeTest",
+            &self.basic_function_context.as_ref().expect("basic function context is null"),
+            autocxx::c_uint::from(0u32))
+            && binding_table.pin_mut().addFunction(
+                "nativeIncrement",
+                &self.increment_function_context.as_ref().expect("increment function context is null"),
+                autocxx::c_uint::from(1u32))
+            && binding_table.pin_mut().addFastFunction(
+                "nativeIncrementFast",
+                &self.increment_fast_context.as_ref().expect("increment fast context is null"),
+                autocxx::c_uint::from(1u32))
+            && binding_table.pin_mut().addFastFunction(
+                "nativeEchoString",
+                &self.echo_string_context.as_ref().expect("echo string context is null"),
+                autocxx::c_uint::from(1u32))
+            && binding_table.pin_mut().addFastFunction(
+                "midpoint",
+                &self.midpoint_context.as_ref().expect("midpoint context is null"),
+                autocxx::c_uint::from(2u32))
+            && binding_table.pin_mut().addAsyncFunction(
+                "readFileAsync",
+                &self.read_file_async_context.as_ref().expect("read file async context is null"),
+                autocxx::c_uint::from(1u32));
+        assert!(added, "invalid binding path");
+        self.binding_table = Some(binding_table);
     }
 
-    fn install(&self, mut runtime: Pin<&mut ffi::hermes::vm::Runtime>, bindings_def: &ffi::BindingsDefine) {
-        use ffi::ToCppString;
-        println!("install called");
-        
-        let normal_def_property_flags = ffi::hermes::vm::DefinePropertyFlags::getNewNonEnumerableFlags();
+    fn install(&self, runtime: Pin<&mut ffi::hermes::vm::Runtime>, _bindings_def: &ffi::BindingsDefine) {
+        eprintln!("install called");
+        let binding_table = self.binding_table.as_ref().expect("bindings weren't started");
+        assert!(binding_table.install(runtime), "failed to install bindings");
+    }
+}
 
-        let mut function_bind_def: UniquePtr<ffi::NativeFunctionDefine> = bindings_def.functionWithOnlyRuntime(runtime.as_mut());
-        let function_name_str = "nativeTest".into_cpp();
-        let symbol_ref = bindings_def.createASCIIRef(function_name_str.as_ref().expect("failed to create ASCII ref"));
-        let symbol_handle_result = bindings_def.getSymbolHandleASCII(runtime.as_mut(), symbol_ref).within_unique_ptr();
-        let symbol_handle = bindings_def.ignoreAllocationFailure(runtime.as_mut(), symbol_handle_result).within_unique_ptr();
-        function_bind_def.as_mut().expect("null function bind deref").setFunction(
-            symbol_handle.get().within_unique_ptr(),
-            &self.basic_function_context.as_ref().expect("basic function context is null"),
-            autocxx::c_uint::from(0u32));
-        let function_bind_result = function_bind_def.as_ref().expect("null function bind deref").define();
-        assert!(function_bind_result, "failed to define function bind");
+#[derive(Clone, Copy, PartialEq)]
+pub enum LoadMode {
+    // map the file and let Hermes read the bytecode out of the mapping
+    Mapped,
+    // read the whole file into memory first
+    Read,
+}
+
+impl LoadMode {
+    pub fn name(&self) -> &'static str {
+        match self {
+            LoadMode::Mapped => "mmap",
+            LoadMode::Read => "read",
+        }
     }
 }
 
-fn main() {
-    let args: Vec<String> = env::args().collect();
+struct Options {
+    input_file_path: String,
+    load_mode: LoadMode,
+    advise_startup: bool,
+    report_startup: bool,
+    zygote_socket: Option<String>,
+    zygote_max_children: u32,
+    native_sample_rate: Option<u32>,
+    native_stats_path: Option<String>,
+    metrics_target: Option<String>,
+    metrics_format: ffi::MetricsFormat,
+    metrics_interval_ms: u32,
+    batch: Option<batch::BatchOptions>,
+    runtime_options: UniquePtr<ffi::RuntimeOptions>,
+}
 
-    if args.len() != 2 {
-        eprintln!("Usage: {} <input_filename>", args[0]);
-        std::process::exit(1);
+fn print_usage(program: &str) {
+    eprintln!("Usage: {} [options] <input_filename>", program);
+    eprintln!("       {} bench <benchmark> [arguments]", program);
+    eprintln!("       {} pack <output.bundle> <[id=]module.hbc>...", program);
+    eprintln!("Options:");
+    eprintln!("  --load=mmap|read    how to load the bytecode, defaults to mmap");
+    eprintln!("  --no-advise         don't prefetch the startup sections of a mapped file");
+    eprintln!("  --report-startup    print load time, total time and peak RSS to stderr");
+    eprintln!("  --zygote=SOCKET     run the top level code once, then fork a child per request on SOCKET (Linux)");
+    eprintln!("  --zygote-children=N at most N children running at once, defaults to 64");
+    eprintln!("  --native-stats=FILE write call counts and latencies of native functions to FILE as JSON on exit");
+    eprintln!("  --native-sample-rate=N    time one in every N native calls, defaults to 1 with --native-stats");
+    eprintln!("  --metrics=FILE|unix:PATH  write GC and process metrics to FILE every interval, or to every connection on a Unix socket");
+    eprintln!("  --metrics-format=json|prometheus");
+    eprintln!("  --metrics-interval=MS     defaults to 10000");
+    eprintln!("  --batch=EXPORT      run the top level code once, then call EXPORT for every line of the batch input");
+    eprintln!("  --batch-input=FILE  read records from FILE, defaults to stdin");
+    eprintln!("  --batch-output=FILE write results to FILE, defaults to stdout");
+    eprintln!("  --batch-size=N      pass up to N records per call joined by newlines, defaults to 1");
+    eprintln!("Runtime options:");
+    eprintln!("  --preset=NAME       throughput (default), low-memory or debug, other options override it");
+    eprintln!("  --init-heap=SIZE    initial heap size, SIZE can end in K, M or G");
+    eprintln!("  --max-heap=SIZE     max heap size");
+    eprintln!("  --occupancy-target=FRACTION");
+    eprintln!("  --sanitize-rate=FRACTION    chance of an extra collection per allocation");
+    eprintln!("  --release-unused=none|old|young-on-full|young-always");
+    eprintln!("  --alloc-in-young=true|false");
+    eprintln!("  --gc-stats          record GC stats");
+    eprintln!("  --heap-budget=SIZE  live heap allowed after a collection, going over it aborts the running call");
+    eprintln!("  --heap-budget-threshold=FRACTION    fraction of the budget where memory pressure starts, defaults to 0.8");
+    eprintln!("  --on-memory-pressure=none|collect|release|abort");
+    eprintln!("  --registers=COUNT   max number of registers");
+    eprintln!("  --microtask-queue=true|false    run promise jobs in microtask checkpoints");
+    eprintln!("  --test-methods      enable HermesInternal test methods");
+    eprintln!("  --time-limit=MS     stop execution after MS milliseconds");
+    eprintln!("  --call-time-limit=MS        time out engine calls that take longer than MS milliseconds");
+    eprintln!("  --call-cpu-time-limit=MS    time out engine calls that use more than MS milliseconds of CPU time");
+    eprintln!("  --stop-after-init   only create the RuntimeModule");
+    eprintln!("  --force-gc-before-stats");
+    eprintln!("  --stabilize-instruction-count");
+    eprintln!("  --heap-timeline     record allocation stacks, heap snapshots become .heaptimeline files");
+    eprintln!("  --heap-snapshot=PREFIX      write heap snapshots to PREFIX-PID-N.heapsnapshot, at exit by default");
+    eprintln!("  --heap-snapshot-every=N     also write one after every N calls");
+    eprintln!("  --heap-snapshot-on-signal   also write one after the next call or task once SIGUSR2 arrives");
+    eprintln!("  --heap-snapshot-on-exit=true|false");
+    eprintln!("  --bytecode-cache=DIR    keep bytecode compiled by evalAsync and importModule in DIR between runs");
+    eprintln!("Profiling, each one writes to FILE or to the console if it's left out:");
+    eprintln!("  --sample-profiling[=FILE]       Chrome trace of the sampling profiler");
+    eprintln!("  --opcode-stats[=FILE]           opcode counts and times, needs a build with the opcode profiler");
+    eprintln!("  --function-stats[=FILE]         per function counts and times, needs the jsfunction profiler");
+    eprintln!("  --basic-block-profiling[=FILE]  basic block counts, needs the bb profiler");
+}
+
+fn parse_size(value: &str) -> Option<u64> {
+    let (digits, multiplier) = match value.as_bytes().last()? {
+        b'k' | b'K' => (&value[..value.len() - 1], 1024),
+        b'm' | b'M' => (&value[..value.len() - 1], 1024 * 1024),
+        b'g' | b'G' => (&value[..value.len() - 1], 1024 * 1024 * 1024),
+        _ => (value, 1),
+    };
+    digits.parse::<u64>().ok()?.checked_mul(multiplier)
+}
+
+fn parse_bool(value: &str) -> Option<bool> {
+    match value {
+        "true" | "1" | "on" => Some(true),
+        "false" | "0" | "off" => Some(false),
+        _ => None,
     }
-    let input_file_path = &args[1];
+}
 
-    let binary: Box<Vec<u8>> = Box::new(fs::read(input_file_path)
-        .expect("file read fail"));
-    // buffer should be safe since its lifetime relies on binary outliving it
-    // and buffer dies after exit and binary dies after exit
-    let buffer = (|binary: &Vec<u8>| unsafe {
-        return ffi::hermes::Buffer::new1(binary.as_ptr(), binary.len()).within_unique_ptr();
-    })(binary.borrow());
-    assert!(!buffer.is_null(), "buffer for hbc bytes was a null pointer");
-    let bindings: Rc<RefCell<RustBindingsDefine>> = RustBindingsDefine::new_rust_owned(make_rust_bindings_define());
-    bindings.as_ref().borrow_mut().deref_mut().start();
-    let success: bool = ffi::executeHBCBytecode(
-        buffer,
+// Applies one --key=value runtime option. The preset isn't handled here since
+// it has to be applied before everything else.
+pub fn apply_runtime_option(options: Pin<&mut ffi::RuntimeOptions>, arg: &str) -> Result<(), String> {
+    let (key, value) = arg.split_once('=').unwrap_or((arg, ""));
+    let invalid = || format!("invalid value for {}: {}", key, value);
+    match key {
+        "--init-heap" => options.setInitHeapSize(parse_size(value).ok_or_else(invalid)?),
+        "--max-heap" => options.setMaxHeapSize(parse_size(value).ok_or_else(invalid)?),
+        "--occupancy-target" => options.setOccupancyTarget(value.parse().map_err(|_| invalid())?),
+        "--sanitize-rate" => options.setSanitizeRate(value.parse().map_err(|_| invalid())?),
+        "--release-unused" => options.setReleaseUnused(match value {
+            "none" => ffi::GCReleaseUnused::None,
+            "old" => ffi::GCReleaseUnused::Old,
+            "young-on-full" => ffi::GCReleaseUnused::YoungOnFull,
+            "young-always" => ffi::GCReleaseUnused::YoungAlways,
+            _ => return Err(invalid()),
+        }),
+        "--alloc-in-young" => options.setAllocInYoung(parse_bool(value).ok_or_else(invalid)?),
+        "--gc-stats" => options.setRecordGCStats(true),
+        "--registers" => options.setMaxNumRegisters(value.parse().map_err(|_| invalid())?),
+        "--microtask-queue" => options.setMicrotaskQueue(parse_bool(value).ok_or_else(invalid)?),
+        "--test-methods" => options.setEnableHermesInternalTestMethods(true),
+        "--time-limit" => options.setTimeLimit(value.parse().map_err(|_| invalid())?),
+        "--call-time-limit" => options.setCallTimeLimit(value.parse().map_err(|_| invalid())?),
+        "--call-cpu-time-limit" => options.setCallCpuTimeLimit(value.parse().map_err(|_| invalid())?),
+        "--stop-after-init" => options.setStopAfterInit(true),
+        "--force-gc-before-stats" => options.setForceGCBeforeStats(true),
+        "--stabilize-instruction-count" => options.setStabilizeInstructionCount(true),
+        "--sample-profiling" if value.is_empty() => options.setSampleProfiling(true),
+        "--sample-profiling" => options.setSampleProfileFile(value),
+        "--heap-timeline" => options.setHeapTimeline(true),
+        "--heap-snapshot" => options.setHeapSnapshotPrefix(
+            Some(value).filter(|value| !value.is_empty()).ok_or_else(invalid)?),
+        "--heap-snapshot-every" => options.setHeapSnapshotEveryCalls(value.parse().map_err(|_| invalid())?),
+        "--heap-snapshot-on-signal" => options.setHeapSnapshotOnSignal(true),
+        "--heap-snapshot-on-exit" => options.setHeapSnapshotOnExit(parse_bool(value).ok_or_else(invalid)?),
+        "--basic-block-profiling" if value.is_empty() => options.setBasicBlockProfiling(true),
+        "--basic-block-profiling" => options.setBasicBlockProfileFile(value),
+        "--opcode-stats" if value.is_empty() => options.setOpcodeStats(true),
+        "--opcode-stats" => options.setOpcodeStatsFile(value),
+        "--function-stats" if value.is_empty() => options.setFunctionStats(true),
+        "--function-stats" => options.setFunctionStatsFile(value),
+        "--heap-budget" => options.setHeapBudget(parse_size(value).ok_or_else(invalid)?),
+        "--heap-budget-threshold" => options.setHeapBudgetThreshold(value.parse().map_err(|_| invalid())?),
+        "--on-memory-pressure" => options.setMemoryPressureAction(match value {
+            "none" => ffi::MemoryPressureAction::None,
+            "collect" => ffi::MemoryPressureAction::Collect,
+            "release" => ffi::MemoryPressureAction::ReleaseUnused,
+            "abort" => ffi::MemoryPressureAction::Abort,
+            _ => return Err(invalid()),
+        }),
+        "--bytecode-cache" => options.setBytecodeCacheDirectory(
+            Some(value).filter(|value| !value.is_empty()).ok_or_else(invalid)?),
+        _ => return Err(format!("unknown option {}", arg)),
+    }
+    Ok(())
+}
+
+pub fn make_runtime_options(preset: &str) -> Option<UniquePtr<ffi::RuntimeOptions>> {
+    let mut runtime_options = ffi::RuntimeOptions::new().within_unique_ptr();
+    if !runtime_options.pin_mut().applyPreset(preset) {
+        return None;
+    }
+    Some(runtime_options)
+}
+
+fn parse_options(args: &[String]) -> Option<Options> {
+    // the preset goes first so that the other options override it
+    let preset = args.iter().rev()
+        .find_map(|arg| arg.strip_prefix("--preset="))
+        .unwrap_or("throughput");
+    let runtime_options = match make_runtime_options(preset) {
+        Some(runtime_options) => runtime_options,
+        None => {
+            eprintln!("unknown preset {}", preset);
+            return None;
+        }
+    };
+    let mut input_file_path: Option<String> = None;
+    let mut options = Options {
+        input_file_path: String::new(),
+        load_mode: LoadMode::Mapped,
+        advise_startup: true,
+        report_startup: false,
+        zygote_socket: None,
+        zygote_max_children: 64,
+        native_sample_rate: None,
+        native_stats_path: None,
+        metrics_target: None,
+        metrics_format: ffi::MetricsFormat::JSON,
+        metrics_interval_ms: 10000,
+        batch: None,
+        runtime_options: runtime_options,
+    };
+    let mut batch_input: Option<String> = None;
+    let mut batch_output: Option<String> = None;
+    let mut batch_size: u32 = 1;
+    for arg in args.iter().skip(1) {
+        match arg.as_str() {
+            "--load=mmap" => options.load_mode = LoadMode::Mapped,
+            "--load=read" => options.load_mode = LoadMode::Read,
+            "--no-advise" => options.advise_startup = false,
+            "--report-startup" => options.report_startup = true,
+            _ if arg.starts_with("--zygote=") => {
+                options.zygote_socket = Some(arg["--zygote=".len()..].to_string());
+            }
+            _ if arg.starts_with("--zygote-children=") => {
+                match arg["--zygote-children=".len()..].parse::<u32>() {
+                    Ok(count) if count > 0 => options.zygote_max_children = count,
+                    _ => {
+                        eprintln!("invalid value for --zygote-children: {}", &arg["--zygote-children=".len()..]);
+                        return None;
+                    }
+                }
+            }
+            _ if arg.starts_with("--native-stats=") => {
+                options.native_stats_path = Some(arg["--native-stats=".len()..].to_string());
+            }
+            _ if arg.starts_with("--native-sample-rate=") => {
+                match arg["--native-sample-rate=".len()..].parse::<u32>() {
+                    Ok(rate) => options.native_sample_rate = Some(rate),
+                    Err(_) => {
+                        eprintln!("invalid value for --native-sample-rate: {}", &arg["--native-sample-rate=".len()..]);
+                        return None;
+                    }
+                }
+            }
+            "--metrics-format=json" => options.metrics_format = ffi::MetricsFormat::JSON,
+            "--metrics-format=prometheus" => options.metrics_format = ffi::MetricsFormat::Prometheus,
+            _ if arg.starts_with("--metrics=") => {
+                options.metrics_target = Some(arg["--metrics=".len()..].to_string());
+            }
+            _ if arg.starts_with("--metrics-interval=") => {
+                match arg["--metrics-interval=".len()..].parse::<u32>() {
+                    Ok(interval) => options.metrics_interval_ms = interval,
+                    Err(_) => {
+                        eprintln!("invalid value for --metrics-interval: {}", &arg["--metrics-interval=".len()..]);
+                        return None;
+                    }
+                }
+            }
+            _ if arg.starts_with("--batch=") => {
+                options.batch = Some(batch::BatchOptions {
+                    export_name: arg["--batch=".len()..].to_string(),
+                    input_path: None,
+                    output_path: None,
+                    batch_size: 1,
+                });
+            }
+            _ if arg.starts_with("--batch-input=") => {
+                batch_input = Some(arg["--batch-input=".len()..].to_string());
+            }
+            _ if arg.starts_with("--batch-output=") => {
+                batch_output = Some(arg["--batch-output=".len()..].to_string());
+            }
+            _ if arg.starts_with("--batch-size=") => {
+                match arg["--batch-size=".len()..].parse::<u32>() {
+                    Ok(size) if size > 0 => batch_size = size,
+                    _ => {
+                        eprintln!("invalid value for --batch-size: {}", &arg["--batch-size=".len()..]);
+                        return None;
+                    }
+                }
+            }
+            _ if arg.starts_with("--preset=") => {}
+            _ if arg.starts_with("--") => {
+                if let Err(error) = apply_runtime_option(options.runtime_options.pin_mut(), arg) {
+                    eprintln!("{}", error);
+                    return None;
+                }
+            }
+            _ if input_file_path.is_none() => input_file_path = Some(arg.clone()),
+            _ => return None,
+        }
+    }
+    let options_error = options.runtime_options.validate();
+    if !options_error.is_empty() {
+        eprintln!("invalid runtime options: {}", options_error.to_string_lossy());
+        return None;
+    }
+    if options.metrics_target.is_some() && options.zygote_socket.is_some() {
+        // the exporter's thread could hold a lock across fork
+        eprintln!("--metrics can't be used with --zygote");
+        return None;
+    }
+    match &mut options.batch {
+        Some(batch) => {
+            if options.zygote_socket.is_some() {
+                eprintln!("--batch can't be used with --zygote");
+                return None;
+            }
+            batch.input_path = batch_input;
+            batch.output_path = batch_output;
+            batch.batch_size = batch_size;
+        }
+        None => {
+            if batch_input.is_some() || batch_output.is_some() || batch_size != 1 {
+                eprintln!("--batch-input, --batch-output and --batch-size need --batch");
+                return None;
+            }
+        }
+    }
+    options.input_file_path = input_file_path?;
+    Some(options)
+}
+
+// The bytes behind an hbc buffer. The buffer only borrows from a read file,
+// so the Vec has to outlive it.
+pub struct LoadedBytecode {
+    pub buffer: UniquePtr<ffi::hermes::Buffer>,
+    _binary: Option<Box<Vec<u8>>>,
+}
+
+pub fn load_bytecode(path: &str, mode: LoadMode, advise_startup: bool) -> Option<LoadedBytecode> {
+    match mode {
+        LoadMode::Mapped => {
+            let buffer = ffi::mapHBCFile(path, advise_startup);
+            if buffer.is_null() {
+                return None;
+            }
+            Some(LoadedBytecode { buffer: buffer, _binary: None })
+        }
+        LoadMode::Read => {
+            let binary: Box<Vec<u8>> = Box::new(fs::read(path).ok()?);
+            // buffer should be safe since its lifetime relies on binary outliving it
+            let buffer = (|binary: &Vec<u8>| unsafe {
+                return ffi::hermes::Buffer::new1(binary.as_ptr(), binary.len()).within_unique_ptr();
+            })(binary.borrow());
+            assert!(!buffer.is_null(), "buffer for hbc bytes was a null pointer");
+            Some(LoadedBytecode { buffer: buffer, _binary: Some(binary) })
+        }
+    }
+}
+
+// Packs modules into one bundle, the first one is the entry module. A
+// module's id defaults to its file name without the extension.
+fn pack(args: &[String]) -> i32 {
+    if args.len() < 4 {
+        print_usage(&args[0]);
+        return 1;
+    }
+    let mut writer = ffi::BundleWriter::new().within_unique_ptr();
+    for arg in &args[3..] {
+        let (id, path) = match arg.split_once('=') {
+            Some((id, path)) => (id.to_string(), path),
+            None => (
+                std::path::Path::new(arg).file_stem().map_or(arg.clone(), |stem| stem.to_string_lossy().into_owned()),
+                arg.as_str(),
+            ),
+        };
+        if !writer.pin_mut().addModule(&id, path) {
+            return 1;
+        }
+    }
+    if writer.write(&args[2]) {0} else {1}
+}
+
+// only returns if the zygote couldn't start
+fn run_zygote(
+    mut loaded: LoadedBytecode,
+    input_file_path: &str,
+    socket_path: &str,
+    bindings: &Rc<RefCell<RustBindingsDefine>>,
+    options: &Options,
+) -> i32 {
+    let mut zygote = ffi::Zygote::create(
+        std::mem::replace(&mut loaded.buffer, UniquePtr::null()),
         input_file_path,
         bindings.as_ref().borrow().as_ref(),
+        options.runtime_options.as_ref().expect("runtime options are null"),
     );
+    if zygote.is_null() {
+        return 1;
+    }
+    zygote.pin_mut().serve(socket_path, options.zygote_max_children);
+    drop(loaded);
+    1
+}
+
+fn main() {
+    let start_time = Instant::now();
+    let args: Vec<String> = env::args().collect();
+
+    if args.len() >= 2 && args[1] == "bench" {
+        std::process::exit(bench::run(&args));
+    }
+    if args.len() >= 2 && args[1] == "pack" {
+        std::process::exit(pack(&args));
+    }
+
+    let options = match parse_options(&args) {
+        Some(options) => options,
+        None => {
+            print_usage(&args[0]);
+            std::process::exit(1);
+        }
+    };
+    let input_file_path = &options.input_file_path;
+
+    let metrics_exporter = match &options.metrics_target {
+        Some(target) => {
+            let exporter = ffi::MetricsExporter::start(target, options.metrics_format, options.metrics_interval_ms);
+            if exporter.is_null() {
+                std::process::exit(1);
+            }
+            exporter
+        }
+        None => UniquePtr::null(),
+    };
+
+    let mut loaded = load_bytecode(input_file_path, options.load_mode, options.advise_startup)
+        .expect("file read fail");
+    let load_time = start_time.elapsed();
+    let bindings = make_bindings();
+    let default_sample_rate = if options.native_stats_path.is_some() {1} else {0};
+    ffi::setNativeSampleRate(options.native_sample_rate.unwrap_or(default_sample_rate));
+    if let Some(socket_path) = &options.zygote_socket {
+        std::process::exit(run_zygote(loaded, input_file_path, socket_path, &bindings, &options));
+    }
+    let success: bool = match &options.batch {
+        Some(batch_options) => {
+            let mut engine = ffi::Engine::create(
+                std::mem::replace(&mut loaded.buffer, UniquePtr::null()),
+                input_file_path,
+                bindings.as_ref().borrow().as_ref(),
+                options.runtime_options.as_ref().expect("runtime options are null"),
+            );
+            !engine.is_null() && batch::run(engine.pin_mut(), batch_options)
+        }
+        None => ffi::executeHBCBytecode(
+            std::mem::replace(&mut loaded.buffer, UniquePtr::null()),
+            input_file_path,
+            bindings.as_ref().borrow().as_ref(),
+            options.runtime_options.as_ref().expect("runtime options are null"),
+        ),
+    };
+    if options.report_startup {
+        // bench::startup parses this line
+        eprintln!(
+            "startup: load={} load_us={} total_us={} peak_rss_kb={}",
+            options.load_mode.name(),
+            load_time.as_micros(),
+            start_time.elapsed().as_micros(),
+            ffi::peakResidentSetBytes() / 1024,
+        );
+    }
+    if let Some(stats_path) = &options.native_stats_path {
+        ffi::dumpNativeStats(stats_path);
+    }
+    drop(loaded);
+    // exit skips destructors, the exporter does its last write in its own
+    drop(metrics_exporter);
     std::process::exit(if success {0} else {1});
 }
@@ -0,0 +1,59 @@
+#include "memory_budget.hpp"
+
+#include "hermes/VM/Runtime.h"
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+MemoryBudget::MemoryBudget(
+  uint64_t _budgetBytes,
+  double threshold,
+  MemoryPressureAction _defaultAction
+):
+  budgetBytes(_budgetBytes),
+  thresholdBytes(static_cast<uint64_t>(_budgetBytes * threshold)),
+  defaultAction(_defaultAction)
+{}
+
+MemoryPressureAction MemoryBudget::onCollection(const hermes::vm::GCAnalyticsEvent& event) {
+  const MemoryPressure pressure{event.allocated.after, event.size.after, budgetBytes};
+  MemoryPressureAction action = MemoryPressureAction::None;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pressure.allocatedBytes < thresholdBytes) {
+      underPressure = false;
+      return MemoryPressureAction::None;
+    }
+    if (!underPressure) {
+      underPressure = true;
+      action = callback ? callback(pressure) : defaultAction;
+    }
+  }
+  if (pressure.allocatedBytes >= budgetBytes) {
+    action = MemoryPressureAction::Abort;
+  }
+  if (action == MemoryPressureAction::Collect || action == MemoryPressureAction::ReleaseUnused) {
+    // a ReleaseUnused isn't downgraded by a later Collect
+    MemoryPressureAction expected = MemoryPressureAction::None;
+    if (!pending.compare_exchange_strong(expected, action) &&
+        action == MemoryPressureAction::ReleaseUnused) {
+      pending.store(action);
+    }
+  }
+  return action;
+}
+
+void relieveMemoryPressure(hermes::vm::Runtime& runtime, MemoryPressureAction action) {
+  if (action != MemoryPressureAction::Collect && action != MemoryPressureAction::ReleaseUnused) {
+    return;
+  }
+  // how much of the heap itself goes back to the OS is up to the runtime's
+  // release unused setting
+  runtime.collect("memory pressure");
+#if defined(__GLIBC__)
+  if (action == MemoryPressureAction::ReleaseUnused) {
+    malloc_trim(0);
+  }
+#endif
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+#include "hermes/Public/GCConfig.h"
+
+namespace hermes {
+namespace vm {
+class Runtime;
+}
+}
+
+enum class MemoryPressureAction : uint8_t {
+    None,
+    // a full collection before the next call
+    Collect,
+    // a full collection, then freed malloc memory goes back to the OS
+    ReleaseUnused,
+    // ends the running call with EngineStatus::OutOfMemory
+    Abort,
+};
+
+struct MemoryPressure {
+    // live bytes after the collection that reported it
+    uint64_t allocatedBytes;
+    uint64_t heapSizeBytes;
+    uint64_t budgetBytes;
+};
+
+// A heap budget for one runtime, checked against the live bytes after every
+// collection.
+// Once they pass threshold * budget the pressure callback picks what to do,
+// or the default action if there is no callback. It's only asked again
+// after a collection brings them back under. Past the budget itself every
+// collection aborts the running call, so a leaking runtime is stopped well
+// before the heap reaches its max size, which Hermes treats as fatal.
+class MemoryBudget {
+public:
+    // Called from whichever thread finished the collection, which can be the
+    // GC's own thread, so it shouldn't touch the runtime.
+    using Callback = std::function<MemoryPressureAction(const MemoryPressure& pressure)>;
+
+    MemoryBudget(uint64_t budgetBytes, double threshold, MemoryPressureAction defaultAction);
+    MemoryBudget(const MemoryBudget&) = delete;
+    MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+    // set it before the runtime starts collecting
+    void setCallback(Callback _callback) { callback = std::move(_callback); }
+
+    // any thread, returns Abort if the running call should be aborted
+    MemoryPressureAction onCollection(const hermes::vm::GCAnalyticsEvent& event);
+
+    // JS thread, the Collect or ReleaseUnused asked for since the last take
+    MemoryPressureAction takePending() {
+        return pending.exchange(MemoryPressureAction::None, std::memory_order_acq_rel);
+    }
+
+    uint64_t getBudgetBytes() const { return budgetBytes; }
+
+private:
+    const uint64_t budgetBytes;
+    const uint64_t thresholdBytes;
+    const MemoryPressureAction defaultAction;
+    Callback callback;
+
+    // collections can finish on two threads at once
+    std::mutex mutex;
+    bool underPressure = false;
+    std::atomic<MemoryPressureAction> pending{MemoryPressureAction::None};
+};
+
+// Runs a pending Collect or ReleaseUnused on the runtime's thread.
+void relieveMemoryPressure(hermes::vm::Runtime& runtime, MemoryPressureAction action);
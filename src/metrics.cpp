@@ -0,0 +1,315 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+
+#include "hermes/Support/JSONEmitter.h"
+#include "hermes/Support/OSCompat.h"
+#include "llvh/Support/FileSystem.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "unix_socket.hpp"
+
+namespace {
+const auto processStart = std::chrono::steady_clock::now();
+
+#ifdef MSG_NOSIGNAL
+// a scraper that hangs up early shouldn't kill the process with SIGPIPE
+constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+constexpr int kSendFlags = 0;
+#endif
+
+struct ProcessStats {
+  uint64_t residentBytes;
+  uint64_t peakResidentBytes;
+  double userSeconds;
+  double systemSeconds;
+  double uptimeSeconds;
+};
+
+ProcessStats getProcessStats() {
+  ProcessStats stats{};
+  stats.residentBytes = hermes::oscompat::current_rss();
+  stats.peakResidentBytes = hermes::oscompat::peak_rss();
+  stats.uptimeSeconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - processStart).count();
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  if (GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) {
+    // 100 ns units
+    auto seconds = [](const FILETIME& time) {
+      return ((static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 1e7;
+    };
+    stats.userSeconds = seconds(user);
+    stats.systemSeconds = seconds(kernel);
+  }
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    stats.userSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    stats.systemSeconds = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+  }
+#endif
+  return stats;
+}
+
+void emitCollections(hermes::JSONEmitter& json, const char* key, const GCMetrics::Collections& collections) {
+  json.emitKey(key);
+  json.openDict();
+  json.emitKeyValue("count", collections.count);
+  json.emitKeyValue("totalMs", collections.totalMilliseconds);
+  json.emitKeyValue("maxMs", collections.maxMilliseconds);
+  json.emitKeyValue("cpuMs", collections.cpuMilliseconds);
+  json.closeDict();
+}
+
+void writeJSON(llvh::raw_ostream& os, const GCMetrics::Snapshot& gc, const ProcessStats& process) {
+  hermes::JSONEmitter json{os};
+  json.openDict();
+  json.emitKey("process");
+  json.openDict();
+  json.emitKeyValue("uptimeSeconds", process.uptimeSeconds);
+  json.emitKeyValue("residentBytes", process.residentBytes);
+  json.emitKeyValue("peakResidentBytes", process.peakResidentBytes);
+  json.emitKeyValue("userCpuSeconds", process.userSeconds);
+  json.emitKeyValue("systemCpuSeconds", process.systemSeconds);
+  json.closeDict();
+  json.emitKey("gc");
+  json.openDict();
+  emitCollections(json, "young", gc.young);
+  emitCollections(json, "old", gc.old);
+  json.emitKeyValue("freedBytes", gc.freedBytes);
+  json.emitKeyValue("allocatedBytes", gc.allocatedBytes);
+  json.emitKeyValue("heapSizeBytes", gc.heapSizeBytes);
+  json.emitKeyValue("externalBytes", gc.externalBytes);
+  json.closeDict();
+  json.closeDict();
+  json.endJSONL();
+}
+
+void writePrometheus(llvh::raw_ostream& os, const GCMetrics::Snapshot& gc, const ProcessStats& process) {
+  auto metric = [&os](const char* name, const char* type, const char* help) {
+    os << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+  };
+  auto collections = [&os](const char* name, double young, double old) {
+    os << name << "{generation=\"young\"} " << young << "\n";
+    os << name << "{generation=\"old\"} " << old << "\n";
+  };
+  metric("process_resident_memory_bytes", "gauge", "Resident set size.");
+  os << "process_resident_memory_bytes " << process.residentBytes << "\n";
+  metric("snapit_process_peak_resident_memory_bytes", "gauge", "Peak resident set size.");
+  os << "snapit_process_peak_resident_memory_bytes " << process.peakResidentBytes << "\n";
+  metric("process_cpu_seconds_total", "counter", "User and system CPU time.");
+  os << "process_cpu_seconds_total " << process.userSeconds + process.systemSeconds << "\n";
+  metric("snapit_uptime_seconds", "gauge", "Time since the process started.");
+  os << "snapit_uptime_seconds " << process.uptimeSeconds << "\n";
+  metric("snapit_gc_collections_total", "counter", "Garbage collections.");
+  collections("snapit_gc_collections_total", gc.young.count, gc.old.count);
+  metric("snapit_gc_duration_seconds_total", "counter",
+      "Wall time of collections, old generation time is mostly concurrent.");
+  collections("snapit_gc_duration_seconds_total",
+      gc.young.totalMilliseconds / 1000, gc.old.totalMilliseconds / 1000);
+  metric("snapit_gc_duration_max_seconds", "gauge", "Longest collection.");
+  collections("snapit_gc_duration_max_seconds",
+      gc.young.maxMilliseconds / 1000, gc.old.maxMilliseconds / 1000);
+  metric("snapit_gc_cpu_seconds_total", "counter", "CPU time of collections.");
+  collections("snapit_gc_cpu_seconds_total",
+      gc.young.cpuMilliseconds / 1000, gc.old.cpuMilliseconds / 1000);
+  metric("snapit_gc_freed_bytes_total", "counter", "Bytes freed by collections.");
+  os << "snapit_gc_freed_bytes_total " << gc.freedBytes << "\n";
+  metric("snapit_heap_allocated_bytes", "gauge", "Live bytes after the latest collection.");
+  os << "snapit_heap_allocated_bytes " << gc.allocatedBytes << "\n";
+  metric("snapit_heap_size_bytes", "gauge", "Heap size after the latest collection.");
+  os << "snapit_heap_size_bytes " << gc.heapSizeBytes << "\n";
+  metric("snapit_heap_external_bytes", "gauge", "External memory after the latest collection.");
+  os << "snapit_heap_external_bytes " << gc.externalBytes << "\n";
+}
+} // namespace
+
+GCMetrics& GCMetrics::getShared() {
+  static GCMetrics shared;
+  return shared;
+}
+
+void GCMetrics::record(const hermes::vm::GCAnalyticsEvent& event) {
+  const double milliseconds = event.duration.count();
+  std::lock_guard<std::mutex> lock(mutex);
+  Collections& collections = event.collectionType == "young" ? totals.young : totals.old;
+  ++collections.count;
+  collections.totalMilliseconds += milliseconds;
+  collections.maxMilliseconds = std::max(collections.maxMilliseconds, milliseconds);
+  collections.cpuMilliseconds += event.cpuDuration.count();
+  if (event.allocated.before > event.allocated.after) {
+    totals.freedBytes += event.allocated.before - event.allocated.after;
+  }
+  totals.allocatedBytes = event.allocated.after;
+  totals.heapSizeBytes = event.size.after;
+  totals.externalBytes = event.external.after;
+}
+
+GCMetrics::Snapshot GCMetrics::snapshot() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return totals;
+}
+
+MetricsExporter::MetricsExporter(
+  std::string _target,
+  MetricsFormat _format,
+  std::chrono::milliseconds _interval
+):
+  target(std::move(_target)),
+  format(_format),
+  interval(_interval)
+{}
+
+std::unique_ptr<MetricsExporter> MetricsExporter::start(
+  const std::string& target,
+  MetricsFormat format,
+  uint32_t intervalMilliseconds
+) {
+  if (intervalMilliseconds == 0) {
+    llvh::errs() << "The metrics interval must not be 0\n";
+    return nullptr;
+  }
+  std::unique_ptr<MetricsExporter> exporter{new MetricsExporter(
+      target, format, std::chrono::milliseconds(intervalMilliseconds))};
+  llvh::StringRef socketPath = target;
+  if (!socketPath.consume_front("unix:")) {
+    if (!exporter->writeFile()) {
+      return nullptr;
+    }
+    exporter->thread = std::thread([exporter = exporter.get()]() { exporter->runFile(); });
+    return exporter;
+  }
+
+#ifdef _WIN32
+  llvh::errs() << "Metrics sockets aren't supported on Windows\n";
+  return nullptr;
+#else
+  exporter->socketPath = socketPath.str();
+  exporter->socket = listenOnUnixSocket(exporter->socketPath, 16, "metrics");
+  if (exporter->socket < 0) {
+    return nullptr;
+  }
+  exporter->thread = std::thread([exporter = exporter.get()]() { exporter->runSocket(); });
+  return exporter;
+#endif
+}
+
+MetricsExporter::~MetricsExporter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  // only started exporters clean up after themselves
+  const bool started = thread.joinable();
+  if (started) {
+    thread.join();
+  }
+#ifndef _WIN32
+  if (socket >= 0) {
+    close(socket);
+    if (started) {
+      unlink(socketPath.c_str());
+    }
+  }
+#endif
+  if (started && socketPath.empty()) {
+    writeFile();
+  }
+}
+
+void MetricsExporter::write(llvh::raw_ostream& os, MetricsFormat format) {
+  const GCMetrics::Snapshot gc = GCMetrics::getShared().snapshot();
+  const ProcessStats process = getProcessStats();
+  if (format == MetricsFormat::Prometheus) {
+    writePrometheus(os, gc, process);
+  } else {
+    writeJSON(os, gc, process);
+  }
+}
+
+bool MetricsExporter::writeFile() const {
+  // written next to the target and renamed over it
+  const std::string temporary = target + ".tmp";
+  {
+    std::error_code error;
+    llvh::raw_fd_ostream file{temporary, error, llvh::sys::fs::F_Text};
+    if (error) {
+      llvh::errs() << "Failed to open " << temporary << ": " << error.message() << "\n";
+      return false;
+    }
+    write(file, format);
+    file.close();
+    if (file.has_error()) {
+      file.clear_error();
+      llvh::errs() << "Failed to write " << temporary << "\n";
+      return false;
+    }
+  }
+  if (std::error_code error = llvh::sys::fs::rename(temporary, target)) {
+    llvh::errs() << "Failed to replace " << target << ": " << error.message() << "\n";
+    return false;
+  }
+  return true;
+}
+
+void MetricsExporter::runFile() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!wake.wait_for(lock, interval, [this]() { return stopping; })) {
+    lock.unlock();
+    writeFile();
+    lock.lock();
+  }
+}
+
+void MetricsExporter::runSocket() {
+#ifndef _WIN32
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (stopping) {
+        return;
+      }
+    }
+    // wakes up now and then to check for stopping
+    pollfd listening{socket, POLLIN, 0};
+    if (poll(&listening, 1, 200) <= 0) {
+      continue;
+    }
+    const int connection = accept(socket, nullptr, nullptr);
+    if (connection < 0) {
+      continue;
+    }
+    std::string text;
+    {
+      llvh::raw_string_ostream os{text};
+      write(os, format);
+    }
+    size_t written = 0;
+    while (written < text.size()) {
+      const ssize_t result = send(connection, text.data() + written, text.size() - written, kSendFlags);
+      if (result <= 0) {
+        break;
+      }
+      written += static_cast<size_t>(result);
+    }
+    close(connection);
+  }
+#endif
+}
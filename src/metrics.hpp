@@ -0,0 +1,92 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "hermes/Public/GCConfig.h"
+#include "llvh/Support/raw_ostream.h"
+
+// GC totals of every runtime in the process, fed by the analytics callback
+// RuntimeOptions::makeRuntimeConfig installs. The callback runs once per
+// collection, on whichever thread finished it.
+class GCMetrics {
+public:
+    struct Collections {
+        uint64_t count = 0;
+        // wall time, for Hades old generation collections this is mostly
+        // concurrent marking, not a pause
+        double totalMilliseconds = 0;
+        double maxMilliseconds = 0;
+        double cpuMilliseconds = 0;
+    };
+
+    struct Snapshot {
+        Collections young;
+        // old generation and full collections
+        Collections old;
+        uint64_t freedBytes = 0;
+        // after the latest collection of any runtime
+        uint64_t allocatedBytes = 0;
+        uint64_t heapSizeBytes = 0;
+        uint64_t externalBytes = 0;
+    };
+
+    static GCMetrics& getShared();
+
+    void record(const hermes::vm::GCAnalyticsEvent& event);
+    Snapshot snapshot() const;
+
+private:
+    GCMetrics() {}
+
+    mutable std::mutex mutex;
+    Snapshot totals;
+};
+
+enum class MetricsFormat {
+    JSON,
+    // Prometheus text exposition format
+    Prometheus,
+};
+
+// Writes GC and process metrics on a background thread. The target is
+// either a file, which is replaced every interval so readers never see half
+// a write, or unix:PATH, a Unix socket that writes the current metrics to
+// every connection and closes it.
+// The names and fields are stable, new ones may be added.
+class MetricsExporter {
+public:
+    // returns null if the target can't be used
+    static std::unique_ptr<MetricsExporter> start(
+        const std::string& target, MetricsFormat format, uint32_t intervalMilliseconds);
+
+    MetricsExporter(const MetricsExporter&) = delete;
+    MetricsExporter& operator=(const MetricsExporter&) = delete;
+    // files get one last write
+    ~MetricsExporter();
+
+    static void write(llvh::raw_ostream& os, MetricsFormat format);
+
+private:
+    MetricsExporter(std::string target, MetricsFormat format, std::chrono::milliseconds interval);
+
+    bool writeFile() const;
+    void runFile();
+    void runSocket();
+
+    const std::string target;
+    const MetricsFormat format;
+    const std::chrono::milliseconds interval;
+    // set for unix: targets
+    std::string socketPath;
+    int socket = -1;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread thread;
+};
@@ -0,0 +1,123 @@
+#include "module_loader.hpp"
+
+#include "compile_service.hpp"
+#include "event_loop.hpp"
+#include "string_bridge.hpp"
+
+ModuleLoader::ModuleLoader(
+  hermes::vm::Runtime& _runtime,
+  EventLoop& _eventLoop,
+  CompileService& _service,
+  std::string _cacheDirectory
+):
+  runtime(_runtime),
+  eventLoop(_eventLoop),
+  service(_service),
+  cacheDirectory(std::move(_cacheDirectory)),
+  promises(_runtime)
+{
+}
+
+ModuleLoader::~ModuleLoader() {
+  std::unique_lock<std::mutex> lock(mutex);
+  idle.wait(lock, [this]() { return inFlight == 0; });
+}
+
+bool ModuleLoader::install() {
+  return defineGlobalFunction(runtime, "evalAsync", evalAsync, this, 1) &&
+      defineGlobalFunction(runtime, "importModule", importModule, this, 1);
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> ModuleLoader::evalAsync(
+  void* context,
+  hermes::vm::Runtime& runtime,
+  hermes::vm::NativeArgs args
+) {
+  using namespace hermes;
+  ModuleLoader& loader = *static_cast<ModuleLoader*>(context);
+  auto source = args.dyncastArg<vm::StringPrimitive>(0);
+  if (!source) {
+    return runtime.raiseTypeError("evalAsync expects source code as a string");
+  }
+  std::string sourceURL = "evalAsync";
+  if (auto url = args.dyncastArg<vm::StringPrimitive>(1)) {
+    sourceURL = stringPrimitiveToUTF8(runtime, url);
+  }
+  return loader.start(stringPrimitiveToUTF8(runtime, source), std::move(sourceURL), false);
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> ModuleLoader::importModule(
+  void* context,
+  hermes::vm::Runtime& runtime,
+  hermes::vm::NativeArgs args
+) {
+  using namespace hermes;
+  ModuleLoader& loader = *static_cast<ModuleLoader*>(context);
+  auto path = args.dyncastArg<vm::StringPrimitive>(0);
+  if (!path) {
+    return runtime.raiseTypeError("importModule expects a path as a string");
+  }
+  std::string pathString = stringPrimitiveToUTF8(runtime, path);
+  std::string sourceURL = pathString;
+  return loader.start(std::move(pathString), std::move(sourceURL), true);
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> ModuleLoader::start(
+  std::string source,
+  std::string sourceURL,
+  bool isPath
+) {
+  using namespace hermes;
+  vm::GCScope scope(runtime);
+  uint32_t id;
+  auto promise = promises.create(id);
+  if (LLVM_UNLIKELY(promise == vm::ExecutionStatus::EXCEPTION)) {
+    return vm::ExecutionStatus::EXCEPTION;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    ++inFlight;
+  }
+  eventLoop.ref();
+  auto done = [this, id, sourceURL](
+      std::shared_ptr<hbc::BCProvider> bytecode, const std::string& error) {
+    eventLoop.postHostTask(
+        [this, id, sourceURL, bytecode, error](vm::Runtime&) {
+          return settle(id, sourceURL, bytecode, error);
+        });
+    eventLoop.unref();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--inFlight == 0) {
+      idle.notify_all();
+    }
+  };
+  if (isPath) {
+    service.compileFile(std::move(source), cacheDirectory, std::move(done));
+  } else {
+    service.compileSource(std::move(source), std::move(sourceURL), cacheDirectory, std::move(done));
+  }
+  return *promise;
+}
+
+hermes::vm::ExecutionStatus ModuleLoader::settle(
+  uint32_t id,
+  const std::string& sourceURL,
+  std::shared_ptr<hermes::hbc::BCProvider> bytecode,
+  const std::string& error
+) {
+  using namespace hermes;
+  vm::GCScope scope(runtime);
+  vm::CallResult<vm::HermesValue> result{vm::ExecutionStatus::EXCEPTION};
+  if (bytecode) {
+    vm::RuntimeModuleFlags flags;
+    flags.persistent = true;
+    result = runtime.runBytecode(
+        std::move(bytecode),
+        flags,
+        sourceURL,
+        vm::Runtime::makeNullHandle<vm::Environment>());
+  } else {
+    (void)runtime.raiseSyntaxError(vm::TwineChar16(utf8ToUTF16String(error).c_str()));
+  }
+  return promises.settle(id, result);
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "pending_promises.hpp"
+#include "wrapper.hpp"
+
+class CompileService;
+class EventLoop;
+
+// The JS side of the compile service for one runtime.
+// install() defines evalAsync(source[, sourceURL]) and importModule(path) on
+// the global object. Both return a promise and hand the compiling off to the
+// CompileService, the runtime keeps running other tasks meanwhile. Once the
+// bytecode is ready it runs as a global script and the promise resolves with
+// its completion value, or rejects with a SyntaxError or whatever it threw.
+// importModule loads .hbc files as they are.
+class ModuleLoader {
+public:
+    // cacheDirectory can be empty to only cache in memory
+    ModuleLoader(
+        hermes::vm::Runtime& runtime,
+        EventLoop& eventLoop,
+        CompileService& service,
+        std::string cacheDirectory
+    );
+    ModuleLoader(const ModuleLoader&) = delete;
+    ModuleLoader& operator=(const ModuleLoader&) = delete;
+    // waits for compiles that are still running, their tasks post to the
+    // event loop, which has to outlive this
+    ~ModuleLoader();
+
+    bool install();
+
+private:
+    static hermes::vm::CallResult<hermes::vm::HermesValue> evalAsync(
+        void* context, hermes::vm::Runtime& runtime, hermes::vm::NativeArgs args);
+    static hermes::vm::CallResult<hermes::vm::HermesValue> importModule(
+        void* context, hermes::vm::Runtime& runtime, hermes::vm::NativeArgs args);
+
+    // Creates a promise and starts the compile, source is a path if isPath.
+    hermes::vm::CallResult<hermes::vm::HermesValue> start(
+        std::string source, std::string sourceURL, bool isPath);
+    // runs on the JS thread once the compile is done
+    hermes::vm::ExecutionStatus settle(
+        uint32_t id,
+        const std::string& sourceURL,
+        std::shared_ptr<hermes::hbc::BCProvider> bytecode,
+        const std::string& error);
+
+    hermes::vm::Runtime& runtime;
+    EventLoop& eventLoop;
+    CompileService& service;
+    const std::string cacheDirectory;
+
+    // by request id
+    PendingPromises promises;
+
+    // compiles that haven't posted back yet
+    std::mutex mutex;
+    std::condition_variable idle;
+    uint32_t inFlight = 0;
+};
@@ -0,0 +1,495 @@
+// Helpers for the by value native call ABI in wrapper.hpp. A fast native
+// function gets the runtime and its arguments as raw pointers and returns a
+// NativeCallResult, so a call doesn't allocate anything on either side.
+
+use autocxx::c_void;
+use std::marker::PhantomData;
+
+use crate::ffi;
+
+pub type Runtime = ffi::hermes::vm::Runtime;
+pub type NativeArgs = ffi::hermes::vm::NativeArgs;
+
+pub type FastNativeFunction = extern "C" fn(
+    user_data: *mut c_void,
+    runtime: *mut Runtime,
+    args: *const NativeArgs,
+) -> NativeCallResult;
+
+// matches NativeCallStatus
+pub const NATIVE_CALL_RETURNED: u32 = 0;
+pub const NATIVE_CALL_EXCEPTION: u32 = 1;
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct NativeCallResult {
+    pub status: u32,
+    pub value: u64,
+}
+
+extern "C" {
+    fn snapit_arg_count(args: *const NativeArgs) -> u32;
+    fn snapit_arg(args: *const NativeArgs, index: u32) -> u64;
+    fn snapit_value_undefined() -> u64;
+    fn snapit_value_is_null(value: u64) -> bool;
+    fn snapit_value_is_number(value: u64) -> bool;
+    fn snapit_value_get_number(value: u64) -> f64;
+    fn snapit_value_encode_number(number: f64) -> u64;
+    fn snapit_value_is_bool(value: u64) -> bool;
+    fn snapit_value_get_bool(value: u64) -> bool;
+    fn snapit_value_encode_bool(value: bool) -> u64;
+    fn snapit_value_is_string(value: u64) -> bool;
+    fn snapit_string_chars(runtime: *mut Runtime, value: u64, chars: *mut *const c_void, length: *mut usize) -> bool;
+    fn snapit_utf16_to_utf8(chars: *const u16, length: usize, out: *mut u8) -> usize;
+    fn snapit_string_from_utf8(runtime: *mut Runtime, chars: *const u8, length: usize, value: *mut u64) -> bool;
+    fn snapit_external_array_buffer(
+        runtime: *mut Runtime,
+        data: *mut u8,
+        length: usize,
+        context: *mut c_void,
+        finalize: extern "C" fn(*mut c_void),
+        value: *mut u64,
+    ) -> bool;
+    fn snapit_external_uint8_array(
+        runtime: *mut Runtime,
+        data: *mut u8,
+        length: usize,
+        context: *mut c_void,
+        finalize: extern "C" fn(*mut c_void),
+        value: *mut u64,
+    ) -> bool;
+    fn snapit_buffer_bytes(runtime: *mut Runtime, value: u64, data: *mut *mut u8, length: *mut usize) -> bool;
+    fn snapit_throw_type_error(runtime: *mut Runtime, message: *const u8, length: usize) -> NativeCallResult;
+}
+
+// A raw HermesValue. Pointers in it aren't rooted, so don't keep one past the
+// call it came from.
+#[derive(Clone, Copy)]
+pub struct RawValue(pub u64);
+
+impl RawValue {
+    pub fn undefined() -> RawValue {
+        RawValue(unsafe { snapit_value_undefined() })
+    }
+
+    pub fn number(number: f64) -> RawValue {
+        RawValue(unsafe { snapit_value_encode_number(number) })
+    }
+
+    pub fn bool(value: bool) -> RawValue {
+        RawValue(unsafe { snapit_value_encode_bool(value) })
+    }
+
+    pub fn is_undefined(self) -> bool {
+        self.0 == RawValue::undefined().0
+    }
+
+    pub fn is_null(self) -> bool {
+        unsafe { snapit_value_is_null(self.0) }
+    }
+
+    pub fn as_number(self) -> Option<f64> {
+        unsafe {
+            match snapit_value_is_number(self.0) {
+                true => Some(snapit_value_get_number(self.0)),
+                false => None,
+            }
+        }
+    }
+}
+
+impl NativeCallResult {
+    pub fn returned(value: RawValue) -> NativeCallResult {
+        NativeCallResult { status: NATIVE_CALL_RETURNED, value: value.0 }
+    }
+
+    pub fn undefined() -> NativeCallResult {
+        NativeCallResult::returned(RawValue::undefined())
+    }
+
+    // for when an exception has already been raised
+    pub fn exception() -> NativeCallResult {
+        NativeCallResult { status: NATIVE_CALL_EXCEPTION, value: 0 }
+    }
+}
+
+pub struct FastArgs {
+    args: *const NativeArgs,
+}
+
+impl FastArgs {
+    // args has to be the pointer a fast native function was called with
+    pub unsafe fn from_raw(args: *const NativeArgs) -> FastArgs {
+        FastArgs { args: args }
+    }
+
+    pub fn count(&self) -> u32 {
+        unsafe { snapit_arg_count(self.args) }
+    }
+
+    // undefined if index is out of range
+    pub fn get(&self, index: u32) -> RawValue {
+        RawValue(unsafe { snapit_arg(self.args, index) })
+    }
+}
+
+// runtime has to be the pointer a fast native function was called with
+pub fn throw_type_error(runtime: *mut Runtime, message: &str) -> NativeCallResult {
+    unsafe { snapit_throw_type_error(runtime, message.as_ptr(), message.len()) }
+}
+
+enum JsChars<'a> {
+    Ascii(&'a [u8]),
+    Utf16(&'a [u16]),
+}
+
+// Characters of a JS string argument, borrowed from the runtime's heap. Only
+// valid until the function returns or allocates, a collection can move them.
+// Borrows are tied to the JsStr, which typed_native! and async_native! drop
+// before they allocate the result, and it can't be sent to another thread.
+pub struct JsStr<'a> {
+    chars: JsChars<'a>,
+    _not_send: PhantomData<*const u8>,
+}
+
+impl<'a> JsStr<'a> {
+    fn new(chars: JsChars<'a>) -> JsStr<'a> {
+        JsStr { chars: chars, _not_send: PhantomData }
+    }
+
+    pub fn len(&self) -> usize {
+        match self.chars {
+            JsChars::Ascii(chars) => chars.len(),
+            JsChars::Utf16(chars) => chars.len(),
+        }
+    }
+
+    // None if the string isn't stored as ASCII
+    pub fn ascii(&self) -> Option<&[u8]> {
+        match self.chars {
+            JsChars::Ascii(chars) => Some(chars),
+            JsChars::Utf16(_) => None,
+        }
+    }
+
+    // None if the string is stored as ASCII
+    pub fn utf16(&self) -> Option<&[u16]> {
+        match self.chars {
+            JsChars::Ascii(_) => None,
+            JsChars::Utf16(chars) => Some(chars),
+        }
+    }
+
+    // Borrows the characters without copying. Strings that aren't all ASCII
+    // are stored as UTF-16 and have to be converted with to_string instead.
+    pub fn as_str(&self) -> Option<&str> {
+        // ASCII is always valid UTF-8
+        self.ascii().map(|chars| unsafe { std::str::from_utf8_unchecked(chars) })
+    }
+
+    // unpaired surrogates are replaced
+    pub fn to_string(&self) -> String {
+        match self.chars {
+            JsChars::Ascii(_) => self.as_str().unwrap().to_owned(),
+            JsChars::Utf16(chars) => {
+                let mut bytes: Vec<u8> = Vec::with_capacity(chars.len() * 3);
+                unsafe {
+                    let length = snapit_utf16_to_utf8(chars.as_ptr(), chars.len(), bytes.as_mut_ptr());
+                    bytes.set_len(length);
+                    // the transcoder only writes valid UTF-8
+                    String::from_utf8_unchecked(bytes)
+                }
+            }
+        }
+    }
+}
+
+// Creates a JS string. Returns None if it couldn't be allocated, in which
+// case an exception has been raised and the native function has to return
+// NativeCallResult::exception().
+pub fn make_string(runtime: *mut Runtime, value: &str) -> Option<RawValue> {
+    let mut raw: u64 = 0;
+    match unsafe { snapit_string_from_utf8(runtime, value.as_ptr(), value.len(), &mut raw) } {
+        true => Some(RawValue(raw)),
+        false => None,
+    }
+}
+
+extern "C" fn drop_external<T>(context: *mut c_void) {
+    unsafe { drop(Box::from_raw(context as *mut T)) }
+}
+
+type ExternalCreate = unsafe extern "C" fn(
+    *mut Runtime,
+    *mut u8,
+    usize,
+    *mut c_void,
+    extern "C" fn(*mut c_void),
+    *mut u64,
+) -> bool;
+
+fn make_external<T: AsMut<[u8]> + Send + 'static>(create: ExternalCreate, runtime: *mut Runtime, owner: T) -> Option<RawValue> {
+    let mut owner = Box::new(owner);
+    let bytes = (*owner).as_mut();
+    let (data, length) = (bytes.as_mut_ptr(), bytes.len());
+    let context = Box::into_raw(owner) as *mut c_void;
+    let mut raw: u64 = 0;
+    // the runtime drops owner, even if this fails
+    match unsafe { create(runtime, data, length, context, drop_external::<T>, &mut raw) } {
+        true => Some(RawValue(raw)),
+        false => None,
+    }
+}
+
+// Hands memory to JS as an ArrayBuffer without copying it, a Vec<u8> or
+// anything else that owns bytes at a fixed address. The runtime drops owner
+// once the buffer is collected. Returns None if an exception was raised.
+pub fn external_array_buffer<T: AsMut<[u8]> + Send + 'static>(runtime: *mut Runtime, owner: T) -> Option<RawValue> {
+    make_external(snapit_external_array_buffer, runtime, owner)
+}
+
+// same as external_array_buffer but returns a Uint8Array over it
+pub fn external_uint8_array<T: AsMut<[u8]> + Send + 'static>(runtime: *mut Runtime, owner: T) -> Option<RawValue> {
+    make_external(snapit_external_uint8_array, runtime, owner)
+}
+
+// The bytes behind an ArrayBuffer or typed array argument, borrowed without
+// copying. Only valid until the native function returns. Two arguments can be
+// views of the same buffer, so reading is safe but writing isn't, see
+// as_mut_slice.
+pub struct JsBytes<'a> {
+    data: *mut u8,
+    length: usize,
+    _marker: PhantomData<&'a [u8]>,
+}
+
+impl<'a> JsBytes<'a> {
+    pub fn len(&self) -> usize {
+        self.length
+    }
+
+    pub fn as_ptr(&self) -> *const u8 {
+        self.data
+    }
+
+    pub fn as_mut_ptr(&mut self) -> *mut u8 {
+        self.data
+    }
+
+    pub fn as_slice(&self) -> &[u8] {
+        match self.length {
+            0 => &[],
+            _ => unsafe { std::slice::from_raw_parts(self.data, self.length) },
+        }
+    }
+
+    // Safety: no other argument can be a view of the same buffer while the
+    // slice is alive, or there would be two overlapping borrows and at least
+    // one of them mutable.
+    pub unsafe fn as_mut_slice(&mut self) -> &mut [u8] {
+        match self.length {
+            0 => &mut [],
+            _ => std::slice::from_raw_parts_mut(self.data, self.length),
+        }
+    }
+}
+
+// Argument types for typed_native!
+pub trait FromArg: Sized {
+    // for the TypeError when an argument doesn't match
+    const EXPECTED: &'static str;
+    // Set by types that can allocate while they're decoded, objects read
+    // into a struct for example. A collection could move what JsStr and
+    // RawValue arguments point to, so these are decoded before the others.
+    const ALLOCATES: bool = false;
+    fn from_arg(runtime: *mut Runtime, value: RawValue) -> Option<Self>;
+}
+
+impl FromArg for f64 {
+    const EXPECTED: &'static str = "a number";
+    fn from_arg(_runtime: *mut Runtime, value: RawValue) -> Option<f64> {
+        value.as_number()
+    }
+}
+
+impl FromArg for bool {
+    const EXPECTED: &'static str = "a boolean";
+    fn from_arg(_runtime: *mut Runtime, value: RawValue) -> Option<bool> {
+        unsafe {
+            match snapit_value_is_bool(value.0) {
+                true => Some(snapit_value_get_bool(value.0)),
+                false => None,
+            }
+        }
+    }
+}
+
+impl<'a> FromArg for JsStr<'a> {
+    const EXPECTED: &'static str = "a string";
+    fn from_arg(runtime: *mut Runtime, value: RawValue) -> Option<JsStr<'a>> {
+        unsafe {
+            if !snapit_value_is_string(value.0) {
+                return None;
+            }
+            let mut chars: *const c_void = std::ptr::null();
+            let mut length: usize = 0;
+            let is_ascii = snapit_string_chars(runtime, value.0, &mut chars, &mut length);
+            if length == 0 {
+                return Some(JsStr::new(JsChars::Ascii(&[])));
+            }
+            Some(JsStr::new(match is_ascii {
+                true => JsChars::Ascii(std::slice::from_raw_parts(chars as *const u8, length)),
+                false => JsChars::Utf16(std::slice::from_raw_parts(chars as *const u16, length)),
+            }))
+        }
+    }
+}
+
+impl<'a> FromArg for JsBytes<'a> {
+    const EXPECTED: &'static str = "an ArrayBuffer or typed array";
+    fn from_arg(runtime: *mut Runtime, value: RawValue) -> Option<JsBytes<'a>> {
+        let mut data: *mut u8 = std::ptr::null_mut();
+        let mut length: usize = 0;
+        unsafe {
+            if !snapit_buffer_bytes(runtime, value.0, &mut data, &mut length) {
+                return None;
+            }
+        }
+        Some(JsBytes { data, length, _marker: PhantomData })
+    }
+}
+
+// any value, not checked
+impl FromArg for RawValue {
+    const EXPECTED: &'static str = "any value";
+    fn from_arg(_runtime: *mut Runtime, value: RawValue) -> Option<RawValue> {
+        Some(value)
+    }
+}
+
+// Return types for typed_native!
+pub trait IntoResult {
+    fn into_result(self, runtime: *mut Runtime) -> NativeCallResult;
+}
+
+impl IntoResult for f64 {
+    fn into_result(self, _runtime: *mut Runtime) -> NativeCallResult {
+        NativeCallResult::returned(RawValue::number(self))
+    }
+}
+
+impl IntoResult for bool {
+    fn into_result(self, _runtime: *mut Runtime) -> NativeCallResult {
+        NativeCallResult::returned(RawValue::bool(self))
+    }
+}
+
+impl IntoResult for () {
+    fn into_result(self, _runtime: *mut Runtime) -> NativeCallResult {
+        NativeCallResult::undefined()
+    }
+}
+
+impl IntoResult for RawValue {
+    fn into_result(self, _runtime: *mut Runtime) -> NativeCallResult {
+        NativeCallResult::returned(self)
+    }
+}
+
+impl<'a> IntoResult for &'a str {
+    fn into_result(self, runtime: *mut Runtime) -> NativeCallResult {
+        match make_string(runtime, self) {
+            Some(value) => NativeCallResult::returned(value),
+            None => NativeCallResult::exception(),
+        }
+    }
+}
+
+impl IntoResult for String {
+    fn into_result(self, runtime: *mut Runtime) -> NativeCallResult {
+        self.as_str().into_result(runtime)
+    }
+}
+
+// an error becomes a TypeError with its message
+impl<T: IntoResult> IntoResult for Result<T, String> {
+    fn into_result(self, runtime: *mut Runtime) -> NativeCallResult {
+        match self {
+            Ok(value) => value.into_result(runtime),
+            Err(message) => throw_type_error(runtime, &message),
+        }
+    }
+}
+
+// index starts at 0, only called on the error path
+pub fn throw_argument_error(runtime: *mut Runtime, index: u32, expected: &str) -> NativeCallResult {
+    throw_type_error(runtime, &format!("argument {} must be {}", index + 1, expected))
+}
+
+// Decodes argument index for typed_native!, the error is the TypeError to
+// return
+pub fn decode_arg<T: FromArg>(runtime: *mut Runtime, args: &FastArgs, index: u32) -> Result<T, NativeCallResult> {
+    match T::from_arg(runtime, args.get(index)) {
+        Some(value) => Ok(value),
+        None => Err(throw_argument_error(runtime, index, T::EXPECTED)),
+    }
+}
+
+// Declares a fast native function from a typed signature. The arguments are
+// decoded and checked with FromArg and the result is encoded with
+// IntoResult, all monomorphized so nothing is dispatched at runtime:
+//   typed_native! {
+//       fn native_add(a: f64, b: f64) -> f64 { a + b }
+//   }
+// native_add is then a FastNativeFunction. The param count to define it with
+// is the number of arguments. An argument with the wrong type, missing ones
+// included, throws a TypeError before the body runs. Structs declared with
+// js_object! work as arguments and results, see object_shape.rs.
+macro_rules! typed_native {
+    ($(#[$meta:meta])* fn $name:ident($($arg:ident: $type:ty),* $(,)?) $body:block) => {
+        $crate::native::typed_native! { $(#[$meta])* fn $name($($arg: $type),*) -> () $body }
+    };
+    ($(#[$meta:meta])* fn $name:ident($($arg:ident: $type:ty),* $(,)?) -> $ret:ty $body:block) => {
+        $(#[$meta])*
+        extern "C" fn $name(
+            _user_data: *mut autocxx::c_void,
+            runtime: *mut $crate::native::Runtime,
+            args: *const $crate::native::NativeArgs,
+        ) -> $crate::native::NativeCallResult {
+            let args = unsafe { $crate::native::FastArgs::from_raw(args) };
+            // arguments that allocate first, see FromArg::ALLOCATES
+            let mut _index: u32 = 0;
+            $(
+                let $arg: Option<$type> = match <$type as $crate::native::FromArg>::ALLOCATES {
+                    true => match $crate::native::decode_arg::<$type>(runtime, &args, _index) {
+                        Ok(value) => Some(value),
+                        Err(error) => return error,
+                    },
+                    false => None,
+                };
+                _index += 1;
+            )*
+            let mut _index: u32 = 0;
+            $(
+                let $arg: $type = match $arg {
+                    Some(value) => value,
+                    None => match $crate::native::decode_arg::<$type>(runtime, &args, _index) {
+                        Ok(value) => value,
+                        Err(error) => return error,
+                    },
+                };
+                _index += 1;
+            )*
+            // the arguments move into the body and are dropped with it, so
+            // the result can't borrow a JsStr's characters while it allocates
+            let result: $ret = (move || $body)();
+            $crate::native::IntoResult::into_result(result, runtime)
+        }
+    };
+}
+pub(crate) use typed_native;
+
+// FastFunctionContext takes the function as void*
+pub fn function_pointer(function: FastNativeFunction) -> *mut c_void {
+    function as *mut c_void
+}
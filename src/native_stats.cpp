@@ -0,0 +1,158 @@
+#include "native_stats.hpp"
+
+#include <algorithm>
+
+#include "hermes/Support/JSONEmitter.h"
+#include "llvh/Support/FileSystem.h"
+#include "llvh/Support/MathExtras.h"
+
+void NativeCallStats::record(uint64_t nanoseconds, uint64_t allocatedBytes) {
+  sampledCalls.fetch_add(1, std::memory_order_relaxed);
+  sampledNanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+  sampledAllocatedBytes.fetch_add(allocatedBytes, std::memory_order_relaxed);
+  buckets[bucketFor(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+}
+
+unsigned NativeCallStats::bucketFor(uint64_t nanoseconds) {
+  if (nanoseconds < kSubBuckets) {
+    return static_cast<unsigned>(nanoseconds);
+  }
+  // the top two bits below the highest set bit pick the sub bucket
+  const unsigned exponent = llvh::Log2_64(nanoseconds);
+  const unsigned subBucket = (nanoseconds >> (exponent - 2)) & (kSubBuckets - 1);
+  return std::min((exponent - 1) * kSubBuckets + subBucket, kBucketCount - 1);
+}
+
+uint64_t NativeCallStats::bucketLimit(unsigned bucket) {
+  if (bucket < kSubBuckets) {
+    return bucket + 1;
+  }
+  const unsigned exponent = bucket / kSubBuckets + 1;
+  const uint64_t subBucket = bucket % kSubBuckets;
+  return (kSubBuckets + subBucket + 1) << (exponent - 2);
+}
+
+uint64_t NativeCallStats::percentile(double fraction) const {
+  const uint64_t total = sampledCalls.load(std::memory_order_relaxed);
+  const uint64_t target = static_cast<uint64_t>(fraction * total);
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < kBucketCount; ++i) {
+    seen += buckets[i].load(std::memory_order_relaxed);
+    if (seen > target) {
+      return bucketLimit(i);
+    }
+  }
+  return bucketLimit(kBucketCount - 1);
+}
+
+void NativeCallStats::writeJSON(hermes::JSONEmitter& json) const {
+  const uint64_t callCount = calls.load(std::memory_order_relaxed);
+  const uint64_t sampled = sampledCalls.load(std::memory_order_relaxed);
+  const uint64_t nanoseconds = sampledNanoseconds.load(std::memory_order_relaxed);
+  const uint64_t allocated = sampledAllocatedBytes.load(std::memory_order_relaxed);
+  json.openDict();
+  json.emitKeyValue("name", name);
+  json.emitKeyValue("calls", callCount);
+  json.emitKeyValue("sampledCalls", sampled);
+  if (sampled != 0) {
+    // sampled calls stand in for the ones that weren't timed
+    json.emitKeyValue("totalNs", static_cast<double>(nanoseconds) * callCount / sampled);
+    json.emitKeyValue("meanNs", static_cast<double>(nanoseconds) / sampled);
+    json.emitKeyValue("p50Ns", percentile(0.5));
+    json.emitKeyValue("p90Ns", percentile(0.9));
+    json.emitKeyValue("p99Ns", percentile(0.99));
+    json.emitKeyValue("allocatedBytesPerCall", static_cast<double>(allocated) / sampled);
+  }
+  // [limit in ns, count] for every bucket that isn't empty
+  json.emitKey("histogram");
+  json.openArray();
+  for (unsigned i = 0; i < kBucketCount; ++i) {
+    const uint64_t count = buckets[i].load(std::memory_order_relaxed);
+    if (count == 0) {
+      continue;
+    }
+    json.openArray();
+    json.emitValue(bucketLimit(i));
+    json.emitValue(count);
+    json.closeArray();
+  }
+  json.closeArray();
+  json.closeDict();
+}
+
+void NativeCallStats::reset() {
+  calls.store(0, std::memory_order_relaxed);
+  sampledCalls.store(0, std::memory_order_relaxed);
+  sampledNanoseconds.store(0, std::memory_order_relaxed);
+  sampledAllocatedBytes.store(0, std::memory_order_relaxed);
+  for (auto& bucket : buckets) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+}
+
+NativeStatsRegistry& NativeStatsRegistry::getShared() {
+  static NativeStatsRegistry shared;
+  return shared;
+}
+
+NativeCallStats* NativeStatsRegistry::forFunction(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (const auto& entry : stats) {
+    if (entry->getName() == name) {
+      return entry.get();
+    }
+  }
+  stats.push_back(std::make_unique<NativeCallStats>(name));
+  return stats.back().get();
+}
+
+void NativeStatsRegistry::writeJSON(llvh::raw_ostream& os) const {
+  hermes::JSONEmitter json{os, true};
+  json.openDict();
+  json.emitKeyValue("sampleRate", nativeSampleRate.load(std::memory_order_relaxed));
+  json.emitKey("functions");
+  json.openArray();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto& entry : stats) {
+      if (entry->getCalls() != 0) {
+        entry->writeJSON(json);
+      }
+    }
+  }
+  json.closeArray();
+  json.closeDict();
+  json.endJSONL();
+}
+
+bool NativeStatsRegistry::dumpToFile(const std::string& path) const {
+  std::error_code error;
+  llvh::raw_fd_ostream file{path, error, llvh::sys::fs::F_Text};
+  if (error) {
+    llvh::errs() << "Failed to open " << path << ": " << error.message() << "\n";
+    return false;
+  }
+  writeJSON(file);
+  file.close();
+  if (file.has_error()) {
+    file.clear_error();
+    llvh::errs() << "Failed to write " << path << "\n";
+    return false;
+  }
+  return true;
+}
+
+void NativeStatsRegistry::reset() {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (const auto& entry : stats) {
+    entry->reset();
+  }
+}
+
+#if SNAPIT_NATIVE_INSTRUMENTATION
+uint64_t NativeCallScope::allocatedBytes(hermes::vm::Runtime& runtime) {
+  hermes::vm::GCBase::HeapInfo info;
+  runtime.getHeap().getHeapInfo(info);
+  return info.totalAllocatedBytes;
+}
+#endif
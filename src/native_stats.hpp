@@ -0,0 +1,141 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "hermes/VM/Runtime.h"
+
+// Set to 0 to compile the instrumentation out of every native call.
+#ifndef SNAPIT_NATIVE_INSTRUMENTATION
+#define SNAPIT_NATIVE_INSTRUMENTATION 1
+#endif
+
+namespace hermes {
+class JSONEmitter;
+}
+
+// 0 turns instrumentation off, otherwise one in every this many calls of a
+// function is timed. Calls are always counted while it's on.
+inline std::atomic<uint32_t> nativeSampleRate{0};
+
+// Call count, time and GC allocations of one native function, from every
+// runtime and thread that calls it.
+// Latencies go into a log-linear histogram, each power of two of
+// nanoseconds is split into kSubBuckets equal buckets, so percentiles are
+// within 25% however wide the range of latencies is.
+class NativeCallStats {
+public:
+    static constexpr unsigned kSubBuckets = 4;
+    // up to 2^42 ns, over an hour, slower calls go in the last bucket
+    static constexpr unsigned kBucketCount = 41 * kSubBuckets;
+
+    explicit NativeCallStats(std::string _name): name(std::move(_name)) {}
+    NativeCallStats(const NativeCallStats&) = delete;
+    NativeCallStats& operator=(const NativeCallStats&) = delete;
+
+    const std::string& getName() const { return name; }
+    uint64_t getCalls() const { return calls.load(std::memory_order_relaxed); }
+
+    // counts a call, returns true if it should be timed
+    bool countCall(uint32_t sampleRate) {
+        const uint64_t call = calls.fetch_add(1, std::memory_order_relaxed);
+        return call % sampleRate == 0;
+    }
+    void record(uint64_t nanoseconds, uint64_t allocatedBytes);
+
+    static unsigned bucketFor(uint64_t nanoseconds);
+    // the first latency past the bucket
+    static uint64_t bucketLimit(unsigned bucket);
+
+    void writeJSON(hermes::JSONEmitter& json) const;
+    void reset();
+
+private:
+    // latency that percentile of the timed calls were under
+    uint64_t percentile(double fraction) const;
+
+    const std::string name;
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> sampledCalls{0};
+    std::atomic<uint64_t> sampledNanoseconds{0};
+    std::atomic<uint64_t> sampledAllocatedBytes{0};
+    std::atomic<uint64_t> buckets[kBucketCount]{};
+};
+
+// Every NativeCallStats in the process, by function name.
+class NativeStatsRegistry {
+public:
+    static NativeStatsRegistry& getShared();
+
+    // the same name always gets the same stats, they live as long as the
+    // process
+    NativeCallStats* forFunction(const std::string& name);
+
+    // functions that were never called are left out
+    void writeJSON(llvh::raw_ostream& os) const;
+    bool dumpToFile(const std::string& path) const;
+    void reset();
+
+private:
+    NativeStatsRegistry() {}
+
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<NativeCallStats>> stats;
+};
+
+// Times the native call it's declared in, if its function has stats and
+// this call is sampled. Costs one relaxed load when instrumentation is off.
+// Allocations are read from the GC's heap info, which isn't free, so keep the
+// sample rate above 1 for functions that are called in tight loops.
+class NativeCallScope {
+public:
+#if SNAPIT_NATIVE_INSTRUMENTATION
+    NativeCallScope(NativeCallStats* _stats, hermes::vm::Runtime& _runtime) {
+        const uint32_t sampleRate = nativeSampleRate.load(std::memory_order_relaxed);
+        if (LLVM_LIKELY(sampleRate == 0) || _stats == nullptr || !_stats->countCall(sampleRate)) {
+            return;
+        }
+        stats = _stats;
+        runtime = &_runtime;
+        allocatedBefore = allocatedBytes(_runtime);
+        start = std::chrono::steady_clock::now();
+    }
+
+    ~NativeCallScope() {
+        if (LLVM_LIKELY(stats == nullptr)) {
+            return;
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        stats->record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+            allocatedBytes(*runtime) - allocatedBefore);
+    }
+#else
+    NativeCallScope(NativeCallStats*, hermes::vm::Runtime&) {}
+#endif
+
+    NativeCallScope(const NativeCallScope&) = delete;
+    NativeCallScope& operator=(const NativeCallScope&) = delete;
+
+private:
+#if SNAPIT_NATIVE_INSTRUMENTATION
+    static uint64_t allocatedBytes(hermes::vm::Runtime& runtime);
+
+    NativeCallStats* stats = nullptr;
+    hermes::vm::Runtime* runtime = nullptr;
+    uint64_t allocatedBefore = 0;
+    std::chrono::steady_clock::time_point start;
+#endif
+};
+
+inline void setNativeSampleRate(uint32_t rate) {
+    nativeSampleRate.store(rate, std::memory_order_relaxed);
+}
+
+inline bool dumpNativeStats(const std::string& path) {
+    return NativeStatsRegistry::getShared().dumpToFile(path);
+}
@@ -0,0 +1,386 @@
+#include "object_shape.hpp"
+
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "string_bridge.hpp"
+
+namespace {
+struct ShapeRegistry {
+  std::mutex mutex;
+  // the names of shape id i + 1
+  std::deque<std::vector<std::string>> shapes;
+  // by the names joined with '\0'
+  std::unordered_map<std::string, uint32_t> ids;
+};
+
+ShapeRegistry& getShapeRegistry() {
+  static ShapeRegistry registry;
+  return registry;
+}
+
+// copies the names out, returns false for an unknown id
+bool getShapeNames(uint32_t shape, std::vector<std::string>& names) {
+  ShapeRegistry& registry = getShapeRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  if (shape == 0 || shape > registry.shapes.size()) {
+    return false;
+  }
+  names = registry.shapes[shape - 1];
+  return true;
+}
+
+std::mutex runtimesMutex;
+std::unordered_map<hermes::vm::Runtime*, ObjectShapes*> runtimes;
+} // namespace
+
+thread_local ObjectShapes* ObjectShapes::currentShapes = nullptr;
+
+ObjectShapes::ObjectShapes(hermes::vm::Runtime& _runtime):
+  runtime(_runtime),
+  self(std::make_shared<ObjectShapes*>(this))
+{
+  // the runtime can outlive this, self is cleared when it's destroyed
+  runtime.addCustomRootsFunction(
+      [self = self](hermes::vm::GC*, hermes::vm::RootAcceptor& acceptor) {
+        if (!*self) {
+          return;
+        }
+        for (auto& entry : (*self)->prepared) {
+          if (!entry) {
+            continue;
+          }
+          for (auto& name : entry->names) {
+            acceptor.accept(name);
+          }
+          acceptor.accept(entry->clazz);
+        }
+        for (auto& value : (*self)->stack) {
+          acceptor.accept(value);
+        }
+      });
+  std::lock_guard<std::mutex> lock(runtimesMutex);
+  runtimes[&runtime] = this;
+}
+
+ObjectShapes::~ObjectShapes() {
+  *self = nullptr;
+  // see ~AsyncNativeCalls
+  std::lock_guard<std::mutex> lock(runtimesMutex);
+  auto found = runtimes.find(&runtime);
+  if (found != runtimes.end() && found->second == this) {
+    runtimes.erase(found);
+  }
+}
+
+ObjectShapes* ObjectShapes::forRuntime(hermes::vm::Runtime& runtime) {
+  std::lock_guard<std::mutex> lock(runtimesMutex);
+  auto found = runtimes.find(&runtime);
+  return found == runtimes.end() ? nullptr : found->second;
+}
+
+uint32_t ObjectShapes::define(const std::vector<std::string>& names) {
+  std::string key;
+  std::unordered_set<std::string> seen;
+  for (const std::string& name : names) {
+    if (!isASCII(name.data(), name.size()) ||
+        name.find('\0') != std::string::npos ||
+        !seen.insert(name).second) {
+      return 0;
+    }
+    key += name;
+    key += '\0';
+  }
+  ShapeRegistry& registry = getShapeRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  auto found = registry.ids.find(key);
+  if (found != registry.ids.end()) {
+    return found->second;
+  }
+  registry.shapes.push_back(names);
+  const uint32_t id = static_cast<uint32_t>(registry.shapes.size());
+  registry.ids.emplace(std::move(key), id);
+  return id;
+}
+
+const ObjectShapes::Prepared* ObjectShapes::prepare(uint32_t shape) {
+  using namespace hermes;
+  if (shape < prepared.size() && prepared[shape]) {
+    return prepared[shape].get();
+  }
+  std::vector<std::string> names;
+  if (!getShapeNames(shape, names)) {
+    runtime.raiseTypeError("unknown object shape");
+    return nullptr;
+  }
+  if (prepared.size() <= shape) {
+    prepared.resize(shape + 1);
+  }
+  // marked from here on, so the names survive the allocations below
+  prepared[shape] = std::make_unique<Prepared>();
+  Prepared& entry = *prepared[shape];
+  entry.clazz = vm::HermesValue::encodeEmptyValue();
+  entry.names.resize(names.size());
+  for (size_t i = 0; i < names.size(); ++i) {
+    entry.names[i] = vm::HermesValue::encodeUndefinedValue();
+  }
+
+  vm::GCScope scope(runtime);
+  for (size_t i = 0; i < names.size(); ++i) {
+    auto symbol = runtime.getIdentifierTable().getSymbolHandle(
+        runtime, vm::createASCIIRef(names[i].c_str()));
+    if (LLVM_UNLIKELY(symbol == vm::ExecutionStatus::EXCEPTION)) {
+      prepared[shape].reset();
+      return nullptr;
+    }
+    entry.names[i] = vm::HermesValue::encodeSymbolValue(**symbol);
+  }
+
+  // the same root class and flags an object literal starts from
+  vm::MutableHandle<vm::HiddenClass> clazz{
+      runtime,
+      runtime.getHiddenClassForPrototypeRaw(
+          vm::vmcast<vm::JSObject>(runtime.objectPrototype),
+          vm::JSObject::numOverlapSlots<vm::JSObject>())};
+  for (size_t i = 0; i < names.size(); ++i) {
+    auto added = vm::HiddenClass::addProperty(
+        clazz,
+        runtime,
+        entry.names[i].getSymbol(),
+        vm::PropertyFlags::defaultNewNamedPropertyFlags());
+    if (LLVM_UNLIKELY(added == vm::ExecutionStatus::EXCEPTION)) {
+      prepared[shape].reset();
+      return nullptr;
+    }
+    clazz = added->first.get();
+    entry.slots.push_back(added->second);
+  }
+  // too many properties, every object gets its own class
+  if (!clazz->isDictionary()) {
+    entry.clazz = vm::HermesValue::encodeObjectValue(clazz.get());
+  }
+  return &entry;
+}
+
+void ObjectShapes::truncate(size_t depth) {
+  if (depth < stack.size()) {
+    stack.resize(depth);
+  }
+}
+
+void ObjectShapes::push(hermes::vm::HermesValue value) {
+  stack.emplace_back();
+  stack.back() = value;
+}
+
+bool ObjectShapes::pushString(const char* chars, size_t length) {
+  auto string = createStringFromUTF8(runtime, chars, length);
+  if (LLVM_UNLIKELY(string == hermes::vm::ExecutionStatus::EXCEPTION)) {
+    return false;
+  }
+  push(*string);
+  return true;
+}
+
+hermes::vm::HermesValue ObjectShapes::pop() {
+  hermes::vm::HermesValue value = stack.back();
+  stack.pop_back();
+  return value;
+}
+
+bool ObjectShapes::makeObject(uint32_t shape) {
+  using namespace hermes;
+  vm::GCScope scope(runtime);
+  const Prepared* entry = prepare(shape);
+  if (!entry) {
+    return false;
+  }
+  const size_t count = entry->names.size();
+  assert(stack.size() >= count && "not enough values for the shape");
+  const size_t base = stack.size() - count;
+
+  vm::MutableHandle<vm::JSObject> object{runtime};
+  if (!entry->clazz.isEmpty()) {
+    // every slot is allocated up front and written in place
+    auto clazz = runtime.makeHandle(vm::vmcast<vm::HiddenClass>(entry->clazz));
+    object = vm::JSObject::create(
+        runtime, vm::Handle<vm::JSObject>::vmcast(&runtime.objectPrototype), clazz).get();
+    for (size_t i = 0; i < count; ++i) {
+      // boxing a double can allocate, so the object is read again after it
+      auto value = vm::SmallHermesValue::encodeHermesValue(stack[base + i], runtime);
+      vm::JSObject::setNamedSlotValueUnsafe(object.get(), runtime, entry->slots[i], value);
+    }
+  } else {
+    object = vm::JSObject::create(runtime).get();
+    vm::MutableHandle<> value{runtime};
+    for (size_t i = 0; i < count; ++i) {
+      value = stack[base + i];
+      if (LLVM_UNLIKELY(
+              vm::JSObject::defineNewOwnProperty(
+                  object,
+                  runtime,
+                  entry->names[i].getSymbol(),
+                  vm::PropertyFlags::defaultNewNamedPropertyFlags(),
+                  value) == vm::ExecutionStatus::EXCEPTION)) {
+        return false;
+      }
+    }
+  }
+  stack.resize(base + 1);
+  stack[base] = object.getHermesValue();
+  return true;
+}
+
+bool ObjectShapes::makeArray(uint32_t length) {
+  using namespace hermes;
+  vm::GCScope scope(runtime);
+  assert(stack.size() >= length && "not enough values for the array");
+  const size_t base = stack.size() - length;
+  auto array = vm::JSArray::create(runtime, length, length);
+  if (LLVM_UNLIKELY(array == vm::ExecutionStatus::EXCEPTION)) {
+    return false;
+  }
+  vm::MutableHandle<> element{runtime};
+  for (uint32_t i = 0; i < length; ++i) {
+    element = stack[base + i];
+    if (LLVM_UNLIKELY(
+            vm::JSArray::setElementAt(*array, runtime, i, element) ==
+            vm::ExecutionStatus::EXCEPTION)) {
+      return false;
+    }
+  }
+  stack.resize(base + 1);
+  stack[base] = array->getHermesValue();
+  return true;
+}
+
+bool ObjectShapes::readObject(uint32_t shape, hermes::vm::HermesValue value) {
+  using namespace hermes;
+  auto* raw = vm::dyn_vmcast<vm::JSObject>(value);
+  if (!raw || raw->isProxyObject() || raw->isHostObject()) {
+    return false;
+  }
+  const size_t base = stack.size();
+
+  // the class matches, the slots are known and nothing allocates
+  if (shape < prepared.size() && prepared[shape] && !prepared[shape]->clazz.isEmpty() &&
+      raw->getClass(runtime) == vm::vmcast<vm::HiddenClass>(prepared[shape]->clazz)) {
+    const Prepared& entry = *prepared[shape];
+    stack.resize(base + entry.slots.size());
+    for (size_t i = 0; i < entry.slots.size(); ++i) {
+      stack[base + i] =
+          vm::JSObject::getNamedSlotValueUnsafe(raw, runtime, entry.slots[i]).unboxToHV(runtime);
+    }
+    return true;
+  }
+
+  vm::GCScope scope(runtime);
+  auto object = runtime.makeHandle(raw);
+  const Prepared* entry = prepare(shape);
+  if (!entry) {
+    return false;
+  }
+  const size_t count = entry->names.size();
+  stack.resize(base + count);
+  vm::NamedPropertyDescriptor desc;
+  for (size_t i = 0; i < count; ++i) {
+    if (!vm::JSObject::getOwnNamedDescriptor(object, runtime, entry->names[i].getSymbol(), desc)) {
+      stack[base + i] = vm::HermesValue::encodeUndefinedValue();
+      continue;
+    }
+    if (desc.flags.accessor || desc.flags.hostObject || desc.flags.proxyObject) {
+      truncate(base);
+      return false;
+    }
+    stack[base + i] =
+        vm::JSObject::getNamedSlotValueUnsafe(object.get(), runtime, desc.slot).unboxToHV(runtime);
+  }
+  return true;
+}
+
+bool ObjectShapes::readArray(hermes::vm::HermesValue value) {
+  using namespace hermes;
+  auto* array = vm::dyn_vmcast<vm::JSArray>(value);
+  if (!array || !array->hasFastIndexProperties()) {
+    return false;
+  }
+  // JS sets the length, a = []; a.length = 4294967295 has no storage behind
+  // it, so only the storage is read and an array it doesn't cover is sparse
+  const uint32_t length = vm::JSArray::getLength(array, runtime);
+  if (array->getBeginIndex() != 0 || array->getEndIndex() != length) {
+    return false;
+  }
+  const size_t base = stack.size();
+  stack.resize(base + length);
+  for (uint32_t i = 0; i < length; ++i) {
+    vm::HermesValue element = array->at(runtime, i).unboxToHV(runtime);
+    if (element.isEmpty()) {
+      stack.resize(base);
+      return false;
+    }
+    stack[base + i] = element;
+  }
+  return true;
+}
+
+extern "C" {
+uint32_t snapit_shape_define(const char* const* names, const size_t* lengths, uint32_t count) {
+  std::vector<std::string> copied;
+  copied.reserve(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    copied.emplace_back(names[i], lengths[i]);
+  }
+  return ObjectShapes::define(copied);
+}
+
+ObjectShapes* snapit_object_shapes(hermes::vm::Runtime* runtime) {
+  // the lookup is only for natives that weren't added through a BindingTable
+  ObjectShapes* shapes = ObjectShapes::current();
+  if (shapes && &shapes->getRuntime() == runtime) {
+    return shapes;
+  }
+  return ObjectShapes::forRuntime(*runtime);
+}
+
+size_t snapit_shapes_depth(const ObjectShapes* shapes) {
+  return shapes->depth();
+}
+
+void snapit_shapes_truncate(ObjectShapes* shapes, size_t depth) {
+  shapes->truncate(depth);
+}
+
+void snapit_shapes_push(ObjectShapes* shapes, uint64_t value) {
+  shapes->push(hermes::vm::HermesValue::fromRaw(value));
+}
+
+bool snapit_shapes_push_string(ObjectShapes* shapes, const char* chars, size_t length) {
+  return shapes->pushString(chars, length);
+}
+
+uint64_t snapit_shapes_at(const ObjectShapes* shapes, size_t index) {
+  return shapes->at(index).getRaw();
+}
+
+uint64_t snapit_shapes_pop(ObjectShapes* shapes) {
+  return shapes->pop().getRaw();
+}
+
+bool snapit_shapes_make_object(ObjectShapes* shapes, uint32_t shape) {
+  return shapes->makeObject(shape);
+}
+
+bool snapit_shapes_make_array(ObjectShapes* shapes, uint32_t length) {
+  return shapes->makeArray(length);
+}
+
+bool snapit_shapes_read_object(ObjectShapes* shapes, uint32_t shape, uint64_t value) {
+  return shapes->readObject(shape, hermes::vm::HermesValue::fromRaw(value));
+}
+
+bool snapit_shapes_read_array(ObjectShapes* shapes, uint64_t value) {
+  return shapes->readArray(hermes::vm::HermesValue::fromRaw(value));
+}
+}
@@ -0,0 +1,130 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "hermes/VM/HiddenClass.h"
+#include "hermes/VM/JSArray.h"
+
+#include "wrapper.hpp"
+
+// Building JS objects and arrays for the host, and reading them back.
+// A shape is a list of property names, defined once for the whole process.
+// Each runtime turns it into a hidden class the first time it's used and
+// keeps that class, so an object of the shape is allocated with all of its
+// slots and they're written by index, instead of adding the properties one
+// at a time and looking each one up. The class is reached through the same
+// transitions as an object literal with the same keys in the same order, so
+// such objects made in JS usually match it as well, and reading an object
+// whose class matches is a load per property.
+// Values are built on a stack that the runtime marks as roots: push the
+// properties in order, then makeObject replaces them with the object. The
+// stack keeps everything alive across the allocations in between.
+// BindingTable hands it to the natives of its runtime through their context,
+// and finds it by runtime to do that, so there's at most one per runtime.
+class ObjectShapes {
+public:
+    explicit ObjectShapes(hermes::vm::Runtime& runtime);
+    ObjectShapes(const ObjectShapes&) = delete;
+    ObjectShapes& operator=(const ObjectShapes&) = delete;
+    ~ObjectShapes();
+
+    // Null if the runtime has none. Takes a lock, calls use current().
+    static ObjectShapes* forRuntime(hermes::vm::Runtime& runtime);
+
+    // The ObjectShapes of the native function running on this thread, set
+    // from its context while it runs. A native can call into JS that calls
+    // another native, so the previous one comes back afterwards.
+    static ObjectShapes* current() { return currentShapes; }
+    class CallScope {
+    public:
+        explicit CallScope(ObjectShapes* shapes): previous(currentShapes) { currentShapes = shapes; }
+        CallScope(const CallScope&) = delete;
+        CallScope& operator=(const CallScope&) = delete;
+        ~CallScope() { currentShapes = previous; }
+
+    private:
+        ObjectShapes* previous;
+    };
+
+    hermes::vm::Runtime& getRuntime() const { return runtime; }
+
+    // Any thread. Names have to be ASCII and not repeat, returns 0 if they
+    // aren't. Defining the same names again returns the same id.
+    static uint32_t define(const std::vector<std::string>& names);
+
+    size_t depth() const { return stack.size(); }
+    // drops everything pushed after depth, for when building fails
+    void truncate(size_t depth);
+    void push(hermes::vm::HermesValue value);
+    // UTF-8, returns false if an exception was raised
+    bool pushString(const char* chars, size_t length);
+    // 0 is the bottom of the stack
+    hermes::vm::HermesValue at(size_t index) const { return stack[index]; }
+    hermes::vm::HermesValue pop();
+
+    // Replaces a value per property of shape, the first pushed is the first
+    // property, with the object. Returns false if an exception was raised.
+    bool makeObject(uint32_t shape);
+    // same for an array of the last length values, allocated at its size
+    bool makeArray(uint32_t length);
+
+    // Pushes the properties of shape read out of value, undefined for the
+    // ones it doesn't have. Only own data properties are read, so no JS
+    // runs. Returns false and pushes nothing if value isn't an object, is a
+    // proxy or host object or has an accessor for one of them, or if an
+    // exception was raised. Can only allocate if value's class isn't the
+    // shape's.
+    bool readObject(uint32_t shape, hermes::vm::HermesValue value);
+    // Pushes every element of an array. Returns false and pushes nothing if
+    // value isn't an array with indexed storage or has holes, a sparse array
+    // can claim any length.
+    bool readArray(hermes::vm::HermesValue value);
+
+private:
+    // what a shape is in this runtime
+    struct Prepared {
+        // the names, kept alive as symbol values
+        std::vector<hermes::vm::PinnedHermesValue> names;
+        // the HiddenClass, empty if it would be a dictionary, which isn't
+        // shared between objects
+        hermes::vm::PinnedHermesValue clazz;
+        std::vector<hermes::vm::SlotIndex> slots;
+    };
+
+    // interns the names and builds the class on first use
+    const Prepared* prepare(uint32_t shape);
+
+    hermes::vm::Runtime& runtime;
+    // indexed by shape id, null until used
+    std::vector<std::unique_ptr<Prepared>> prepared;
+    // both are marked as roots
+    std::vector<hermes::vm::PinnedHermesValue> stack;
+    // what the roots function marks through, null once this is destroyed
+    std::shared_ptr<ObjectShapes*> self;
+
+    static thread_local ObjectShapes* currentShapes;
+};
+
+extern "C" {
+// For the Rust side. names is count ASCII strings, see ObjectShapes::define.
+uint32_t snapit_shape_define(const char* const* names, const size_t* lengths, uint32_t count);
+// null if the runtime has no ObjectShapes, the running native's context
+// usually has it
+ObjectShapes* snapit_object_shapes(hermes::vm::Runtime* runtime);
+size_t snapit_shapes_depth(const ObjectShapes* shapes);
+void snapit_shapes_truncate(ObjectShapes* shapes, size_t depth);
+// value is a raw HermesValue that has to be rooted until it's pushed
+void snapit_shapes_push(ObjectShapes* shapes, uint64_t value);
+// the snapit_shapes_* functions that return bool return false if an
+// exception was raised, or if a read didn't match
+bool snapit_shapes_push_string(ObjectShapes* shapes, const char* chars, size_t length);
+uint64_t snapit_shapes_at(const ObjectShapes* shapes, size_t index);
+uint64_t snapit_shapes_pop(ObjectShapes* shapes);
+bool snapit_shapes_make_object(ObjectShapes* shapes, uint32_t shape);
+bool snapit_shapes_make_array(ObjectShapes* shapes, uint32_t length);
+bool snapit_shapes_read_object(ObjectShapes* shapes, uint32_t shape, uint64_t value);
+bool snapit_shapes_read_array(ObjectShapes* shapes, uint64_t value);
+}
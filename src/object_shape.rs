@@ -0,0 +1,399 @@
+// Building JS objects and arrays from Rust values and reading them back, see
+// ObjectShapes in object_shape.hpp. A struct declared with js_object! has a
+// Shape, so its objects are allocated with every slot in place and read back
+// by slot when they have the class the runtime made for it. Vec becomes an
+// array that's allocated at its length.
+
+use std::sync::atomic::{AtomicU32, Ordering};
+
+use crate::native::{throw_type_error, FromArg, IntoResult, JsStr, NativeCallResult, RawValue, Runtime};
+
+// ObjectShapes, only used through a pointer
+#[repr(C)]
+pub struct RawShapes {
+    _private: [u8; 0],
+}
+
+extern "C" {
+    fn snapit_shape_define(names: *const *const u8, lengths: *const usize, count: u32) -> u32;
+    fn snapit_object_shapes(runtime: *mut Runtime) -> *mut RawShapes;
+    fn snapit_shapes_depth(shapes: *const RawShapes) -> usize;
+    fn snapit_shapes_truncate(shapes: *mut RawShapes, depth: usize);
+    fn snapit_shapes_push(shapes: *mut RawShapes, value: u64);
+    fn snapit_shapes_push_string(shapes: *mut RawShapes, chars: *const u8, length: usize) -> bool;
+    fn snapit_shapes_at(shapes: *const RawShapes, index: usize) -> u64;
+    fn snapit_shapes_pop(shapes: *mut RawShapes) -> u64;
+    fn snapit_shapes_make_object(shapes: *mut RawShapes, shape: u32) -> bool;
+    fn snapit_shapes_make_array(shapes: *mut RawShapes, length: u32) -> bool;
+    fn snapit_shapes_read_object(shapes: *mut RawShapes, shape: u32, value: u64) -> bool;
+    fn snapit_shapes_read_array(shapes: *mut RawShapes, value: u64) -> bool;
+}
+
+// The property names of a struct, in the order its objects get them. It's
+// defined for the process the first time it's used.
+pub struct Shape {
+    names: &'static [&'static str],
+    id: AtomicU32,
+}
+
+impl Shape {
+    pub const fn new(names: &'static [&'static str]) -> Shape {
+        Shape { names: names, id: AtomicU32::new(0) }
+    }
+
+    pub fn names(&self) -> &'static [&'static str] {
+        self.names
+    }
+
+    // panics if the names aren't ASCII or repeat
+    pub fn id(&self) -> u32 {
+        let id = self.id.load(Ordering::Relaxed);
+        if id != 0 {
+            return id;
+        }
+        let pointers: Vec<*const u8> = self.names.iter().map(|name| name.as_ptr()).collect();
+        let lengths: Vec<usize> = self.names.iter().map(|name| name.len()).collect();
+        // defining the same names twice returns the same id, so racing here
+        // is harmless
+        let id = unsafe { snapit_shape_define(pointers.as_ptr(), lengths.as_ptr(), self.names.len() as u32) };
+        assert!(id != 0, "object shape names have to be ASCII and can't repeat: {:?}", self.names);
+        self.id.store(id, Ordering::Relaxed);
+        id
+    }
+}
+
+// The value stack of a runtime. What's on it is rooted, so a value being
+// built or read stays valid while other values allocate.
+pub struct Values {
+    shapes: *mut RawShapes,
+    runtime: *mut Runtime,
+}
+
+impl Values {
+    // None if the runtime has no ObjectShapes, which every Engine has
+    pub fn for_runtime(runtime: *mut Runtime) -> Option<Values> {
+        let shapes = unsafe { snapit_object_shapes(runtime) };
+        match shapes.is_null() {
+            true => None,
+            false => Some(Values { shapes: shapes, runtime: runtime }),
+        }
+    }
+
+    pub fn runtime(&self) -> *mut Runtime {
+        self.runtime
+    }
+
+    pub fn depth(&self) -> usize {
+        unsafe { snapit_shapes_depth(self.shapes) }
+    }
+
+    pub fn truncate(&mut self, depth: usize) {
+        unsafe { snapit_shapes_truncate(self.shapes, depth) }
+    }
+
+    // the value has to be rooted, or nothing can have allocated since it was
+    // read
+    pub fn push(&mut self, value: RawValue) {
+        unsafe { snapit_shapes_push(self.shapes, value.0) }
+    }
+
+    // the push_*, make_* and read_* functions return false if an exception
+    // was raised, or if a read didn't match
+    pub fn push_str(&mut self, value: &str) -> bool {
+        unsafe { snapit_shapes_push_string(self.shapes, value.as_ptr(), value.len()) }
+    }
+
+    // only valid until the next allocation
+    pub fn at(&self, index: usize) -> RawValue {
+        RawValue(unsafe { snapit_shapes_at(self.shapes, index) })
+    }
+
+    // not rooted anymore, return it before anything allocates
+    pub fn pop(&mut self) -> RawValue {
+        RawValue(unsafe { snapit_shapes_pop(self.shapes) })
+    }
+
+    // replaces the last shape.names().len() values with an object
+    pub fn make_object(&mut self, shape: &Shape) -> bool {
+        unsafe { snapit_shapes_make_object(self.shapes, shape.id()) }
+    }
+
+    // replaces the last length values with an array
+    pub fn make_array(&mut self, length: u32) -> bool {
+        unsafe { snapit_shapes_make_array(self.shapes, length) }
+    }
+
+    // pushes a value per name of shape, undefined for missing properties
+    pub fn read_object(&mut self, shape: &Shape, value: RawValue) -> bool {
+        unsafe { snapit_shapes_read_object(self.shapes, shape.id(), value.0) }
+    }
+
+    // Pushes every element. Returns false and pushes nothing if value isn't
+    // an array with indexed storage or has holes.
+    pub fn read_array(&mut self, value: RawValue) -> bool {
+        unsafe { snapit_shapes_read_array(self.shapes, value.0) }
+    }
+}
+
+// Rust values that can be written as a JS value
+pub trait ToJs {
+    // pushes one value, returns false if an exception was raised
+    fn push_to(&self, values: &mut Values) -> bool;
+}
+
+// Rust values that can be read out of a JS value. They own what they read,
+// since reading the next field can allocate.
+pub trait FromJs: Sized {
+    // None if the value doesn't match, or if an exception was raised
+    fn from_js(values: &mut Values, value: RawValue) -> Option<Self>;
+}
+
+impl ToJs for f64 {
+    fn push_to(&self, values: &mut Values) -> bool {
+        values.push(RawValue::number(*self));
+        true
+    }
+}
+
+impl FromJs for f64 {
+    fn from_js(_values: &mut Values, value: RawValue) -> Option<f64> {
+        value.as_number()
+    }
+}
+
+impl ToJs for bool {
+    fn push_to(&self, values: &mut Values) -> bool {
+        values.push(RawValue::bool(*self));
+        true
+    }
+}
+
+impl FromJs for bool {
+    fn from_js(values: &mut Values, value: RawValue) -> Option<bool> {
+        <bool as FromArg>::from_arg(values.runtime(), value)
+    }
+}
+
+impl ToJs for str {
+    fn push_to(&self, values: &mut Values) -> bool {
+        values.push_str(self)
+    }
+}
+
+impl ToJs for String {
+    fn push_to(&self, values: &mut Values) -> bool {
+        values.push_str(self)
+    }
+}
+
+impl FromJs for String {
+    fn from_js(values: &mut Values, value: RawValue) -> Option<String> {
+        <JsStr as FromArg>::from_arg(values.runtime(), value).map(|chars| chars.to_string())
+    }
+}
+
+// None is written as undefined, undefined and null are read as None
+impl<T: ToJs> ToJs for Option<T> {
+    fn push_to(&self, values: &mut Values) -> bool {
+        match self {
+            Some(value) => value.push_to(values),
+            None => {
+                values.push(RawValue::undefined());
+                true
+            }
+        }
+    }
+}
+
+impl<T: FromJs> FromJs for Option<T> {
+    fn from_js(values: &mut Values, value: RawValue) -> Option<Option<T>> {
+        if value.is_undefined() || value.is_null() {
+            return Some(None);
+        }
+        T::from_js(values, value).map(Some)
+    }
+}
+
+impl<T: ToJs> ToJs for [T] {
+    fn push_to(&self, values: &mut Values) -> bool {
+        let depth = values.depth();
+        for element in self {
+            if !element.push_to(values) {
+                values.truncate(depth);
+                return false;
+            }
+        }
+        values.make_array(self.len() as u32)
+    }
+}
+
+impl<T: ToJs> ToJs for Vec<T> {
+    fn push_to(&self, values: &mut Values) -> bool {
+        self.as_slice().push_to(values)
+    }
+}
+
+impl<T: FromJs> FromJs for Vec<T> {
+    fn from_js(values: &mut Values, value: RawValue) -> Option<Vec<T>> {
+        let depth = values.depth();
+        if !values.read_array(value) {
+            return None;
+        }
+        let length = values.depth() - depth;
+        let mut elements = Vec::with_capacity(length);
+        for index in 0..length {
+            // read again every time, the last element could have moved it
+            let element = values.at(depth + index);
+            match T::from_js(values, element) {
+                Some(element) => elements.push(element),
+                None => {
+                    values.truncate(depth);
+                    return None;
+                }
+            }
+        }
+        values.truncate(depth);
+        Some(elements)
+    }
+}
+
+impl<T: ToJs + ?Sized> ToJs for &T {
+    fn push_to(&self, values: &mut Values) -> bool {
+        (**self).push_to(values)
+    }
+}
+
+// Creates the JS value for value. Returns None if an exception was raised,
+// in which case the native function has to return
+// NativeCallResult::exception().
+pub fn make_value<T: ToJs + ?Sized>(runtime: *mut Runtime, value: &T) -> Option<RawValue> {
+    let mut values = match Values::for_runtime(runtime) {
+        Some(values) => values,
+        None => {
+            throw_type_error(runtime, "this runtime can't build objects");
+            return None;
+        }
+    };
+    let depth = values.depth();
+    if !value.push_to(&mut values) {
+        values.truncate(depth);
+        return None;
+    }
+    Some(values.pop())
+}
+
+// Reads value into a T, for FromArg
+pub fn read_value<T: FromJs>(runtime: *mut Runtime, value: RawValue) -> Option<T> {
+    let mut values = Values::for_runtime(runtime)?;
+    T::from_js(&mut values, value)
+}
+
+// for IntoResult
+pub fn value_result<T: ToJs + ?Sized>(runtime: *mut Runtime, value: &T) -> NativeCallResult {
+    match make_value(runtime, value) {
+        Some(value) => NativeCallResult::returned(value),
+        None => NativeCallResult::exception(),
+    }
+}
+
+impl<T: FromJs> FromArg for Vec<T> {
+    const EXPECTED: &'static str = "an array without holes";
+    const ALLOCATES: bool = true;
+    fn from_arg(runtime: *mut Runtime, value: RawValue) -> Option<Vec<T>> {
+        read_value(runtime, value)
+    }
+}
+
+impl<T: ToJs> IntoResult for Vec<T> {
+    fn into_result(self, runtime: *mut Runtime) -> NativeCallResult {
+        value_result(runtime, &self)
+    }
+}
+
+// Declares a struct that maps to a JS object with a property per field, in
+// the order of the fields:
+//   js_object! {
+//       struct Point { x: f64, y: f64 }
+//   }
+// Point then works as an argument and result of typed_native! functions, as
+// a field of other js_object! structs and in a Vec. Fields can be anything
+// that implements ToJs and FromJs: f64, bool, String, Option, Vec and other
+// js_object! structs. Properties the object doesn't have read as undefined,
+// so only Option fields can be missing.
+macro_rules! js_object {
+    (
+        $(#[$meta:meta])*
+        $vis:vis struct $name:ident {
+            $($(#[$field_meta:meta])* $field_vis:vis $field:ident: $type:ty),* $(,)?
+        }
+    ) => {
+        $(#[$meta])*
+        $vis struct $name {
+            $($(#[$field_meta])* $field_vis $field: $type),*
+        }
+
+        impl $name {
+            pub fn shape() -> &'static $crate::object_shape::Shape {
+                static SHAPE: $crate::object_shape::Shape =
+                    $crate::object_shape::Shape::new(&[$(stringify!($field)),*]);
+                &SHAPE
+            }
+        }
+
+        impl $crate::object_shape::ToJs for $name {
+            fn push_to(&self, values: &mut $crate::object_shape::Values) -> bool {
+                let _depth = values.depth();
+                $(
+                    if !$crate::object_shape::ToJs::push_to(&self.$field, values) {
+                        values.truncate(_depth);
+                        return false;
+                    }
+                )*
+                values.make_object($name::shape())
+            }
+        }
+
+        impl $crate::object_shape::FromJs for $name {
+            fn from_js(
+                values: &mut $crate::object_shape::Values,
+                value: $crate::native::RawValue,
+            ) -> Option<$name> {
+                let depth = values.depth();
+                if !values.read_object($name::shape(), value) {
+                    return None;
+                }
+                let mut _index: usize = depth;
+                let result = (|| {
+                    Some($name {
+                        $(
+                            $field: {
+                                // read again every time, the last field could
+                                // have moved it
+                                let field = values.at(_index);
+                                _index += 1;
+                                <$type as $crate::object_shape::FromJs>::from_js(values, field)?
+                            },
+                        )*
+                    })
+                })();
+                values.truncate(depth);
+                result
+            }
+        }
+
+        impl $crate::native::FromArg for $name {
+            const EXPECTED: &'static str = concat!("an object with the properties of ", stringify!($name));
+            const ALLOCATES: bool = true;
+            fn from_arg(runtime: *mut $crate::native::Runtime, value: $crate::native::RawValue) -> Option<$name> {
+                $crate::object_shape::read_value(runtime, value)
+            }
+        }
+
+        impl $crate::native::IntoResult for $name {
+            fn into_result(self, runtime: *mut $crate::native::Runtime) -> $crate::native::NativeCallResult {
+                $crate::object_shape::value_result(runtime, &self)
+            }
+        }
+    };
+}
+pub(crate) use js_object;
@@ -0,0 +1,103 @@
+#include "pending_promises.hpp"
+
+PendingPromises::PendingPromises(hermes::vm::Runtime& _runtime):
+  runtime(_runtime),
+  resolvers(std::make_shared<ResolversById>())
+{
+  runtime.addCustomRootsFunction(
+      [resolvers = resolvers](hermes::vm::GC*, hermes::vm::RootAcceptor& acceptor) {
+        for (auto& entry : *resolvers) {
+          acceptor.accept(entry.second->resolve);
+          acceptor.accept(entry.second->reject);
+        }
+      });
+}
+
+PendingPromises::~PendingPromises() {
+  resolvers->clear();
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> PendingPromises::takeResolvers(
+  void* context,
+  hermes::vm::Runtime& runtime,
+  hermes::vm::NativeArgs args
+) {
+  Resolvers& promise = *static_cast<Resolvers*>(context);
+  promise.resolve = args.getArg(0);
+  promise.reject = args.getArg(1);
+  return hermes::vm::HermesValue::encodeUndefinedValue();
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> PendingPromises::create(uint32_t& id) {
+  using namespace hermes;
+  auto promiseConstructor = getGlobalFunction(runtime, "Promise");
+  if (LLVM_UNLIKELY(promiseConstructor == vm::ExecutionStatus::EXCEPTION)) {
+    return vm::ExecutionStatus::EXCEPTION;
+  }
+  if (!*promiseConstructor) {
+    return runtime.raiseTypeError("Promise is not a constructor");
+  }
+
+  auto promise = std::make_unique<Resolvers>();
+  promise->resolve = vm::HermesValue::encodeUndefinedValue();
+  promise->reject = vm::HermesValue::encodeUndefinedValue();
+  auto executor = vm::NativeFunction::create(
+      runtime,
+      vm::Handle<vm::JSObject>::vmcast(&runtime.functionPrototype),
+      promise.get(),
+      takeResolvers,
+      vm::Predefined::getSymbolID(vm::Predefined::emptyString),
+      2,
+      vm::Runtime::makeNullHandle<vm::JSObject>());
+  // the executor runs before this returns, so promise holds both functions
+  auto created = vm::Callable::executeConstruct1(*promiseConstructor, runtime, executor);
+  if (LLVM_UNLIKELY(created == vm::ExecutionStatus::EXCEPTION)) {
+    return vm::ExecutionStatus::EXCEPTION;
+  }
+
+  id = nextId++;
+  resolvers->emplace(id, std::move(promise));
+  return created->get();
+}
+
+void PendingPromises::drop(uint32_t id) {
+  resolvers->erase(id);
+}
+
+hermes::vm::ExecutionStatus PendingPromises::settle(
+  uint32_t id,
+  hermes::vm::CallResult<hermes::vm::HermesValue> value
+) {
+  using namespace hermes;
+  vm::GCScope scope(runtime);
+  vm::MutableHandle<> argument{runtime};
+  const bool rejected = value == vm::ExecutionStatus::EXCEPTION;
+  if (rejected) {
+    argument = runtime.getThrownValue();
+    runtime.clearThrownValue();
+  } else {
+    argument = *value;
+  }
+
+  auto found = resolvers->find(id);
+  if (found == resolvers->end()) {
+    return vm::ExecutionStatus::RETURNED;
+  }
+  // handles keep them alive once the promise is no longer a root
+  auto resolve = vm::Handle<vm::Callable>::dyn_vmcast(
+      runtime.makeHandle(found->second->resolve));
+  auto reject = vm::Handle<vm::Callable>::dyn_vmcast(
+      runtime.makeHandle(found->second->reject));
+  resolvers->erase(found);
+  if (!resolve || !reject) {
+    return vm::ExecutionStatus::RETURNED;
+  }
+
+  auto called = vm::Callable::executeCall1(
+      rejected ? reject : resolve,
+      runtime,
+      vm::Runtime::getUndefinedValue(),
+      argument.getHermesValue());
+  return called == vm::ExecutionStatus::EXCEPTION ?
+      vm::ExecutionStatus::EXCEPTION : vm::ExecutionStatus::RETURNED;
+}
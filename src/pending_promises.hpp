@@ -0,0 +1,43 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+#include "wrapper.hpp"
+
+// Promises that native code settles later, by id. create() makes a promise
+// and keeps its resolve and reject functions as roots until settle() or
+// drop(). JS thread only.
+class PendingPromises {
+public:
+    explicit PendingPromises(hermes::vm::Runtime& runtime);
+    PendingPromises(const PendingPromises&) = delete;
+    PendingPromises& operator=(const PendingPromises&) = delete;
+    // promises still pending never settle
+    ~PendingPromises();
+
+    // returns the promise and sets id
+    hermes::vm::CallResult<hermes::vm::HermesValue> create(uint32_t& id);
+    // forgets a promise without settling it
+    void drop(uint32_t id);
+    // Resolves the promise with value, or rejects it with the thrown value if
+    // value is an exception. Returns the status of calling the resolver.
+    hermes::vm::ExecutionStatus settle(
+        uint32_t id, hermes::vm::CallResult<hermes::vm::HermesValue> value);
+
+private:
+    struct Resolvers {
+        hermes::vm::PinnedHermesValue resolve;
+        hermes::vm::PinnedHermesValue reject;
+    };
+    using ResolversById = std::unordered_map<uint32_t, std::unique_ptr<Resolvers>>;
+
+    // the promise executor, context is the Resolvers
+    static hermes::vm::CallResult<hermes::vm::HermesValue> takeResolvers(
+        void* context, hermes::vm::Runtime& runtime, hermes::vm::NativeArgs args);
+
+    hermes::vm::Runtime& runtime;
+    // shared with the roots function, the runtime can outlive this
+    std::shared_ptr<ResolversById> resolvers;
+    uint32_t nextId = 1;
+};
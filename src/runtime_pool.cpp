@@ -0,0 +1,172 @@
+#include "runtime_pool.hpp"
+
+RuntimePool::RuntimePool(
+  std::unique_ptr<hermes::Buffer> bytes,
+  const std::string& _sourceURL,
+  const RuntimeOptions& _runtimeOptions,
+  unsigned workerCount
+):
+  bytecode(loadBytecodeProvider(std::move(bytes), _sourceURL)),
+  sourceURL(_sourceURL),
+  runtimeOptions(_runtimeOptions)
+{
+  for (unsigned i = 0; i < workerCount; ++i) {
+    workers.push_back(std::make_unique<Worker>());
+  }
+}
+
+RuntimePool::~RuntimePool() {
+  stop();
+}
+
+void RuntimePool::setWorkerBindings(unsigned worker, const BindingsDefine& bindings) {
+  workers[worker]->bindings = &bindings;
+}
+
+bool RuntimePool::start() {
+  if (!bytecode || workers.empty()) {
+    return false;
+  }
+  for (const auto& worker : workers) {
+    if (!worker->bindings) {
+      llvh::errs() << "Every worker in a runtime pool needs bindings\n";
+      return false;
+    }
+  }
+  for (unsigned i = 0; i < workers.size(); ++i) {
+    workers[i]->thread = std::thread([this, i]() { runWorker(i); });
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  idle.wait(lock, [this]() { return startFailed || readyWorkers == workers.size(); });
+  if (startFailed) {
+    lock.unlock();
+    stop();
+    return false;
+  }
+  running = true;
+  return true;
+}
+
+bool RuntimePool::submit(const std::string& exportName, const CallArguments& args) {
+  return submitWithCallback(exportName, args, nullptr);
+}
+
+bool RuntimePool::submitWithCallback(
+  const std::string& exportName,
+  const CallArguments& args,
+  JobCallback callback
+) {
+  {
+    // counted before it's queued so the count is never behind the queues,
+    // and under the pool lock so a worker that is about to wait sees it
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!running) {
+      return false;
+    }
+    ++queuedJobs;
+    ++pendingJobs;
+  }
+  Worker& worker = *workers[nextWorker++ % workers.size()];
+  {
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    worker.jobs.push_back(Job{exportName, args, std::move(callback)});
+  }
+  wakeup.notify_one();
+  return true;
+}
+
+void RuntimePool::waitIdle() {
+  std::unique_lock<std::mutex> lock(mutex);
+  idle.wait(lock, [this]() { return pendingJobs == 0; });
+}
+
+bool RuntimePool::takeJob(unsigned index, Job& job) {
+  {
+    Worker& own = *workers[index];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (!own.jobs.empty()) {
+      job = std::move(own.jobs.front());
+      own.jobs.pop_front();
+      return true;
+    }
+  }
+  for (size_t i = 1; i < workers.size(); ++i) {
+    Worker& victim = *workers[(index + i) % workers.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.jobs.empty()) {
+      job = std::move(victim.jobs.back());
+      victim.jobs.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+void RuntimePool::runWorker(unsigned index) {
+  // the engine lives and dies on this thread
+  std::unique_ptr<Engine> engine = Engine::createWithProvider(
+      bytecode, sourceURL, *workers[index]->bindings, runtimeOptions);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (engine) {
+      ++readyWorkers;
+    } else {
+      startFailed = true;
+    }
+  }
+  idle.notify_all();
+  if (!engine) {
+    return;
+  }
+
+  while (true) {
+    Job job;
+    if (!takeJob(index, job)) {
+      std::unique_lock<std::mutex> lock(mutex);
+      // a job can be counted before it's visible in a queue, then this just
+      // goes around again
+      wakeup.wait(lock, [this]() { return stopping || queuedJobs != 0; });
+      if (stopping && queuedJobs == 0) {
+        return;
+      }
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      --queuedJobs;
+    }
+
+    EngineStatus status = engine->call(job.exportName, job.args);
+    if (status == EngineStatus::Returned) {
+      status = engine->awaitResult();
+    }
+    if (job.callback) {
+      job.callback(status, *engine);
+    }
+    if (status == EngineStatus::Returned) {
+      ++completedJobs;
+    } else {
+      ++failedJobs;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--pendingJobs == 0) {
+      idle.notify_all();
+    }
+  }
+}
+
+void RuntimePool::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    running = false;
+    stopping = true;
+  }
+  wakeup.notify_all();
+  for (const auto& worker : workers) {
+    if (worker->thread.joinable()) {
+      worker->thread.join();
+    }
+  }
+}
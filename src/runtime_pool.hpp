@@ -0,0 +1,103 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "wrapper.hpp"
+
+// A fixed set of worker threads, each with its own Engine, all running one
+// bundle whose bytecode is loaded once and shared.
+// Every runtime is created, used and destroyed on its worker's thread, and
+// only ever by that thread, which is all Hermes asks of a runtime.
+// Jobs are spread over per-worker queues. A worker takes jobs from the front
+// of its own queue and steals from the back of the others when it runs out,
+// so one slow job doesn't hold up the ones queued behind it.
+class RuntimePool {
+public:
+    // called on the worker's thread once the job is done
+    using JobCallback = std::function<void(EngineStatus status, Engine& engine)>;
+
+    RuntimePool(
+        std::unique_ptr<hermes::Buffer> bytes,
+        const std::string& sourceURL,
+        const RuntimeOptions& runtimeOptions,
+        unsigned workerCount
+    );
+    RuntimePool(const RuntimePool&) = delete;
+    RuntimePool& operator=(const RuntimePool&) = delete;
+    // finishes every queued job first
+    ~RuntimePool();
+
+    // Each worker installs its own bindings, so they don't have to be thread
+    // safe. Set them for every worker before start(), they have to outlive
+    // the pool.
+    void setWorkerBindings(unsigned worker, const BindingsDefine& bindings);
+
+    // Creates every worker's engine, which runs the bundle's top level code
+    // once per worker. Returns false if any of them failed, the pool can't be
+    // used after that.
+    bool start();
+
+    // Thread safe. Returns false without queueing the job if the pool isn't
+    // running, before start() succeeded or once it's stopping, since no
+    // worker would ever take it.
+    bool submit(const std::string& exportName, const CallArguments& args);
+    bool submitWithCallback(const std::string& exportName, const CallArguments& args, JobCallback callback);
+
+    // blocks until every submitted job has finished
+    void waitIdle();
+
+    unsigned getWorkerCount() const { return static_cast<unsigned>(workers.size()); }
+    // jobs where the export returned, and jobs where it threw or was missing
+    uint64_t getCompletedJobs() const { return completedJobs; }
+    uint64_t getFailedJobs() const { return failedJobs; }
+
+private:
+    struct Job {
+        std::string exportName;
+        CallArguments args;
+        JobCallback callback;
+    };
+
+    struct Worker {
+        std::thread thread;
+        const BindingsDefine* bindings = nullptr;
+        // guards jobs
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    void runWorker(unsigned index);
+    // own queue first, then steal
+    bool takeJob(unsigned index, Job& job);
+    void stop();
+
+    std::shared_ptr<hermes::hbc::BCProvider> bytecode;
+    std::string sourceURL;
+    const RuntimeOptions runtimeOptions;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<unsigned> nextWorker{0};
+
+    // guards everything below
+    std::mutex mutex;
+    // workers wait here for jobs, start() and waitIdle() wait on idle
+    std::condition_variable wakeup;
+    std::condition_variable idle;
+    // jobs sitting in a queue
+    size_t queuedJobs = 0;
+    // jobs queued or running
+    size_t pendingJobs = 0;
+    unsigned readyWorkers = 0;
+    bool startFailed = false;
+    // between a successful start() and stop(), jobs are only taken then
+    bool running = false;
+    bool stopping = false;
+
+    std::atomic<uint64_t> completedJobs{0};
+    std::atomic<uint64_t> failedJobs{0};
+};
@@ -0,0 +1,250 @@
+#include "string_bridge.hpp"
+
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SNAPIT_SSE2 1
+#include <emmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define SNAPIT_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace {
+constexpr char16_t kReplacementChar = 0xFFFD;
+
+inline bool isHighSurrogate(char32_t c) {
+  return c >= 0xD800 && c <= 0xDBFF;
+}
+
+inline bool isLowSurrogate(char32_t c) {
+  return c >= 0xDC00 && c <= 0xDFFF;
+}
+
+inline bool isContinuation(unsigned char c) {
+  return (c & 0xC0) == 0x80;
+}
+
+// copies the ASCII characters at the start of chars, returns how many
+size_t copyASCII(const char16_t* chars, size_t length, char* out) {
+  size_t i = 0;
+#if SNAPIT_SSE2
+  const __m128i nonASCII = _mm_set1_epi16(static_cast<short>(0xFF80));
+  for (; i + 8 <= length; i += 8) {
+    const __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(chars + i));
+    const __m128i high = _mm_and_si128(units, nonASCII);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xFFFF) {
+      break;
+    }
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(units, units));
+  }
+#elif SNAPIT_NEON
+  for (; i + 8 <= length; i += 8) {
+    const uint16x8_t units = vld1q_u16(reinterpret_cast<const uint16_t*>(chars + i));
+    if (vmaxvq_u16(units) >= 0x80) {
+      break;
+    }
+    vst1_u8(reinterpret_cast<uint8_t*>(out + i), vmovn_u16(units));
+  }
+#endif
+  for (; i < length && chars[i] < 0x80; ++i) {
+    out[i] = static_cast<char>(chars[i]);
+  }
+  return i;
+}
+
+// widens the ASCII characters at the start of chars, returns how many
+size_t widenASCII(const char* chars, size_t length, char16_t* out) {
+  size_t i = 0;
+#if SNAPIT_SSE2
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= length; i += 16) {
+    const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(chars + i));
+    if (_mm_movemask_epi8(bytes) != 0) {
+      break;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi8(bytes, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 8), _mm_unpackhi_epi8(bytes, zero));
+  }
+#elif SNAPIT_NEON
+  for (; i + 16 <= length; i += 16) {
+    const uint8x16_t bytes = vld1q_u8(reinterpret_cast<const uint8_t*>(chars + i));
+    if (vmaxvq_u8(bytes) >= 0x80) {
+      break;
+    }
+    vst1q_u16(reinterpret_cast<uint16_t*>(out + i), vmovl_u8(vget_low_u8(bytes)));
+    vst1q_u16(reinterpret_cast<uint16_t*>(out + i + 8), vmovl_high_u8(bytes));
+  }
+#endif
+  for (; i < length && static_cast<unsigned char>(chars[i]) < 0x80; ++i) {
+    out[i] = static_cast<char16_t>(chars[i]);
+  }
+  return i;
+}
+
+// Decodes one sequence that starts with a non-ASCII byte. Anything invalid,
+// including overlong forms and encoded surrogates, is one replacement
+// character for the first byte.
+char32_t decodeUTF8(const unsigned char* chars, size_t length, size_t& i) {
+  const unsigned char lead = chars[i];
+  size_t count;
+  char32_t min;
+  char32_t c;
+  if (lead >= 0xC2 && lead <= 0xDF) {
+    count = 1;
+    min = 0x80;
+    c = lead & 0x1F;
+  } else if (lead >= 0xE0 && lead <= 0xEF) {
+    count = 2;
+    min = 0x800;
+    c = lead & 0x0F;
+  } else if (lead >= 0xF0 && lead <= 0xF4) {
+    count = 3;
+    min = 0x10000;
+    c = lead & 0x07;
+  } else {
+    ++i;
+    return kReplacementChar;
+  }
+  if (length - i <= count) {
+    ++i;
+    return kReplacementChar;
+  }
+  for (size_t j = 1; j <= count; ++j) {
+    if (!isContinuation(chars[i + j])) {
+      ++i;
+      return kReplacementChar;
+    }
+    c = (c << 6) | (chars[i + j] & 0x3F);
+  }
+  if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) {
+    ++i;
+    return kReplacementChar;
+  }
+  i += count + 1;
+  return c;
+}
+} // namespace
+
+bool isASCII(const char* chars, size_t length) {
+  size_t i = 0;
+#if SNAPIT_SSE2
+  __m128i any = _mm_setzero_si128();
+  for (; i + 16 <= length; i += 16) {
+    any = _mm_or_si128(any, _mm_loadu_si128(reinterpret_cast<const __m128i*>(chars + i)));
+  }
+  if (_mm_movemask_epi8(any) != 0) {
+    return false;
+  }
+#elif SNAPIT_NEON
+  uint8x16_t any = vdupq_n_u8(0);
+  for (; i + 16 <= length; i += 16) {
+    any = vorrq_u8(any, vld1q_u8(reinterpret_cast<const uint8_t*>(chars + i)));
+  }
+  if (vmaxvq_u8(any) >= 0x80) {
+    return false;
+  }
+#endif
+  unsigned char rest = 0;
+  for (; i < length; ++i) {
+    rest |= static_cast<unsigned char>(chars[i]);
+  }
+  return rest < 0x80;
+}
+
+size_t utf16ToUTF8(const char16_t* chars, size_t length, char* out) {
+  size_t i = 0;
+  char* end = out;
+  while (i < length) {
+    const size_t ascii = copyASCII(chars + i, length - i, end);
+    i += ascii;
+    end += ascii;
+    if (i == length) {
+      break;
+    }
+
+    char32_t c = chars[i++];
+    if (c < 0x800) {
+      *end++ = static_cast<char>(0xC0 | (c >> 6));
+      *end++ = static_cast<char>(0x80 | (c & 0x3F));
+      continue;
+    }
+    if (isHighSurrogate(c) && i < length && isLowSurrogate(chars[i])) {
+      c = 0x10000 + ((c - 0xD800) << 10) + (chars[i++] - 0xDC00);
+      *end++ = static_cast<char>(0xF0 | (c >> 18));
+      *end++ = static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+      *end++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+      *end++ = static_cast<char>(0x80 | (c & 0x3F));
+      continue;
+    }
+    if (isHighSurrogate(c) || isLowSurrogate(c)) {
+      c = kReplacementChar;
+    }
+    *end++ = static_cast<char>(0xE0 | (c >> 12));
+    *end++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+    *end++ = static_cast<char>(0x80 | (c & 0x3F));
+  }
+  return end - out;
+}
+
+size_t utf8ToUTF16(const char* chars, size_t length, char16_t* out) {
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(chars);
+  size_t i = 0;
+  char16_t* end = out;
+  while (i < length) {
+    const size_t ascii = widenASCII(chars + i, length - i, end);
+    i += ascii;
+    end += ascii;
+    if (i == length) {
+      break;
+    }
+
+    const char32_t c = decodeUTF8(bytes, length, i);
+    if (c >= 0x10000) {
+      *end++ = static_cast<char16_t>(0xD800 + ((c - 0x10000) >> 10));
+      *end++ = static_cast<char16_t>(0xDC00 + ((c - 0x10000) & 0x3FF));
+    } else {
+      *end++ = static_cast<char16_t>(c);
+    }
+  }
+  return end - out;
+}
+
+std::u16string utf8ToUTF16String(const std::string& text) {
+  std::u16string converted(text.size(), u'\0');
+  converted.resize(utf8ToUTF16(text.data(), text.size(), &converted[0]));
+  return converted;
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> createStringFromUTF8(
+  hermes::vm::Runtime& runtime,
+  const char* chars,
+  size_t length
+) {
+  using namespace hermes;
+  if (isASCII(chars, length)) {
+    return vm::StringPrimitive::createEfficient(runtime, ASCIIRef(chars, length));
+  }
+  // reused so that transcoding doesn't allocate every time
+  thread_local std::vector<char16_t> buffer;
+  if (buffer.size() < length) {
+    buffer.resize(length);
+  }
+  const size_t units = utf8ToUTF16(chars, length, buffer.data());
+  return vm::StringPrimitive::createEfficient(runtime, UTF16Ref(buffer.data(), units));
+}
+
+extern "C" {
+size_t snapit_utf16_to_utf8(const char16_t* chars, size_t length, char* out) {
+  return utf16ToUTF8(chars, length, out);
+}
+
+bool snapit_string_from_utf8(hermes::vm::Runtime* runtime, const char* chars, size_t length, uint64_t* value) {
+  auto str = createStringFromUTF8(*runtime, chars, length);
+  if (LLVM_UNLIKELY(str == hermes::vm::ExecutionStatus::EXCEPTION)) {
+    return false;
+  }
+  *value = str->getRaw();
+  return true;
+}
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "wrapper.hpp"
+
+// Transcoding between JS strings and UTF-8. Runs of ASCII, which is most of
+// the JSON and text that goes through bindings, are handled 8 or 16
+// characters at a time with SSE2 or NEON, the rest one character at a time.
+// Invalid input, unpaired surrogates or bad UTF-8, becomes U+FFFD.
+
+bool isASCII(const char* chars, size_t length);
+
+// out needs room for 3 bytes per code unit, returns the bytes written
+size_t utf16ToUTF8(const char16_t* chars, size_t length, char* out);
+
+// out needs room for one code unit per byte, returns the units written
+size_t utf8ToUTF16(const char* chars, size_t length, char16_t* out);
+
+// For messages passed to TwineChar16, which reads a const char* as Latin-1.
+// Ends at the first 0.
+std::u16string utf8ToUTF16String(const std::string& text);
+
+// Creates a string from UTF-8. ASCII is copied straight into the heap,
+// anything else is transcoded to UTF-16 first.
+hermes::vm::CallResult<hermes::vm::HermesValue> createStringFromUTF8(
+    hermes::vm::Runtime& runtime,
+    const char* chars,
+    size_t length
+);
+
+extern "C" {
+// for the Rust side of the bridge
+size_t snapit_utf16_to_utf8(const char16_t* chars, size_t length, char* out);
+// returns false if an exception was raised, otherwise value is the string
+bool snapit_string_from_utf8(hermes::vm::Runtime* runtime, const char* chars, size_t length, uint64_t* value);
+}
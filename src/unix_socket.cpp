@@ -0,0 +1,39 @@
+#include "unix_socket.hpp"
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "llvh/Support/raw_ostream.h"
+
+int listenOnUnixSocket(const std::string& path, int backlog, const char* what) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    llvh::errs() << "Invalid " << what << " socket path " << path << "\n";
+    return -1;
+  }
+  path.copy(address.sun_path, path.size());
+
+  const int listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0) {
+    llvh::errs() << "Failed to create the " << what << " socket\n";
+    return -1;
+  }
+  // a socket left behind by an earlier run would make bind fail, anything
+  // else at the path isn't ours to delete
+  struct stat existing;
+  if (lstat(address.sun_path, &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+    unlink(address.sun_path);
+  }
+  if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+      listen(listener, backlog) != 0) {
+    llvh::errs() << "Failed to listen on " << path << "\n";
+    close(listener);
+    return -1;
+  }
+  return listener;
+}
+#endif
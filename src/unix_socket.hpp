@@ -0,0 +1,9 @@
+#pragma once
+#include <string>
+
+#ifndef _WIN32
+// Creates a Unix socket listening at path, replacing a socket left there by
+// an earlier run but nothing else. Returns the socket, close-on-exec, or -1
+// after printing why, with what naming it in the messages, like "metrics".
+int listenOnUnixSocket(const std::string& path, int backlog, const char* what);
+#endif
@@ -0,0 +1,183 @@
+#include "watchdog.hpp"
+
+#include <algorithm>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#include <pthread.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+struct ExecutionWatchdog::Watch {
+  Clock::time_point deadline;
+  std::chrono::microseconds cpuBudget{0};
+  std::chrono::microseconds cpuStart{0};
+  Callback callback;
+  // the watched thread, only kept with a CPU budget
+#ifdef _WIN32
+  HANDLE thread = nullptr;
+#elif defined(__APPLE__)
+  mach_port_t thread = MACH_PORT_NULL;
+#else
+  clockid_t cpuClock{};
+#endif
+
+  Watch() = default;
+  Watch(const Watch&) = delete;
+  Watch& operator=(const Watch&) = delete;
+  ~Watch() {
+#ifdef _WIN32
+    if (thread) {
+      CloseHandle(thread);
+    }
+#endif
+  }
+
+  // on the watched thread, returns false if its CPU time can't be read
+  bool watchCurrentThread() {
+#ifdef _WIN32
+    // GetCurrentThread is a pseudo handle that means the caller, the
+    // watchdog needs a real one
+    if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(),
+            &thread, THREAD_QUERY_LIMITED_INFORMATION, FALSE, 0)) {
+      thread = nullptr;
+      return false;
+    }
+#elif defined(__APPLE__)
+    thread = pthread_mach_thread_np(pthread_self());
+#else
+    if (pthread_getcpuclockid(pthread_self(), &cpuClock) != 0) {
+      return false;
+    }
+#endif
+    cpuStart = cpuTime();
+    return true;
+  }
+
+  // any thread
+  std::chrono::microseconds cpuTime() const {
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(thread, &creation, &exit, &kernel, &user)) {
+      return std::chrono::microseconds(0);
+    }
+    // 100 ns units
+    auto microseconds = [](const FILETIME& time) {
+      return ((static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 10;
+    };
+    return std::chrono::microseconds(microseconds(user) + microseconds(kernel));
+#elif defined(__APPLE__)
+    thread_basic_info_data_t info;
+    mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+    if (thread_info(thread, THREAD_BASIC_INFO, reinterpret_cast<thread_info_t>(&info), &count) !=
+        KERN_SUCCESS) {
+      return std::chrono::microseconds(0);
+    }
+    return std::chrono::seconds(info.user_time.seconds + info.system_time.seconds) +
+        std::chrono::microseconds(info.user_time.microseconds + info.system_time.microseconds);
+#else
+    timespec time;
+    if (clock_gettime(cpuClock, &time) != 0) {
+      return std::chrono::microseconds(0);
+    }
+    return std::chrono::seconds(time.tv_sec) +
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::nanoseconds(time.tv_nsec));
+#endif
+  }
+};
+
+ExecutionWatchdog& ExecutionWatchdog::getShared() {
+  static ExecutionWatchdog shared;
+  return shared;
+}
+
+ExecutionWatchdog::~ExecutionWatchdog() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wakeup.notify_one();
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
+
+uint64_t ExecutionWatchdog::watch(
+  Clock::time_point deadline,
+  std::chrono::microseconds cpuBudget,
+  Callback callback
+) {
+  if (deadline == Clock::time_point::max() && cpuBudget.count() == 0) {
+    return 0;
+  }
+  auto watch = std::make_unique<Watch>();
+  watch->deadline = deadline;
+  watch->callback = std::move(callback);
+  if (cpuBudget.count() != 0 && watch->watchCurrentThread()) {
+    watch->cpuBudget = cpuBudget;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!thread.joinable()) {
+    thread = std::thread([this]() { run(); });
+  }
+  const uint64_t id = nextId++;
+  watches.emplace(id, std::move(watch));
+  // the new watch may end before the one the thread is waiting for
+  wakeup.notify_one();
+  return id;
+}
+
+void ExecutionWatchdog::unwatch(uint64_t id) {
+  if (id == 0) {
+    return;
+  }
+  std::unique_ptr<Watch> watch;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = watches.find(id);
+    if (found == watches.end()) {
+      return;
+    }
+    watch = std::move(found->second);
+    watches.erase(found);
+  }
+  // the thread doesn't need a wakeup, it just finds nothing to do
+}
+
+void ExecutionWatchdog::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stopping) {
+    const Clock::time_point now = Clock::now();
+    Clock::time_point next = Clock::time_point::max();
+    for (auto it = watches.begin(); it != watches.end();) {
+      Watch& watch = *it->second;
+      Clock::time_point ends = watch.deadline;
+      if (watch.cpuBudget.count() != 0) {
+        const std::chrono::microseconds used = watch.cpuTime() - watch.cpuStart;
+        ends = std::min(ends, used >= watch.cpuBudget ? now : now + (watch.cpuBudget - used));
+      }
+      if (ends <= now) {
+        watch.callback();
+        it = watches.erase(it);
+        continue;
+      }
+      next = std::min(next, ends);
+      ++it;
+    }
+    if (next == Clock::time_point::max()) {
+      wakeup.wait(lock);
+    } else {
+      wakeup.wait_until(lock, next);
+    }
+  }
+}
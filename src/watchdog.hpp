@@ -0,0 +1,52 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// One thread for the whole process that ends calls which run past their
+// deadline or use up their CPU budget. A watch is added when a call starts
+// and removed when it returns, and the thread sleeps until the nearest
+// deadline, so idle runtimes cost nothing.
+// A thread can't use CPU time faster than wall time passes, so a CPU budget
+// is checked when what's left of it would be up in wall time, and again
+// after that for whatever the thread didn't get to use.
+class ExecutionWatchdog {
+public:
+    using Clock = std::chrono::steady_clock;
+    // Runs on the watchdog's thread with its lock held, so it should only
+    // ask the runtime to stop and must not watch or unwatch.
+    using Callback = std::function<void()>;
+
+    static ExecutionWatchdog& getShared();
+
+    ExecutionWatchdog(const ExecutionWatchdog&) = delete;
+    ExecutionWatchdog& operator=(const ExecutionWatchdog&) = delete;
+    ~ExecutionWatchdog();
+
+    // The CPU budget counts the calling thread's CPU time from now on.
+    // Clock::time_point::max() is no deadline and a budget of 0 is no budget.
+    // The callback runs at most once. Returns 0 if there's nothing to watch.
+    uint64_t watch(Clock::time_point deadline, std::chrono::microseconds cpuBudget, Callback callback);
+    // Once this returns the callback won't run. Does nothing for an id that
+    // already fired.
+    void unwatch(uint64_t id);
+
+private:
+    struct Watch;
+
+    ExecutionWatchdog() = default;
+    void run();
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::map<uint64_t, std::unique_ptr<Watch>> watches;
+    uint64_t nextId = 1;
+    bool stopping = false;
+    // started by the first watch, so a zygote can fork before that
+    std::thread thread;
+};
@@ -1,4 +1,36 @@
 #include "wrapper.hpp"
+#include "async_native.hpp"
+#include "bundle.hpp"
+#include "compile_service.hpp"
+#include "event_loop.hpp"
+#include "metrics.hpp"
+#include "module_loader.hpp"
+#include "object_shape.hpp"
+#include "string_bridge.hpp"
+
+#include <cstdio>
+#include <limits>
+
+#include "hermes/BCGen/HBC/BytecodeProviderFromSrc.h"
+#include "llvh/Support/FileSystem.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 BindingsDefine::BindingsDefine():
   defaultFunctionContext({*this, defaultFunction})
@@ -35,86 +67,478 @@ hermes::vm::CallResult<hermes::vm::HermesValue> callFunctionContext(void *contex
 {
   BindingsDefine::FunctionContext& functionContext = 
       *static_cast<BindingsDefine::FunctionContext*>(context);
-  /*return */functionContext.func.invoke(
+  NativeCallScope scope{functionContext.getStats(), runtime};
+  // drop any handles the function made, native calls run in loops
+  hermes::vm::GCScopeMarkerRAII marker{runtime};
+  NativeVFunctionReturnValue result = functionContext.func.invoke(
       functionContext.parent,
       runtime,
       args);
-  return hermes::vm::HermesValue::encodeUndefinedValue();
+  if (LLVM_UNLIKELY(result.status == hermes::vm::ExecutionStatus::EXCEPTION)) {
+    return hermes::vm::ExecutionStatus::EXCEPTION;
+  }
+  return result.value;
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> callFastFunctionContext(void *context, hermes::vm::Runtime &runtime, hermes::vm::NativeArgs args)
+{
+  const FastFunctionContext& functionContext =
+      *static_cast<const FastFunctionContext*>(context);
+  NativeCallScope scope{functionContext.getStats(), runtime};
+  hermes::vm::GCScopeMarkerRAII marker{runtime};
+  NativeCallResult result = functionContext.call(runtime, args);
+  if (LLVM_UNLIKELY(result.status == NativeCallStatus::Exception)) {
+    return hermes::vm::ExecutionStatus::EXCEPTION;
+  }
+  // nothing can allocate between here and the interpreter taking the value,
+  // so it doesn't matter that the marker has already released its handle
+  return hermes::vm::HermesValue::fromRaw(result.value);
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> callRuntimeFastFunction(void *context, hermes::vm::Runtime &runtime, hermes::vm::NativeArgs args)
+{
+  const RuntimeFunctionContext& runtimeContext =
+      *static_cast<const RuntimeFunctionContext*>(context);
+  ObjectShapes::CallScope shapes{runtimeContext.objectShapes};
+  return callFastFunctionContext(const_cast<void*>(runtimeContext.function), runtime, args);
+}
+
+hermes::vm::ExecutionStatus raiseArgumentTypeError(
+  hermes::vm::Runtime& runtime,
+  unsigned index,
+  const char* expected
+) {
+  const std::string message =
+      "argument " + std::to_string(index + 1) + " must be " + expected;
+  return runtime.raiseTypeError(hermes::vm::TwineChar16(message.c_str()));
+}
+
+extern "C" {
+uint32_t snapit_arg_count(const hermes::vm::NativeArgs* args) {
+  return args->getArgCount();
+}
+
+uint64_t snapit_arg(const hermes::vm::NativeArgs* args, uint32_t index) {
+  return args->getArg(index).getRaw();
+}
+
+uint64_t snapit_value_undefined() {
+  return hermes::vm::HermesValue::encodeUndefinedValue().getRaw();
+}
+
+bool snapit_value_is_null(uint64_t value) {
+  return hermes::vm::HermesValue::fromRaw(value).isNull();
+}
+
+bool snapit_value_is_number(uint64_t value) {
+  return hermes::vm::HermesValue::fromRaw(value).isNumber();
+}
+
+double snapit_value_get_number(uint64_t value) {
+  return hermes::vm::HermesValue::fromRaw(value).getNumber();
+}
+
+uint64_t snapit_value_encode_number(double number) {
+  return hermes::vm::HermesValue::encodeUntrustedNumberValue(number).getRaw();
+}
+
+bool snapit_value_is_bool(uint64_t value) {
+  return hermes::vm::HermesValue::fromRaw(value).isBool();
+}
+
+bool snapit_value_get_bool(uint64_t value) {
+  return hermes::vm::HermesValue::fromRaw(value).getBool();
+}
+
+uint64_t snapit_value_encode_bool(bool value) {
+  return hermes::vm::HermesValue::encodeBoolValue(value).getRaw();
+}
+
+bool snapit_value_is_string(uint64_t value) {
+  return hermes::vm::HermesValue::fromRaw(value).isString();
+}
+
+bool snapit_string_chars(hermes::vm::Runtime* runtime, uint64_t value, const void** chars, size_t* length) {
+  // the handle is released by the marker around the call
+  auto str = runtime->makeHandle(
+      hermes::vm::vmcast<hermes::vm::StringPrimitive>(hermes::vm::HermesValue::fromRaw(value)));
+  hermes::vm::StringView view = hermes::vm::StringPrimitive::createStringView(*runtime, str);
+  *length = view.length();
+  if (view.isASCII()) {
+    *chars = view.castToCharPtr();
+    return true;
+  }
+  *chars = view.castToChar16Ptr();
+  return false;
+}
+
+NativeCallResult snapit_throw_type_error(hermes::vm::Runtime* runtime, const char* message, size_t length) {
+  const std::string text(message, length);
+  runtime->raiseTypeError(hermes::vm::TwineChar16(utf8ToUTF16String(text).c_str()));
+  return NativeCallResult{NativeCallStatus::Exception, 0};
+}
+}
+
+namespace {
+constexpr uint64_t kMiB = 1024 * 1024;
+constexpr uint64_t kGiB = 1024 * kMiB;
+// GCConfig keeps heap sizes as gcheapsize_t, which is 32 bits, so anything
+// bigger would be truncated
+constexpr uint64_t kMaxHeapSizeLimit =
+    std::numeric_limits<hermes::vm::gcheapsize_t>::max();
+constexpr uint32_t kMinNumRegisters = 1024;
+// 128 MiB of register stack
+constexpr uint32_t kMaxNumRegisters = 16 * 1024 * 1024;
+
+hermes::vm::ReleaseUnused toReleaseUnused(GCReleaseUnused mode) {
+  switch (mode) {
+    case GCReleaseUnused::None:
+      return hermes::vm::kReleaseUnusedNone;
+    case GCReleaseUnused::Old:
+      return hermes::vm::kReleaseUnusedOld;
+    case GCReleaseUnused::YoungOnFull:
+      return hermes::vm::kReleaseUnusedYoungOnFull;
+    case GCReleaseUnused::YoungAlways:
+      return hermes::vm::kReleaseUnusedYoungAlways;
+  }
+  return hermes::vm::kReleaseUnusedOld;
+}
+
+// Hands write a stream for path, or fallback if path is empty.
+template<typename Write>
+void writeProfile(
+  const std::string& path,
+  llvh::raw_ostream& fallback,
+  const char* what,
+  Write write
+) {
+  if (path.empty()) {
+    write(fallback);
+    fallback.flush();
+    return;
+  }
+  std::error_code error;
+  llvh::raw_fd_ostream file{path, error, llvh::sys::fs::F_Text};
+  if (error) {
+    llvh::errs() << "Failed to open " << path << " for the " << what << ": "
+                 << error.message() << "\n";
+    return;
+  }
+  write(file);
+}
+
+// For VM dumps that print straight to the console instead of taking a
+// stream, stdout and stderr go to path while write runs.
+template<typename Write>
+void writeConsoleProfile(const std::string& path, const char* what, Write write) {
+  if (path.empty()) {
+    write();
+    return;
+  }
+#ifdef _WIN32
+  const int file = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_TEXT, _S_IREAD | _S_IWRITE);
+#else
+  const int file = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+  if (file < 0) {
+    llvh::errs() << "Failed to open " << path << " for the " << what << "\n";
+    return;
+  }
+  llvh::outs().flush();
+  std::fflush(stdout);
+  std::fflush(stderr);
+#ifdef _WIN32
+  const int savedOut = _dup(1);
+  const int savedErr = _dup(2);
+  _dup2(file, 1);
+  _dup2(file, 2);
+#else
+  const int savedOut = dup(1);
+  const int savedErr = dup(2);
+  dup2(file, 1);
+  dup2(file, 2);
+#endif
+  write();
+  llvh::outs().flush();
+  std::fflush(stdout);
+  std::fflush(stderr);
+#ifdef _WIN32
+  _dup2(savedOut, 1);
+  _dup2(savedErr, 2);
+  _close(savedOut);
+  _close(savedErr);
+  _close(file);
+#else
+  dup2(savedOut, 1);
+  dup2(savedErr, 2);
+  close(savedOut);
+  close(savedErr);
+  close(file);
+#endif
+}
+
+// config with onCollection called after every collection, next to GCMetrics
+hermes::vm::RuntimeConfig withCollectionCallback(
+  const hermes::vm::RuntimeConfig& config,
+  std::function<void(const hermes::vm::GCAnalyticsEvent&)> onCollection
+) {
+  return config.rebuild()
+      .withGCConfig(config.getGCConfig().rebuild()
+          .withAnalyticsCallback(
+              [onCollection = std::move(onCollection)](const hermes::vm::GCAnalyticsEvent& event) {
+                GCMetrics::getShared().record(event);
+                onCollection(event);
+              })
+          .build())
+      .build();
+}
+
+// the heap stats of one runtime with the perf events since
+// PerfEvents::begin() added in
+void printStats(hermes::vm::Runtime& runtime, llvh::raw_ostream& os) {
+  std::string stats;
+  {
+    llvh::raw_string_ostream tmp{stats};
+    runtime.printHeapStats(tmp);
+  }
+  hermes::vm::instrumentation::PerfEvents::endAndInsertStats(stats);
+  os << stats;
+}
+} // namespace
+
+RuntimeOptions::RuntimeOptions():
+  heapBudget(0),
+  heapBudgetThreshold(0.8),
+  memoryPressureAction(MemoryPressureAction::Collect),
+  microtaskQueue(true),
+  basicBlockProfiling(false),
+  stopAfterInit(false),
+  timeLimit(0),
+  callTimeLimit(0),
+  callCpuTimeLimit(0),
+  forceGCBeforeStats(false),
+  stabilizeInstructionCount(false),
+  sampleProfiling(false),
+  heapTimeline(false),
+  heapSnapshotEveryCalls(0),
+  heapSnapshotOnExit(true),
+  heapSnapshotOnSignal(false),
+  opcodeStats(false),
+  functionStats(false)
+{
+  applyPreset("throughput");
+}
+
+bool RuntimeOptions::applyPreset(const std::string& name) {
+  if (name == "throughput") {
+    // start big and keep freed memory around so that hot paths don't wait on
+    // the heap growing or on pages being returned to the OS
+    initHeapSize = 32 * kMiB;
+    maxHeapSize = 1 * kGiB;
+    occupancyTarget = 0.75;
+    sanitizeRate = 0.0;
+    releaseUnused = GCReleaseUnused::None;
+    allocInYoung = true;
+    recordGCStats = false;
+    maxNumRegisters = 1024 * 1024;
+    enableHermesInternalTestMethods = false;
+  } else if (name == "low-memory") {
+    initHeapSize = 1 * kMiB;
+    maxHeapSize = 256 * kMiB;
+    occupancyTarget = 0.5;
+    sanitizeRate = 0.0;
+    releaseUnused = GCReleaseUnused::YoungAlways;
+    allocInYoung = true;
+    recordGCStats = false;
+    maxNumRegisters = 128 * 1024;
+    enableHermesInternalTestMethods = false;
+  } else if (name == "debug") {
+    // extra collections shake out missing handles in bindings
+    initHeapSize = 1 * kMiB;
+    maxHeapSize = 1 * kGiB;
+    occupancyTarget = 0.5;
+    sanitizeRate = 0.1;
+    releaseUnused = GCReleaseUnused::Old;
+    allocInYoung = true;
+    recordGCStats = true;
+    maxNumRegisters = 1024 * 1024;
+    enableHermesInternalTestMethods = true;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+std::string RuntimeOptions::validate() const {
+  std::string error;
+  llvh::raw_string_ostream os{error};
+  if (initHeapSize == 0) {
+    os << "initial heap size must not be 0";
+  } else if (initHeapSize > kMaxHeapSizeLimit) {
+    os << "initial heap size " << initHeapSize << " is over the limit of "
+       << kMaxHeapSizeLimit;
+  } else if (maxHeapSize < initHeapSize) {
+    os << "max heap size " << maxHeapSize
+       << " is smaller than the initial heap size " << initHeapSize;
+  } else if (maxHeapSize > kMaxHeapSizeLimit) {
+    os << "max heap size " << maxHeapSize << " is over the limit of "
+       << kMaxHeapSizeLimit;
+  } else if (maxNumRegisters < kMinNumRegisters || maxNumRegisters > kMaxNumRegisters) {
+    os << "register count " << maxNumRegisters << " must be between "
+       << kMinNumRegisters << " and " << kMaxNumRegisters;
+  } else if (!(occupancyTarget > 0.0 && occupancyTarget < 1.0)) {
+    os << "occupancy target " << occupancyTarget << " must be between 0 and 1";
+  } else if (!(sanitizeRate >= 0.0 && sanitizeRate <= 1.0)) {
+    os << "sanitize rate " << sanitizeRate << " must be between 0 and 1";
+  } else if (
+      releaseUnused != GCReleaseUnused::None &&
+      releaseUnused != GCReleaseUnused::Old &&
+      releaseUnused != GCReleaseUnused::YoungOnFull &&
+      releaseUnused != GCReleaseUnused::YoungAlways) {
+    os << "unknown release unused mode " << static_cast<int>(releaseUnused);
+  } else if (heapBudget != 0 && heapBudget >= maxHeapSize) {
+    os << "heap budget " << heapBudget << " must be below the max heap size "
+       << maxHeapSize;
+  } else if (!(heapBudgetThreshold > 0.0 && heapBudgetThreshold <= 1.0)) {
+    os << "heap budget threshold " << heapBudgetThreshold
+       << " must be between 0 and 1";
+  }
+  if (heapSnapshotPrefix.empty() && (heapSnapshotEveryCalls != 0 || heapSnapshotOnSignal) &&
+      os.str().empty()) {
+    os << "heap snapshots need a file prefix";
+  }
+  if (heapSnapshotOnSignal && !heapSnapshotSignalSupported() && os.str().empty()) {
+    os << "heap snapshots on a signal aren't supported on this platform";
+  }
+  // profilers that aren't in this build, see SNAPIT_HERMES_PROFILERS in build.rs
+#if !HERMESVM_SAMPLING_PROFILER_AVAILABLE
+  if (sampleProfiling && os.str().empty()) {
+    os << "the sampling profiler isn't available on this platform";
+  }
+#endif
+#ifndef HERMESVM_PROFILER_OPCODE
+  if (opcodeStats && os.str().empty()) {
+    os << "opcode stats need a build with the opcode profiler";
+  }
+#endif
+#ifndef HERMESVM_PROFILER_JSFUNCTION
+  if (functionStats && os.str().empty()) {
+    os << "function stats need a build with the jsfunction profiler";
+  }
+#endif
+#ifndef HERMESVM_PROFILER_BB
+  if (basicBlockProfiling && os.str().empty()) {
+    os << "basic block profiling needs a build with the bb profiler";
+  }
+#endif
+  return os.str();
 }
 
-hermes::vm::RuntimeConfig makeRuntimeConfig()
+hermes::vm::RuntimeConfig RuntimeOptions::makeRuntimeConfig() const
 {
-  // to do, make options for these
+  auto gcConfig = hermes::vm::GCConfig::Builder()
+      .withInitHeapSize(initHeapSize)
+      .withMaxHeapSize(maxHeapSize)
+      .withOccupancyTarget(occupancyTarget)
+      .withAllocInYoung(allocInYoung)
+      .withShouldRecordStats(recordGCStats)
+      .withShouldReleaseUnused(toReleaseUnused(releaseUnused))
+      .withName("hvm-rust")
+      // once per collection, cheap enough to always have on
+      .withAnalyticsCallback([](const hermes::vm::GCAnalyticsEvent& event) {
+        GCMetrics::getShared().record(event);
+      });
+  if (sanitizeRate > 0.0) {
+    gcConfig.withSanitizeConfig(
+        hermes::vm::GCSanitizeConfig::Builder()
+            .withSanitizeRate(sanitizeRate)
+            .withRandomSeed(-1)
+            .build());
+  }
   return hermes::vm::RuntimeConfig::Builder()
-      .withGCConfig(hermes::vm::GCConfig::Builder()
-                        .withInitHeapSize(1024 * 1024)
-                        .withMaxHeapSize(1024 * 1024 * 1024)
-                        .withSanitizeConfig(
-                            hermes::vm::GCSanitizeConfig::Builder()
-                                .withSanitizeRate(0.1)
-                                .withRandomSeed(-1)
-                                .build())
-                        .withShouldRecordStats(false)
-                        .withShouldReleaseUnused(hermes::vm::kReleaseUnusedOld)
-                        .withName("hvm-rust")
-                        .build())
+      .withGCConfig(gcConfig.build())
       .withEnableBlockScoping(true)
       .withES6Promise(true)
       .withES6Proxy(true)
       .withIntl(true)
-      .withMicrotaskQueue(false)
+      .withMicrotaskQueue(microtaskQueue)
       .withTrackIO(true)
       .withEnableHermesInternal(true)
-      .withEnableHermesInternalTestMethods(true)
-      .withMaxNumRegisters(1024 * 1024)
+      .withEnableHermesInternalTestMethods(enableHermesInternalTestMethods)
+      .withMaxNumRegisters(maxNumRegisters)
+      .withStabilizeInstructionCount(stabilizeInstructionCount)
       .build();
 }
 
 struct ExecuteOptions {
-  ExecuteOptions(): runtimeConfig(makeRuntimeConfig()) {}
+  ExecuteOptions(const RuntimeOptions& runtimeOptions):
+    runtimeConfig(runtimeOptions.makeRuntimeConfig()),
+    basicBlockProfiling(runtimeOptions.basicBlockProfiling),
+    stopAfterInit(runtimeOptions.stopAfterInit),
+    timeLimit(runtimeOptions.timeLimit),
+    forceGCBeforeStats(runtimeOptions.forceGCBeforeStats),
+    stabilizeInstructionCount(runtimeOptions.stabilizeInstructionCount),
+    sampleProfiling(runtimeOptions.sampleProfiling),
+    heapTimeline(runtimeOptions.heapTimeline),
+    opcodeStats(runtimeOptions.opcodeStats),
+    functionStats(runtimeOptions.functionStats),
+    sampleProfileFile(runtimeOptions.sampleProfileFile),
+    opcodeStatsFile(runtimeOptions.opcodeStatsFile),
+    functionStatsFile(runtimeOptions.functionStatsFile),
+    basicBlockProfileFile(runtimeOptions.basicBlockProfileFile)
+  {}
 
   hermes::vm::RuntimeConfig runtimeConfig;
 
-    // execution options
-  // to do, make options for these
-  /// Enable basic block profiling.
-  bool basicBlockProfiling{false};
-
-  /// Stop after creating the RuntimeModule.
-  bool stopAfterInit{false};
-
-  /// Execution time limit.
-  uint32_t timeLimit{0};
-
-  /// Perform a full GC just before printing any statistics.
-  bool forceGCBeforeStats{false};
-
-  /// Try to execute the same number of CPU instructions
-  /// across repeated invocations of the same JS.
-  bool stabilizeInstructionCount{false};
-
-  /// Run the sampling profiler.
-  bool sampleProfiling{false};
-
-  /// Start tracking heap objects before executing bytecode.
-  bool heapTimeline{false};
+  // execution options, see RuntimeOptions
+  bool basicBlockProfiling;
+  bool stopAfterInit;
+  uint32_t timeLimit;
+  bool forceGCBeforeStats;
+  bool stabilizeInstructionCount;
+  bool sampleProfiling;
+  bool heapTimeline;
+  bool opcodeStats;
+  bool functionStats;
+  std::string sampleProfileFile;
+  std::string opcodeStatsFile;
+  std::string functionStatsFile;
+  std::string basicBlockProfileFile;
 };
 
 bool executeHBCBytecode(
   std::unique_ptr<hermes::Buffer> bytes,
   const std::string sourceName,
-  const BindingsDefine& bindings
+  const BindingsDefine& bindings,
+  const RuntimeOptions& runtimeOptions
 ) {
   using namespace hermes;
-  std::shared_ptr<hbc::BCProvider> bytecode = std::move(
-    hbc::BCProviderFromBuffer::createBCProviderFromBuffer(
-      std::move(bytes)
-    ).first);
+  const std::string optionsError = runtimeOptions.validate();
+  if (!optionsError.empty()) {
+    llvh::errs() << "Invalid runtime options: " << optionsError << "\n";
+    return false;
+  }
+
+  // a bundle runs its entry module, the others load on their first require
+  std::shared_ptr<Bundle> bundle;
+  std::shared_ptr<hbc::BCProvider> bytecode;
+  if (Bundle::isBundle(*bytes)) {
+    bundle = Bundle::open(std::move(bytes), sourceName);
+    if (!bundle) {
+      return false;
+    }
+    bytecode = bundle->loadModule(0);
+  } else {
+    bytecode = std::move(
+      hbc::BCProviderFromBuffer::createBCProviderFromBuffer(
+        std::move(bytes)
+      ).first);
+  }
   if (!bytecode) {
     return false;
   }
     
-  const ExecuteOptions options = ExecuteOptions{};
+  const ExecuteOptions options = ExecuteOptions{runtimeOptions};
   const std::string *filename = &sourceName;
 
   bool shouldRecordGCStats =
@@ -124,7 +548,41 @@ bool executeHBCBytecode(
   }
 
   std::unique_ptr<vm::StatSamplingThread> statSampler;
-  auto runtime = vm::Runtime::create(options.runtimeConfig);
+  // declared before the runtime so that it outlives the runtime, the runtime
+  // marks its roots
+  std::unique_ptr<MemoryBudget> memoryBudget;
+  vm::Runtime* budgetedRuntime = nullptr;
+  std::unique_ptr<EventLoop> eventLoop;
+  std::unique_ptr<ModuleLoader> moduleLoader;
+  std::unique_ptr<BundleLoader> bundleLoader;
+  vm::RuntimeConfig runtimeConfig = options.runtimeConfig;
+  if (runtimeOptions.heapBudget != 0) {
+    // there's only one call here, so an abort ends the script
+    memoryBudget = std::make_unique<MemoryBudget>(
+        runtimeOptions.heapBudget,
+        runtimeOptions.heapBudgetThreshold,
+        runtimeOptions.memoryPressureAction);
+    runtimeConfig = withCollectionCallback(
+        runtimeConfig,
+        [&memoryBudget, &budgetedRuntime](const vm::GCAnalyticsEvent& event) {
+          if (memoryBudget->onCollection(event) == MemoryPressureAction::Abort &&
+              budgetedRuntime) {
+            budgetedRuntime->triggerTimeoutAsyncBreak();
+          }
+        });
+  }
+  auto runtime = vm::Runtime::create(runtimeConfig);
+  budgetedRuntime = runtime.get();
+  eventLoop = std::make_unique<EventLoop>(*runtime);
+  moduleLoader = std::make_unique<ModuleLoader>(
+      *runtime, *eventLoop, CompileService::getShared(), runtimeOptions.bytecodeCacheDirectory);
+  // declared after the runtime so they're destroyed while it's still there,
+  // see ~Engine
+  auto asyncCalls = std::make_unique<AsyncNativeCalls>(*runtime, *eventLoop);
+  auto objectShapes = std::make_unique<ObjectShapes>(*runtime);
+  if (bundle) {
+    bundleLoader = std::make_unique<BundleLoader>(*runtime, bundle);
+  }
 
   if (options.timeLimit > 0) {
     runtime->timeLimitMonitor = vm::TimeLimitMonitor::getOrCreate();
@@ -137,7 +595,17 @@ bool executeHBCBytecode(
         std::chrono::milliseconds(100));
   }
 
-  if (options.heapTimeline) {
+  std::unique_ptr<HeapSnapshotter> heapSnapshotter;
+  if (!runtimeOptions.heapSnapshotPrefix.empty()) {
+    // it starts the allocation timeline itself
+    heapSnapshotter = std::make_unique<HeapSnapshotter>(
+        *runtime,
+        runtimeOptions.heapSnapshotPrefix,
+        runtimeOptions.heapSnapshotEveryCalls,
+        runtimeOptions.heapSnapshotOnSignal,
+        options.heapTimeline);
+    eventLoop->setTaskHook([&heapSnapshotter]() { heapSnapshotter->poll(); });
+  } else if (options.heapTimeline) {
 #ifdef HERMES_MEMORY_INSTRUMENTATION
     runtime->enableAllocationLocationTracker();
 #else
@@ -148,6 +616,18 @@ bool executeHBCBytecode(
 
   vm::GCScope scope(*runtime);
 
+  if (!eventLoop->install()) {
+    llvh::errs() << "Failed to install the event loop\n";
+    return false;
+  }
+  if (!moduleLoader->install()) {
+    llvh::errs() << "Failed to install the module loader\n";
+    return false;
+  }
+  if (bundleLoader && !bundleLoader->install()) {
+    llvh::errs() << "Failed to install require\n";
+    return false;
+  }
   bindings.install(*runtime, bindings);
 
   vm::RuntimeModuleFlags flags;
@@ -185,13 +665,6 @@ bool executeHBCBytecode(
       sourceURL,
       vm::Runtime::makeNullHandle<vm::Environment>());
 
-#if HERMESVM_SAMPLING_PROFILER_AVAILABLE
-  if (options.sampleProfiling) {
-    vm::SamplingProfiler::disable();
-    vm::SamplingProfiler::dumpChromeTraceGlobal(llvh::errs());
-  }
-#endif // HERMESVM_SAMPLING_PROFILER_AVAILABLE
-
   bool threwException = status == vm::ExecutionStatus::EXCEPTION;
 
   if (threwException) {
@@ -199,41 +672,35 @@ bool executeHBCBytecode(
     llvh::outs().flush();
     runtime->printException(
         llvh::errs(), runtime->makeHandle(runtime->getThrownValue()));
+  } else {
+    if (memoryBudget) {
+      relieveMemoryPressure(*runtime, memoryBudget->takePending());
+    }
+    // Run timers and tasks until there are no more, with a microtask
+    // checkpoint after the script and after every task.
+    threwException = !eventLoop->run();
   }
 
-  // to do implement microtask
-  /*
-  // Perform a microtask checkpoint after running script.
-  microtask::performCheckpoint(*runtime);
-
-  if (!ctx.tasksEmpty()) {
-    vm::GCScopeMarkerRAII marker{scope};
-    // Run the tasks until there are no more.
-    vm::MutableHandle<vm::Callable> task{*runtime};
-    while (auto optTask = ctx.dequeueTask()) {
-      task = std::move(*optTask);
-      auto callRes = vm::Callable::executeCall0(
-          task, *runtime, vm::Runtime::getUndefinedValue(), false);
-      if (LLVM_UNLIKELY(callRes == vm::ExecutionStatus::EXCEPTION)) {
-        threwException = true;
-        llvh::outs().flush();
-        runtime->printException(
-            llvh::errs(), runtime->makeHandle(runtime->getThrownValue()));
-        break;
-      }
-
-      // Perform a microtask checkpoint at the end of every task tick.
-      microtask::performCheckpoint(*runtime);
-    }
+#if HERMESVM_SAMPLING_PROFILER_AVAILABLE
+  if (options.sampleProfiling) {
+    vm::SamplingProfiler::disable();
+    writeProfile(options.sampleProfileFile, llvh::errs(), "sampling profile",
+        [](llvh::raw_ostream& os) { vm::SamplingProfiler::dumpChromeTraceGlobal(os); });
   }
-  */
+#endif // HERMESVM_SAMPLING_PROFILER_AVAILABLE
 
 #ifdef HERMESVM_PROFILER_OPCODE
-  runtime->dumpOpcodeStats(llvh::outs());
+  if (options.opcodeStats) {
+    writeProfile(options.opcodeStatsFile, llvh::outs(), "opcode stats",
+        [&runtime](llvh::raw_ostream& os) { runtime->dumpOpcodeStats(os); });
+  }
 #endif
 
 #ifdef HERMESVM_PROFILER_JSFUNCTION
-  runtime->dumpJSFunctionStats();
+  if (options.functionStats) {
+    writeConsoleProfile(options.functionStatsFile, "function stats",
+        [&runtime]() { runtime->dumpJSFunctionStats(); });
+  }
 #endif
 
 #ifdef HERMESVM_PROFILER_NATIVECALL
@@ -247,15 +714,721 @@ bool executeHBCBytecode(
     if (options.forceGCBeforeStats) {
       runtime->collect("forced for stats");
     }
-    // to do implement printStats
-    //printStats(*runtime, llvh::errs());
+    printStats(*runtime, llvh::errs());
+  }
+
+  if (heapSnapshotter && runtimeOptions.heapSnapshotOnExit) {
+    heapSnapshotter->write();
   }
 
 #ifdef HERMESVM_PROFILER_BB
   if (options.basicBlockProfiling) {
-    runtime->getBasicBlockExecutionInfo().dump(llvh::errs());
+    writeProfile(options.basicBlockProfileFile, llvh::errs(), "basic block profile",
+        [&runtime](llvh::raw_ostream& os) { runtime->getBasicBlockExecutionInfo().dump(os); });
   }
 #endif
 
   return !threwException;
-}
\ No newline at end of file
+}
+
+std::string stringPrimitiveToUTF8(
+  hermes::vm::Runtime& runtime,
+  hermes::vm::Handle<hermes::vm::StringPrimitive> str
+) {
+  hermes::vm::StringView view =
+      hermes::vm::StringPrimitive::createStringView(runtime, str);
+  if (view.isASCII()) {
+    return std::string(view.castToCharPtr(), view.length());
+  }
+  std::string out(view.length() * 3, '\0');
+  out.resize(utf16ToUTF8(view.castToChar16Ptr(), view.length(), &out[0]));
+  return out;
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> makeArgumentValue(
+  hermes::vm::Runtime& runtime,
+  const CallArguments::Argument& argument
+) {
+  using namespace hermes;
+  switch (argument.kind) {
+    case CallArguments::Kind::Null:
+      return vm::HermesValue::encodeNullValue();
+    case CallArguments::Kind::Bool:
+      return vm::HermesValue::encodeBoolValue(argument.number != 0);
+    case CallArguments::Kind::Number:
+      return vm::HermesValue::encodeUntrustedNumberValue(argument.number);
+    case CallArguments::Kind::String:
+      return createStringFromUTF8(
+          runtime, argument.string.data(), argument.string.size());
+    case CallArguments::Kind::Undefined:
+      break;
+  }
+  return vm::HermesValue::encodeUndefinedValue();
+}
+
+hermes::vm::CallResult<hermes::vm::Handle<hermes::vm::Callable>> getGlobalFunction(
+  hermes::vm::Runtime& runtime,
+  const std::string& name
+) {
+  using namespace hermes;
+  auto symbol = runtime.getIdentifierTable().getSymbolHandle(
+      runtime, vm::createASCIIRef(name.c_str()));
+  if (LLVM_UNLIKELY(symbol == vm::ExecutionStatus::EXCEPTION)) {
+    return vm::ExecutionStatus::EXCEPTION;
+  }
+  auto value = vm::JSObject::getNamed_RJS(runtime.getGlobal(), runtime, **symbol);
+  if (LLVM_UNLIKELY(value == vm::ExecutionStatus::EXCEPTION)) {
+    return vm::ExecutionStatus::EXCEPTION;
+  }
+  return vm::Handle<vm::Callable>::dyn_vmcast(
+      runtime.makeHandle(std::move(*value)));
+}
+
+bool defineGlobalFunction(
+  hermes::vm::Runtime& runtime,
+  const char* name,
+  hermes::vm::NativeFunctionPtr function,
+  void* context,
+  unsigned paramCount
+) {
+  using namespace hermes;
+  vm::GCScope scope(runtime);
+  auto symbol = runtime.getIdentifierTable().getSymbolHandle(
+      runtime, vm::createASCIIRef(name));
+  if (LLVM_UNLIKELY(symbol == vm::ExecutionStatus::EXCEPTION)) {
+    return false;
+  }
+  auto nativeFunction = vm::NativeFunction::create(
+      runtime,
+      vm::Handle<vm::JSObject>::vmcast(&runtime.functionPrototype),
+      context,
+      function,
+      **symbol,
+      paramCount,
+      vm::Runtime::makeNullHandle<vm::JSObject>());
+  auto res = vm::JSObject::defineOwnProperty(
+      runtime.getGlobal(),
+      runtime,
+      **symbol,
+      vm::DefinePropertyFlags::getNewNonEnumerableFlags(),
+      nativeFunction);
+  return res != vm::ExecutionStatus::EXCEPTION && *res;
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> callFunction(
+  hermes::vm::Runtime& runtime,
+  hermes::vm::Handle<hermes::vm::Callable> function,
+  llvh::ArrayRef<hermes::vm::Handle<>> arguments
+) {
+  using namespace hermes;
+  vm::ScopedNativeCallFrame frame{
+      runtime,
+      static_cast<uint32_t>(arguments.size()),
+      function.getHermesValue(),
+      vm::HermesValue::encodeUndefinedValue(),
+      vm::HermesValue::encodeUndefinedValue()};
+  if (LLVM_UNLIKELY(frame.overflowHasOccurred())) {
+    return runtime.raiseStackOverflow(vm::Runtime::StackOverflowKind::NativeStack);
+  }
+  for (uint32_t i = 0; i < arguments.size(); ++i) {
+    frame->getArgRef(i) = arguments[i].getHermesValue();
+  }
+  auto callResult = vm::Callable::call(function, runtime);
+  if (LLVM_UNLIKELY(callResult == vm::ExecutionStatus::EXCEPTION)) {
+    return vm::ExecutionStatus::EXCEPTION;
+  }
+  return callResult->get();
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> callFunction(
+  hermes::vm::Runtime& runtime,
+  hermes::vm::Handle<hermes::vm::Callable> function,
+  const CallArguments& args
+) {
+  using namespace hermes;
+  // create every argument before pushing the frame, the handles keep them
+  // alive if creating a later one triggers a collection
+  llvh::SmallVector<vm::Handle<>, 8> argHandles;
+  for (const CallArguments::Argument& argument : args.getList()) {
+    auto value = makeArgumentValue(runtime, argument);
+    if (LLVM_UNLIKELY(value == vm::ExecutionStatus::EXCEPTION)) {
+      return vm::ExecutionStatus::EXCEPTION;
+    }
+    argHandles.push_back(runtime.makeHandle(*value));
+  }
+  return callFunction(runtime, function, argHandles);
+}
+
+Engine::Engine(const RuntimeOptions& runtimeOptions):
+  memoryBudget(runtimeOptions.heapBudget == 0 ? nullptr : std::make_unique<MemoryBudget>(
+      runtimeOptions.heapBudget,
+      runtimeOptions.heapBudgetThreshold,
+      runtimeOptions.memoryPressureAction)),
+  callTimeLimit(runtimeOptions.callTimeLimit),
+  callCpuTimeLimit(runtimeOptions.callCpuTimeLimit),
+  runtime(hermes::vm::Runtime::create(makeRuntimeConfig(runtimeOptions))),
+  eventLoop(std::make_unique<EventLoop>(*runtime)),
+  result(hermes::vm::HermesValue::encodeUndefinedValue()),
+  drainFunction(hermes::vm::HermesValue::encodeUndefinedValue())
+{
+  runtime->addCustomRootsFunction(
+      [this](hermes::vm::GC*, hermes::vm::RootAcceptor& acceptor) {
+        acceptor.accept(result);
+        acceptor.accept(drainFunction);
+        for (auto& exported : exports) {
+          acceptor.accept(exported.second);
+        }
+      });
+}
+
+hermes::vm::RuntimeConfig Engine::makeRuntimeConfig(const RuntimeOptions& runtimeOptions) {
+  hermes::vm::RuntimeConfig config = runtimeOptions.makeRuntimeConfig();
+  if (!memoryBudget) {
+    return config;
+  }
+  return withCollectionCallback(config, [this](const hermes::vm::GCAnalyticsEvent& event) {
+    if (memoryBudget->onCollection(event) == MemoryPressureAction::Abort) {
+      interrupt(EngineStatus::OutOfMemory);
+    }
+  });
+}
+
+void Engine::setMemoryPressureCallback(MemoryBudget::Callback callback) {
+  if (memoryBudget) {
+    memoryBudget->setCallback(std::move(callback));
+  }
+}
+
+Engine::~Engine() {
+  if (heapSnapshotter && heapSnapshotOnExit) {
+    heapSnapshotter->write();
+  }
+  heapSnapshotter.reset();
+  // These are found by the runtime's address, so they go while the runtime
+  // still holds it. Their roots functions check whether they're still there.
+  asyncCalls.reset();
+  objectShapes.reset();
+  // the runtime's other roots functions point into this engine and its
+  // event loop, so it has to be destroyed before any of the other members
+  runtime.reset();
+}
+
+std::unique_ptr<Engine> Engine::create(
+  std::unique_ptr<hermes::Buffer> bytes,
+  const std::string& sourceURL,
+  const BindingsDefine& bindings,
+  const RuntimeOptions& runtimeOptions
+) {
+  if (bytes && Bundle::isBundle(*bytes)) {
+    std::shared_ptr<Bundle> bundle = Bundle::open(std::move(bytes), sourceURL);
+    if (!bundle) {
+      return nullptr;
+    }
+    auto bytecode = bundle->loadModule(0);
+    if (!bytecode) {
+      return nullptr;
+    }
+    return createEngine(
+        std::move(bytecode), std::move(bundle), sourceURL, bindings, runtimeOptions);
+  }
+  auto bytecode = loadBytecodeProvider(std::move(bytes), sourceURL);
+  if (!bytecode) {
+    return nullptr;
+  }
+  return createWithProvider(
+      std::move(bytecode), sourceURL, bindings, runtimeOptions);
+}
+
+std::unique_ptr<Engine> Engine::createWithProvider(
+  std::shared_ptr<hermes::hbc::BCProvider> bytecode,
+  const std::string& sourceURL,
+  const BindingsDefine& bindings,
+  const RuntimeOptions& runtimeOptions
+) {
+  return createEngine(std::move(bytecode), nullptr, sourceURL, bindings, runtimeOptions);
+}
+
+std::unique_ptr<Engine> Engine::createEngine(
+  std::shared_ptr<hermes::hbc::BCProvider> bytecode,
+  std::shared_ptr<Bundle> bundle,
+  const std::string& sourceURL,
+  const BindingsDefine& bindings,
+  const RuntimeOptions& runtimeOptions
+) {
+  const std::string optionsError = runtimeOptions.validate();
+  if (!optionsError.empty()) {
+    llvh::errs() << "Invalid runtime options: " << optionsError << "\n";
+    return nullptr;
+  }
+
+  std::unique_ptr<Engine> engine{new Engine(runtimeOptions)};
+  engine->moduleLoader = std::make_unique<ModuleLoader>(
+      *engine->runtime,
+      *engine->eventLoop,
+      CompileService::getShared(),
+      runtimeOptions.bytecodeCacheDirectory);
+  engine->asyncCalls = std::make_unique<AsyncNativeCalls>(*engine->runtime, *engine->eventLoop);
+  engine->objectShapes = std::make_unique<ObjectShapes>(*engine->runtime);
+  if (bundle) {
+    engine->bundleLoader = std::make_unique<BundleLoader>(*engine->runtime, std::move(bundle));
+  }
+  if (!runtimeOptions.heapSnapshotPrefix.empty()) {
+    engine->heapSnapshotter = std::make_unique<HeapSnapshotter>(
+        *engine->runtime,
+        runtimeOptions.heapSnapshotPrefix,
+        runtimeOptions.heapSnapshotEveryCalls,
+        runtimeOptions.heapSnapshotOnSignal,
+        runtimeOptions.heapTimeline);
+    engine->heapSnapshotOnExit = runtimeOptions.heapSnapshotOnExit;
+    HeapSnapshotter* snapshotter = engine->heapSnapshotter.get();
+    engine->eventLoop->setTaskHook([snapshotter]() { snapshotter->poll(); });
+  }
+  if (!engine->init(std::move(bytecode), sourceURL, bindings)) {
+    return nullptr;
+  }
+  return engine;
+}
+
+std::shared_ptr<hermes::hbc::BCProvider> loadBytecodeProvider(
+  std::unique_ptr<hermes::Buffer> bytes,
+  const std::string& sourceURL
+) {
+  using namespace hermes;
+  auto bytecode = hbc::BCProviderFromBuffer::createBCProviderFromBuffer(
+      std::move(bytes));
+  if (!bytecode.first) {
+    llvh::errs() << "Failed to load " << sourceURL << ": " << bytecode.second
+                 << "\n";
+    return nullptr;
+  }
+  return std::move(bytecode.first);
+}
+
+bool Engine::init(
+  std::shared_ptr<hermes::hbc::BCProvider> provider,
+  const std::string& sourceURL,
+  const BindingsDefine& bindings
+) {
+  using namespace hermes;
+  bytecode = std::move(provider);
+
+  vm::GCScope scope(*runtime);
+
+  if (!eventLoop->install()) {
+    llvh::errs() << "Failed to install the event loop\n";
+    return false;
+  }
+  if (!moduleLoader->install()) {
+    llvh::errs() << "Failed to install the module loader\n";
+    return false;
+  }
+  if (bundleLoader && !bundleLoader->install()) {
+    llvh::errs() << "Failed to install require\n";
+    return false;
+  }
+  bindings.install(*runtime, bindings);
+
+  vm::RuntimeModuleFlags flags;
+  flags.persistent = true;
+
+  vm::CallResult<vm::HermesValue> status = runtime->runBytecode(
+      std::shared_ptr<hbc::BCProvider>(bytecode),
+      flags,
+      sourceURL,
+      vm::Runtime::makeNullHandle<vm::Environment>());
+  if (status == vm::ExecutionStatus::EXCEPTION) {
+    llvh::outs().flush();
+    runtime->printException(
+        llvh::errs(), runtime->makeHandle(runtime->getThrownValue()));
+    runtime->clearThrownValue();
+    return false;
+  }
+  // the top level code is the first task
+  return eventLoop->performCheckpoint();
+}
+
+EngineStatus Engine::call(const std::string& exportName, const CallArguments& args) {
+  using namespace hermes;
+  vm::GCScope scope(*runtime);
+  result = vm::HermesValue::encodeUndefinedValue();
+
+  const vm::PinnedHermesValue* function = lookupExport(exportName);
+  if (function == nullptr) {
+    return EngineStatus::NotFound;
+  }
+
+  beginCall();
+  auto callResult = callFunction(
+      *runtime, vm::Handle<vm::Callable>::vmcast(function), args);
+  if (LLVM_UNLIKELY(callResult == vm::ExecutionStatus::EXCEPTION)) {
+    return endCall(takeException());
+  }
+  result = *callResult;
+  // a call is a task, jobs it queued run before anything else
+  eventLoop->performCheckpoint();
+  return endCall(EngineStatus::Returned);
+}
+
+EngineStatus Engine::awaitResult() {
+  using namespace hermes;
+  vm::GCScope scope(*runtime);
+  if (!result.isObject()) {
+    return EngineStatus::Returned;
+  }
+
+  auto thenSymbol = runtime->getIdentifierTable().getSymbolHandle(
+      *runtime, vm::createASCIIRef("then"));
+  if (LLVM_UNLIKELY(thenSymbol == vm::ExecutionStatus::EXCEPTION)) {
+    return takeException();
+  }
+  auto thenValue = vm::JSObject::getNamed_RJS(
+      vm::Handle<vm::JSObject>::vmcast(&result), *runtime, **thenSymbol);
+  if (LLVM_UNLIKELY(thenValue == vm::ExecutionStatus::EXCEPTION)) {
+    return takeException();
+  }
+  auto then = vm::Handle<vm::Callable>::dyn_vmcast(
+      runtime->makeHandle(std::move(*thenValue)));
+  if (!then) {
+    // not a thenable, it's the final value
+    return EngineStatus::Returned;
+  }
+
+  // The resolvers stay attached to the promise if it doesn't settle in time.
+  // Each knows which await it belongs to, and the generation moves on when
+  // the await returns, so a late settlement can't overwrite a later result.
+  const uint64_t generation = awaitGeneration;
+  auto makeResolver = [&](vm::NativeFunctionPtr resolve) {
+    return vm::FinalizableNativeFunction::createWithoutPrototype(
+        *runtime,
+        new AwaitContext{this, generation},
+        resolve,
+        [](void* context) { delete static_cast<AwaitContext*>(context); },
+        vm::Predefined::getSymbolID(vm::Predefined::emptyString),
+        1);
+  };
+  auto onFulfilled = makeResolver(Engine::onFulfilled);
+  if (LLVM_UNLIKELY(onFulfilled == vm::ExecutionStatus::EXCEPTION)) {
+    return takeException();
+  }
+  auto onFulfilledHandle = runtime->makeHandle(*onFulfilled);
+  auto onRejected = makeResolver(Engine::onRejected);
+  if (LLVM_UNLIKELY(onRejected == vm::ExecutionStatus::EXCEPTION)) {
+    return takeException();
+  }
+  auto onRejectedHandle = runtime->makeHandle(*onRejected);
+
+  awaitedStatus = EngineStatus::Pending;
+  beginCall();
+  auto thenResult = vm::Callable::executeCall2(
+      then,
+      *runtime,
+      runtime->makeHandle(result),
+      onFulfilledHandle.getHermesValue(),
+      onRejectedHandle.getHermesValue());
+  if (LLVM_UNLIKELY(thenResult == vm::ExecutionStatus::EXCEPTION)) {
+    ++awaitGeneration;
+    return endCall(takeException());
+  }
+
+  eventLoop->runUntil([this]() { return awaitedStatus != EngineStatus::Pending; });
+  ++awaitGeneration;
+  return endCall(awaitedStatus);
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> Engine::onFulfilled(
+  void* context,
+  hermes::vm::Runtime& runtime,
+  hermes::vm::NativeArgs args
+) {
+  const AwaitContext& awaitContext = *static_cast<const AwaitContext*>(context);
+  Engine& engine = *awaitContext.engine;
+  if (awaitContext.generation != engine.awaitGeneration) {
+    return hermes::vm::HermesValue::encodeUndefinedValue();
+  }
+  engine.result = args.getArg(0);
+  engine.awaitedStatus = EngineStatus::Returned;
+  return hermes::vm::HermesValue::encodeUndefinedValue();
+}
+
+hermes::vm::CallResult<hermes::vm::HermesValue> Engine::onRejected(
+  void* context,
+  hermes::vm::Runtime& runtime,
+  hermes::vm::NativeArgs args
+) {
+  const AwaitContext& awaitContext = *static_cast<const AwaitContext*>(context);
+  Engine& engine = *awaitContext.engine;
+  if (awaitContext.generation != engine.awaitGeneration) {
+    return hermes::vm::HermesValue::encodeUndefinedValue();
+  }
+  engine.result = args.getArg(0);
+  engine.awaitedStatus = EngineStatus::Exception;
+  return hermes::vm::HermesValue::encodeUndefinedValue();
+}
+
+bool Engine::runEventLoop() {
+  // not a call, nothing interrupts it
+  eventLoop->resume();
+  return eventLoop->run();
+}
+
+std::string Engine::resultString() {
+  using namespace hermes;
+  vm::GCScope scope(*runtime);
+  auto str = vm::toString_RJS(*runtime, runtime->makeHandle(result));
+  if (str == vm::ExecutionStatus::EXCEPTION) {
+    runtime->clearThrownValue();
+    return std::string();
+  }
+  return stringPrimitiveToUTF8(*runtime, runtime->makeHandle(std::move(*str)));
+}
+
+const hermes::vm::PinnedHermesValue* Engine::lookupExport(const std::string& exportName) {
+  using namespace hermes;
+  auto found = exports.find(exportName);
+  if (found != exports.end()) {
+    return &found->second;
+  }
+
+  auto function = getGlobalFunction(*runtime, exportName);
+  if (function == vm::ExecutionStatus::EXCEPTION) {
+    runtime->clearThrownValue();
+    return nullptr;
+  }
+  if (!*function) {
+    return nullptr;
+  }
+  return &exports.emplace(exportName, function->getHermesValue()).first->second;
+}
+
+EngineStatus Engine::takeException() {
+  result = runtime->getThrownValue();
+  runtime->clearThrownValue();
+  return EngineStatus::Exception;
+}
+
+void Engine::interrupt(EngineStatus status) {
+  std::lock_guard<std::mutex> lock(interruptMutex);
+  if (!running || interruptStatus != EngineStatus::Returned) {
+    return;
+  }
+  interruptStatus = status;
+  runtime->triggerTimeoutAsyncBreak();
+  // tasks after the interrupted one wait for the next call
+  eventLoop->stop();
+}
+
+void Engine::beginCall() {
+  // a stop from an earlier call, interrupts only come in while running
+  eventLoop->resume();
+  {
+    std::lock_guard<std::mutex> lock(interruptMutex);
+    running = true;
+  }
+  // outside the lock, the watchdog holds its own lock while it interrupts
+  ExecutionWatchdog::Clock::time_point callDeadline = deadline;
+  if (callTimeLimit.count() != 0) {
+    callDeadline = std::min(callDeadline, ExecutionWatchdog::Clock::now() + callTimeLimit);
+  }
+  watchId = ExecutionWatchdog::getShared().watch(
+      callDeadline, callCpuTimeLimit, [this]() { interrupt(EngineStatus::TimedOut); });
+}
+
+EngineStatus Engine::endCall(EngineStatus status) {
+  ExecutionWatchdog::getShared().unwatch(watchId);
+  watchId = 0;
+  EngineStatus interrupted;
+  {
+    std::lock_guard<std::mutex> lock(interruptMutex);
+    running = false;
+    interrupted = interruptStatus;
+    interruptStatus = EngineStatus::Returned;
+  }
+  if (interrupted != EngineStatus::Returned) {
+    drainInterrupt();
+    // a call that got to return before the break keeps its result
+    if (status != EngineStatus::Returned) {
+      status = interrupted;
+      result = hermes::vm::HermesValue::encodeUndefinedValue();
+    }
+    if (interrupted == EngineStatus::OutOfMemory) {
+      // what the aborted call allocated is garbage now
+      runtime->collect("memory budget");
+    }
+  }
+  if (memoryBudget) {
+    relieveMemoryPressure(*runtime, memoryBudget->takePending());
+  }
+  if (heapSnapshotter) {
+    heapSnapshotter->afterCall();
+  }
+  return status;
+}
+
+void Engine::drainInterrupt() {
+  using namespace hermes;
+  vm::GCScope scope(*runtime);
+  // taking the break at the function's entry or in its loop is fine, it's
+  // tried twice in case it's taken while the function is being created
+  for (int attempt = 0; attempt < 2 && drainFunction.isUndefined(); ++attempt) {
+    // the loop's back edge checks for a break, it's compiled with the check
+    // even though bundles may not be
+    static const char source[] = "(function() { for (var i = 0; i < 2; i++) {} })";
+    hbc::CompileFlags flags;
+    flags.emitAsyncBreakCheck = true;
+    auto compiled = hbc::BCProviderFromSrc::createBCProviderFromSrc(
+        std::make_unique<hermes::Buffer>(
+            reinterpret_cast<const uint8_t*>(source), sizeof(source) - 1),
+        "drainInterrupt",
+        nullptr,
+        flags);
+    if (!compiled.first) {
+      return;
+    }
+    vm::RuntimeModuleFlags moduleFlags;
+    auto function = runtime->runBytecode(
+        std::move(compiled.first),
+        moduleFlags,
+        "drainInterrupt",
+        vm::Runtime::makeNullHandle<vm::Environment>());
+    if (function == vm::ExecutionStatus::EXCEPTION) {
+      runtime->clearThrownValue();
+      continue;
+    }
+    drainFunction = *function;
+  }
+  auto function = vm::Handle<vm::Callable>::dyn_vmcast(runtime->makeHandle(drainFunction));
+  if (!function) {
+    return;
+  }
+  if (callFunction(*runtime, function, llvh::ArrayRef<vm::Handle<>>()) ==
+      vm::ExecutionStatus::EXCEPTION) {
+    runtime->clearThrownValue();
+  }
+}
+
+MappedFileBuffer::MappedFileBuffer(const uint8_t* data, size_t size):
+  hermes::Buffer(data, size)
+{}
+
+MappedFileBuffer::~MappedFileBuffer() {
+  if (data_ == nullptr)
+    return;
+#ifdef _WIN32
+  UnmapViewOfFile(data_);
+#else
+  munmap(const_cast<uint8_t*>(data_), size_);
+#endif
+}
+
+std::unique_ptr<MappedFileBuffer> MappedFileBuffer::open(const std::string& path) {
+#ifdef _WIN32
+  HANDLE file = CreateFileA(
+      path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return nullptr;
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+    CloseHandle(file);
+    return nullptr;
+  }
+  HANDLE mapping =
+      CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (mapping == nullptr)
+    return nullptr;
+  // the view keeps the mapping object alive after its handle is closed
+  void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (view == nullptr)
+    return nullptr;
+  const size_t size = static_cast<size_t>(fileSize.QuadPart);
+#else
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return nullptr;
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+    ::close(fd);
+    return nullptr;
+  }
+  const size_t size = static_cast<size_t>(fileStat.st_size);
+  // MAP_SHARED so that clean pages are shared with other processes mapping
+  // the same bundle
+  void* view = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (view == MAP_FAILED)
+    return nullptr;
+#endif
+  return std::unique_ptr<MappedFileBuffer>(
+      new MappedFileBuffer(static_cast<const uint8_t*>(view), size));
+}
+
+void MappedFileBuffer::advise(size_t offset, size_t length, Advice advice) const {
+  if (advice == Advice::Normal || offset >= size_)
+    return;
+  length = std::min(length, size_ - offset);
+  // the start of the range has to be page aligned
+  const uintptr_t pageMask = hermes::oscompat::page_size() - 1;
+  const uintptr_t start = reinterpret_cast<uintptr_t>(data_) + offset;
+  const uintptr_t alignedStart = start & ~pageMask;
+  length += start - alignedStart;
+#ifdef _WIN32
+  // windows has no equivalent to MADV_RANDOM, only prefetching
+  if (advice != Advice::Random) {
+    WIN32_MEMORY_RANGE_ENTRY range{reinterpret_cast<void*>(alignedStart), length};
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+  }
+#else
+  madvise(
+      reinterpret_cast<void*>(alignedStart),
+      length,
+      advice == Advice::Random ? MADV_RANDOM : MADV_WILLNEED);
+#endif
+}
+
+void MappedFileBuffer::adviseHBC(Advice advice) const {
+  using namespace hermes::hbc;
+  if (advice != Advice::Startup) {
+    advise(0, size_, advice);
+    return;
+  }
+  if (size_ < sizeof(BytecodeFileHeader))
+    return;
+  const auto* header = reinterpret_cast<const BytecodeFileHeader*>(data_);
+  if (header->magic != MAGIC)
+    return;
+
+  // The tables read while creating the RuntimeModule come right after the
+  // header, in this order, each one padded to BYTECODE_ALIGNMENT.
+  const size_t startupSections[] = {
+    sizeof(BytecodeFileHeader),
+    header->functionCount * sizeof(SmallFuncHeader),
+    header->stringKindCount * sizeof(StringKind::Entry),
+    header->identifierCount * sizeof(uint32_t),
+    header->stringCount * sizeof(SmallStringTableEntry),
+    header->overflowStringCount * sizeof(OverflowStringTableEntry),
+    header->stringStorageSize,
+  };
+  size_t startupLength = 0;
+  for (size_t sectionSize : startupSections)
+    startupLength += llvh::alignTo(sectionSize, BYTECODE_ALIGNMENT);
+  startupLength = std::min(startupLength, size_);
+
+  // function bodies are only read when the function runs, so don't let the
+  // kernel read ahead into them
+  advise(startupLength, size_ - startupLength, Advice::Random);
+  advise(0, startupLength, Advice::WillNeed);
+}
+
+std::unique_ptr<hermes::Buffer> mapHBCFile(const std::string& path, bool adviseStartup) {
+  std::unique_ptr<MappedFileBuffer> buffer = MappedFileBuffer::open(path);
+  if (!buffer) {
+    llvh::errs() << "Failed to map " << path << "\n";
+    return nullptr;
+  }
+  if (adviseStartup) {
+    buffer->adviseHBC(MappedFileBuffer::Advice::Startup);
+  }
+  return buffer;
+}
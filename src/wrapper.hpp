@@ -1,8 +1,13 @@
 #pragma once
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <list>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 
 #include "hermes/BCGen/HBC/BytecodeDataProvider.h"
 #include "hermes/Public/RuntimeConfig.h"
@@ -10,11 +15,13 @@
 
 #include "hermes/CompilerDriver/CompilerDriver.h"
 #include "hermes/Support/MemoryBuffer.h"
+#include "hermes/Support/OSCompat.h"
 #include "hermes/Support/UTF8.h"
 #include "hermes/VM/Callable.h"
 #include "hermes/VM/Domain.h"
 #include "hermes/VM/JSObject.h"
 #include "hermes/VM/NativeArgs.h"
+#include "hermes/VM/Operations.h"
 #include "hermes/VM/Profiler/SamplingProfiler.h"
 #include "hermes/VM/Runtime.h"
 #include "hermes/VM/StringPrimitive.h"
@@ -26,14 +33,26 @@
 #include "hermes/BCGen/HBC/HBC.h"
 #include "hermes/VM/Runtime.h"
 
+#include "heap_snapshot.hpp"
+#include "memory_budget.hpp"
+#include "watchdog.hpp"
+#include "native_stats.hpp"
+
 class BindingsDefine;
 struct NativeFunctionDefine;
+class Bundle;
+class BundleLoader;
+class EventLoop;
+class ModuleLoader;
+class AsyncNativeCalls;
+class ObjectShapes;
 
 struct NativeVFunctionReturnValue {
     /* implicit */ NativeVFunctionReturnValue(hermes::vm::HermesValue&& value_) : status(hermes::vm::ExecutionStatus::RETURNED), value(std::move(value_)) {}
-    /* implicit */ NativeVFunctionReturnValue(hermes::vm::ExecutionStatus status_) : status(status_) {}
+    /* implicit */ NativeVFunctionReturnValue(hermes::vm::ExecutionStatus status_) : status(status_), value(hermes::vm::HermesValue::encodeUndefinedValue()) {}
 
     static NativeVFunctionReturnValue encodeUndefined() { return hermes::vm::HermesValue::encodeUndefinedValue(); }
+    static NativeVFunctionReturnValue encodeNumber(double number) { return hermes::vm::HermesValue::encodeUntrustedNumberValue(number); }
 
     hermes::vm::ExecutionStatus status;
     hermes::vm::HermesValue value;
@@ -56,6 +75,79 @@ public:
 private:
 };
 
+enum class NativeCallStatus : uint32_t {
+    Returned = 0,
+    // the exception has already been raised on the runtime
+    Exception = 1,
+};
+
+// What a FastNativeFunction returns. It fits in two registers so it comes
+// back by value.
+struct NativeCallResult {
+    NativeCallStatus status;
+    // a raw HermesValue, ignored for exceptions
+    uint64_t value;
+};
+
+extern "C" {
+// A native function that reads its arguments straight out of the caller's
+// frame and returns by value, so nothing is allocated per call. Values are
+// raw HermesValues, which are only valid until the function returns.
+typedef NativeCallResult (*FastNativeFunction)(
+    void* userData,
+    hermes::vm::Runtime* runtime,
+    const hermes::vm::NativeArgs* args
+);
+
+// Accessors for fast native functions written in other languages.
+uint32_t snapit_arg_count(const hermes::vm::NativeArgs* args);
+// undefined if index is out of range
+uint64_t snapit_arg(const hermes::vm::NativeArgs* args, uint32_t index);
+uint64_t snapit_value_undefined();
+bool snapit_value_is_null(uint64_t value);
+bool snapit_value_is_number(uint64_t value);
+double snapit_value_get_number(uint64_t value);
+uint64_t snapit_value_encode_number(double number);
+bool snapit_value_is_bool(uint64_t value);
+bool snapit_value_get_bool(uint64_t value);
+uint64_t snapit_value_encode_bool(bool value);
+bool snapit_value_is_string(uint64_t value);
+// Points chars at the characters of a string value and returns true if they
+// are ASCII bytes or false if they are UTF-16 code units. They stay valid
+// until the function returns or allocates.
+bool snapit_string_chars(hermes::vm::Runtime* runtime, uint64_t value, const void** chars, size_t* length);
+// message is UTF-8, returns the result to hand back to the runtime
+NativeCallResult snapit_throw_type_error(hermes::vm::Runtime* runtime, const char* message, size_t length);
+}
+
+// Has to outlive every function defined with it.
+class FastFunctionContext {
+public:
+    // function is a FastNativeFunction, it's passed as void* since the
+    // bindings can't express function pointers
+    FastFunctionContext(void* _function, void* _userData):
+        function(reinterpret_cast<FastNativeFunction>(_function)),
+        userData(_userData)
+    {}
+
+    inline NativeCallResult call(hermes::vm::Runtime& runtime, const hermes::vm::NativeArgs& args) const {
+        return function(userData, &runtime, &args);
+    }
+
+    // Set when the function is added to a BindingTable, pool workers can be
+    // starting runtimes meanwhile. A context added twice keeps the first.
+    NativeCallStats* getStats() const { return stats.load(std::memory_order_acquire); }
+    void setStats(NativeCallStats* _stats) const {
+        NativeCallStats* unset = nullptr;
+        stats.compare_exchange_strong(unset, _stats, std::memory_order_acq_rel);
+    }
+
+private:
+    FastNativeFunction function;
+    void* userData;
+    mutable std::atomic<NativeCallStats*> stats{nullptr};
+};
+
 //wrapper around handle to stop binding errors
 struct SymbolIDHandle {
 public:
@@ -134,6 +226,16 @@ public:
         
         const BindingsDefine& parent;
         const NativeVFunction& func;
+
+        // see FastFunctionContext
+        NativeCallStats* getStats() const { return stats.load(std::memory_order_acquire); }
+        void setStats(NativeCallStats* _stats) const {
+            NativeCallStats* unset = nullptr;
+            stats.compare_exchange_strong(unset, _stats, std::memory_order_acq_rel);
+        }
+
+    private:
+        mutable std::atomic<NativeCallStats*> stats{nullptr};
     };
 
     virtual void start() {}
@@ -196,13 +298,587 @@ private:
     const FunctionContext defaultFunctionContext;
 };
 
+enum class GCReleaseUnused {
+    None,
+    Old,
+    YoungOnFull,
+    YoungAlways,
+};
+
+// Settings for creating a runtime and executing a bundle. A default
+// constructed RuntimeOptions is the throughput preset, apply another preset
+// before overriding single fields and check the result with validate().
+class RuntimeOptions {
+public:
+    RuntimeOptions();
+
+    // "throughput", "low-memory" or "debug", returns false for an unknown name
+    bool applyPreset(const std::string& name);
+
+    // returns an empty string if the options can be used, otherwise the reason
+    // they can't
+    std::string validate() const;
+
+    hermes::vm::RuntimeConfig makeRuntimeConfig() const;
+
+    void setInitHeapSize(uint64_t bytes) { initHeapSize = bytes; }
+    void setMaxHeapSize(uint64_t bytes) { maxHeapSize = bytes; }
+    void setOccupancyTarget(double target) { occupancyTarget = target; }
+    void setSanitizeRate(double rate) { sanitizeRate = rate; }
+    void setReleaseUnused(GCReleaseUnused mode) { releaseUnused = mode; }
+    void setAllocInYoung(bool enable) { allocInYoung = enable; }
+    void setRecordGCStats(bool enable) { recordGCStats = enable; }
+    void setMaxNumRegisters(uint32_t count) { maxNumRegisters = count; }
+    void setMicrotaskQueue(bool enable) { microtaskQueue = enable; }
+    void setEnableHermesInternalTestMethods(bool enable) { enableHermesInternalTestMethods = enable; }
+    void setBasicBlockProfiling(bool enable) { basicBlockProfiling = enable; }
+    void setStopAfterInit(bool enable) { stopAfterInit = enable; }
+    void setTimeLimit(uint32_t milliseconds) { timeLimit = milliseconds; }
+    void setCallTimeLimit(uint32_t milliseconds) { callTimeLimit = milliseconds; }
+    void setCallCpuTimeLimit(uint32_t milliseconds) { callCpuTimeLimit = milliseconds; }
+    void setForceGCBeforeStats(bool enable) { forceGCBeforeStats = enable; }
+    void setStabilizeInstructionCount(bool enable) { stabilizeInstructionCount = enable; }
+    void setSampleProfiling(bool enable) { sampleProfiling = enable; }
+    void setHeapTimeline(bool enable) { heapTimeline = enable; }
+    void setOpcodeStats(bool enable) { opcodeStats = enable; }
+    void setFunctionStats(bool enable) { functionStats = enable; }
+    // these also turn their profiler on
+    void setSampleProfileFile(const std::string& path) { sampleProfiling = true; sampleProfileFile = path; }
+    void setOpcodeStatsFile(const std::string& path) { opcodeStats = true; opcodeStatsFile = path; }
+    void setFunctionStatsFile(const std::string& path) { functionStats = true; functionStatsFile = path; }
+    void setBasicBlockProfileFile(const std::string& path) { basicBlockProfiling = true; basicBlockProfileFile = path; }
+    void setBytecodeCacheDirectory(const std::string& directory) { bytecodeCacheDirectory = directory; }
+    void setHeapBudget(uint64_t bytes) { heapBudget = bytes; }
+    void setHeapBudgetThreshold(double fraction) { heapBudgetThreshold = fraction; }
+    void setMemoryPressureAction(MemoryPressureAction action) { memoryPressureAction = action; }
+    void setHeapSnapshotPrefix(const std::string& prefix) { heapSnapshotPrefix = prefix; }
+    void setHeapSnapshotEveryCalls(uint32_t calls) { heapSnapshotEveryCalls = calls; }
+    void setHeapSnapshotOnExit(bool enable) { heapSnapshotOnExit = enable; }
+    void setHeapSnapshotOnSignal(bool enable) { heapSnapshotOnSignal = enable; }
+
+    // gc options
+    uint64_t initHeapSize;
+    uint64_t maxHeapSize;
+    // fraction of the heap that should be in use after a full collection
+    double occupancyTarget;
+    // chance of an extra collection on each allocation, for finding GC bugs
+    double sanitizeRate;
+    GCReleaseUnused releaseUnused;
+    bool allocInYoung;
+    bool recordGCStats;
+    // live bytes allowed after a collection, 0 for no budget, see
+    // MemoryBudget. Has to be below the max heap size.
+    uint64_t heapBudget;
+    // fraction of the budget where memory pressure starts
+    double heapBudgetThreshold;
+    // what to do under memory pressure when the engine has no callback
+    MemoryPressureAction memoryPressureAction;
+
+    // runtime options
+    uint32_t maxNumRegisters;
+    // run promise jobs in the event loop's microtask checkpoints instead of
+    // right away
+    bool microtaskQueue;
+    bool enableHermesInternalTestMethods;
+
+    // execution options
+    /// Enable basic block profiling.
+    bool basicBlockProfiling;
+
+    /// Stop after creating the RuntimeModule.
+    bool stopAfterInit;
+
+    /// Execution time limit.
+    uint32_t timeLimit;
+
+    // Wall and CPU time each Engine::call and awaitResult may take before
+    // it's interrupted with EngineStatus::TimedOut, 0 for no limit. Unlike
+    // timeLimit the engine keeps working afterwards.
+    uint32_t callTimeLimit;
+    uint32_t callCpuTimeLimit;
+
+    /// Perform a full GC just before printing any statistics.
+    bool forceGCBeforeStats;
+
+    /// Try to execute the same number of CPU instructions
+    /// across repeated invocations of the same JS.
+    bool stabilizeInstructionCount;
+
+    /// Run the sampling profiler.
+    bool sampleProfiling;
+
+    /// Start tracking heap objects before executing bytecode.
+    bool heapTimeline;
+
+    // Heap snapshots go to PREFIX-PID-N.heapsnapshot, or .heaptimeline with
+    // heapTimeline, see HeapSnapshotter. Empty for no snapshots.
+    std::string heapSnapshotPrefix;
+    // 0 for none, otherwise a snapshot after every this many calls
+    uint32_t heapSnapshotEveryCalls;
+    bool heapSnapshotOnExit;
+    // on SIGUSR2, not on Windows
+    bool heapSnapshotOnSignal;
+
+    /// Dump the opcode counts and times, needs HERMESVM_PROFILER_OPCODE.
+    bool opcodeStats;
+
+    /// Dump the per function call counts and times, needs
+    /// HERMESVM_PROFILER_JSFUNCTION.
+    bool functionStats;
+
+    // where each profiler writes once the bundle is done, empty for the
+    // console. The sampling profiler writes a Chrome trace.
+    std::string sampleProfileFile;
+    std::string opcodeStatsFile;
+    std::string functionStatsFile;
+    std::string basicBlockProfileFile;
+
+    // where evalAsync and importModule keep compiled bytecode between runs,
+    // empty to only keep it in memory
+    std::string bytecodeCacheDirectory;
+};
+
 bool executeHBCBytecode(
     std::unique_ptr<hermes::Buffer> bytes,
     const std::string sourceURL,
-    const BindingsDefine& bindings
+    const BindingsDefine& bindings,
+    const RuntimeOptions& runtimeOptions
+);
+
+// Arguments passed from the host to a JS function. They are plain host values
+// until the call is made, strings are created in the runtime at that point.
+struct CallArguments {
+public:
+    enum class Kind {
+        Undefined,
+        Null,
+        Bool,
+        Number,
+        String,
+    };
+
+    struct Argument {
+        Kind kind;
+        double number;
+        std::string string;
+    };
+
+    void pushUndefined() { list.push_back({Kind::Undefined, 0, {}}); }
+    void pushNull() { list.push_back({Kind::Null, 0, {}}); }
+    void pushBool(bool value) { list.push_back({Kind::Bool, value ? 1.0 : 0.0, {}}); }
+    void pushNumber(double value) { list.push_back({Kind::Number, value, {}}); }
+    // value is UTF-8
+    void pushString(const std::string& value) { list.push_back({Kind::String, 0, value}); }
+    void clear() { list.clear(); }
+    size_t size() const { return list.size(); }
+
+    const std::vector<Argument>& getList() const { return list; }
+
+private:
+    std::vector<Argument> list;
+};
+
+enum class EngineStatus {
+    Returned,
+    // the exception is stored as the result
+    Exception,
+    // the export doesn't exist or isn't a function
+    NotFound,
+    // awaitResult() ran out of tasks before the promise settled
+    Pending,
+    // the runtime went over its heap budget and the call was aborted, the
+    // engine can still be used
+    OutOfMemory,
+    // the call ran past its deadline or CPU time limit and was interrupted,
+    // the engine can still be used
+    TimedOut,
+};
+
+// Keeps one Runtime alive with the bundle already loaded and its bindings
+// installed, so serving a request is a single call into an exported function
+// instead of a full runtime bring-up.
+// Exports are functions on the global object. They are looked up once and
+// then cached, so reassigning one after the first call has no effect.
+// Not thread safe, use an Engine only on the thread that created it.
+class Engine {
+public:
+    // Runs the bundle's top level code, or the entry module if bytes is a
+    // multi-module bundle. Returns null if the bytecode couldn't be loaded or
+    // the top level code threw.
+    // The runtime keeps pointers to the function contexts and binding table
+    // of bindings, so bindings has to outlive the Engine. The same goes for
+    // createWithProvider.
+    static std::unique_ptr<Engine> create(
+        std::unique_ptr<hermes::Buffer> bytes,
+        const std::string& sourceURL,
+        const BindingsDefine& bindings,
+        const RuntimeOptions& runtimeOptions
+    );
+
+    // Same as create, but the bytecode has already been loaded and can be
+    // shared with other engines, including ones on other threads.
+    static std::unique_ptr<Engine> createWithProvider(
+        std::shared_ptr<hermes::hbc::BCProvider> bytecode,
+        const std::string& sourceURL,
+        const BindingsDefine& bindings,
+        const RuntimeOptions& runtimeOptions
+    );
+
+    Engine(const Engine&) = delete;
+    Engine& operator=(const Engine&) = delete;
+    ~Engine();
+
+    // Calls an export and performs a microtask checkpoint. Timers and other
+    // tasks it queued only run in awaitResult() or runEventLoop().
+    EngineStatus call(const std::string& exportName, const CallArguments& args);
+
+    // If the result of the last call is a promise or other thenable, runs the
+    // event loop until it settles and makes its value the result.
+    EngineStatus awaitResult();
+
+    // Runs queued tasks until there are none left, returns false if one threw.
+    bool runEventLoop();
+    EventLoop& getEventLoop() { return *eventLoop; }
+
+    // the return value or exception of the last call
+    bool resultIsNumber() const { return result.isNumber(); }
+    bool resultIsUndefined() const { return result.isUndefined(); }
+    double resultNumber() const { return result.isNumber() ? result.getNumber() : 0.0; }
+    // converts the result with toString, as UTF-8
+    std::string resultString();
+
+    hermes::vm::Runtime& getRuntime() { return *runtime; }
+
+    // Replaces the heap budget's default action, see MemoryBudget. Does
+    // nothing without a budget.
+    void setMemoryPressureCallback(MemoryBudget::Callback callback);
+
+    // Calls and awaitResult() return EngineStatus::TimedOut once they run
+    // past the deadline, until clearDeadline(). For a deadline on a whole
+    // request rather than on each call, the call time limits from
+    // RuntimeOptions still apply and whichever ends first wins.
+    void setDeadline(ExecutionWatchdog::Clock::time_point _deadline) { deadline = _deadline; }
+    void clearDeadline() { deadline = ExecutionWatchdog::Clock::time_point::max(); }
+
+private:
+    explicit Engine(const RuntimeOptions& runtimeOptions);
+
+    hermes::vm::RuntimeConfig makeRuntimeConfig(const RuntimeOptions& runtimeOptions);
+
+    // bundle is null for a single module
+    static std::unique_ptr<Engine> createEngine(
+        std::shared_ptr<hermes::hbc::BCProvider> bytecode,
+        std::shared_ptr<Bundle> bundle,
+        const std::string& sourceURL,
+        const BindingsDefine& bindings,
+        const RuntimeOptions& runtimeOptions
+    );
+
+    bool init(
+        std::shared_ptr<hermes::hbc::BCProvider> bytecode,
+        const std::string& sourceURL,
+        const BindingsDefine& bindings
+    );
+
+    // returns null if the export isn't a function
+    const hermes::vm::PinnedHermesValue* lookupExport(const std::string& exportName);
+
+    // moves the thrown value into result
+    EngineStatus takeException();
+
+    // Any thread. Makes the running call return status at the next async
+    // break check, does nothing between calls.
+    void interrupt(EngineStatus status);
+    // around everything that runs JS for the host
+    void beginCall();
+    EngineStatus endCall(EngineStatus status);
+    // An interrupt can arrive after the call's last break check, it would
+    // then end whatever runs next. This runs a function that checks for a
+    // break so that it's taken here instead.
+    void drainInterrupt();
+
+    // the context of the resolvers an awaitResult() passes to then, owned
+    // by the function objects
+    struct AwaitContext {
+        Engine* engine;
+        uint64_t generation;
+    };
+    static hermes::vm::CallResult<hermes::vm::HermesValue> onFulfilled(
+        void* context, hermes::vm::Runtime& runtime, hermes::vm::NativeArgs args);
+    static hermes::vm::CallResult<hermes::vm::HermesValue> onRejected(
+        void* context, hermes::vm::Runtime& runtime, hermes::vm::NativeArgs args);
+
+    // declared before the runtime, its GC calls into them
+    std::unique_ptr<MemoryBudget> memoryBudget;
+    std::mutex interruptMutex;
+    bool running = false;
+    // Returned unless the running call was interrupted
+    EngineStatus interruptStatus = EngineStatus::Returned;
+    ExecutionWatchdog::Clock::time_point deadline = ExecutionWatchdog::Clock::time_point::max();
+    std::chrono::milliseconds callTimeLimit;
+    std::chrono::milliseconds callCpuTimeLimit;
+    // the running call's watch, 0 without one
+    uint64_t watchId = 0;
+
+    std::shared_ptr<hermes::vm::Runtime> runtime;
+    std::unique_ptr<EventLoop> eventLoop;
+    // destroyed before the event loop it posts to
+    std::unique_ptr<ModuleLoader> moduleLoader;
+    std::unique_ptr<AsyncNativeCalls> asyncCalls;
+    std::unique_ptr<ObjectShapes> objectShapes;
+    // only for bundles
+    std::unique_ptr<BundleLoader> bundleLoader;
+    std::shared_ptr<hermes::hbc::BCProvider> bytecode;
+    EngineStatus awaitedStatus = EngineStatus::Returned;
+    // the running awaitResult()'s, resolvers from any other are ignored
+    uint64_t awaitGeneration = 0;
+    // both are marked as roots by the runtime
+    std::unordered_map<std::string, hermes::vm::PinnedHermesValue> exports;
+    hermes::vm::PinnedHermesValue result;
+    // compiled on the first drainInterrupt, also a root
+    hermes::vm::PinnedHermesValue drainFunction;
+    std::unique_ptr<HeapSnapshotter> heapSnapshotter;
+    bool heapSnapshotOnExit = false;
+};
+
+// Parses the bytecode header and function table once. The provider is
+// immutable after that and can be shared by every runtime that runs the
+// bundle. Returns null and prints the reason if the bytecode is invalid.
+std::shared_ptr<hermes::hbc::BCProvider> loadBytecodeProvider(
+    std::unique_ptr<hermes::Buffer> bytes,
+    const std::string& sourceURL
+);
+
+hermes::vm::CallResult<hermes::vm::HermesValue> makeArgumentValue(
+    hermes::vm::Runtime& runtime,
+    const CallArguments::Argument& argument
+);
+
+// The handle is null if the global doesn't exist or isn't callable.
+hermes::vm::CallResult<hermes::vm::Handle<hermes::vm::Callable>> getGlobalFunction(
+    hermes::vm::Runtime& runtime,
+    const std::string& name
+);
+
+// Defines a non-enumerable native function on the global object, returns
+// false if that failed.
+bool defineGlobalFunction(
+    hermes::vm::Runtime& runtime,
+    const char* name,
+    hermes::vm::NativeFunctionPtr function,
+    void* context,
+    unsigned paramCount
+);
+
+// Calls function with undefined as this. The arguments have to be rooted.
+hermes::vm::CallResult<hermes::vm::HermesValue> callFunction(
+    hermes::vm::Runtime& runtime,
+    hermes::vm::Handle<hermes::vm::Callable> function,
+    llvh::ArrayRef<hermes::vm::Handle<>> arguments
+);
+
+hermes::vm::CallResult<hermes::vm::HermesValue> callFunction(
+    hermes::vm::Runtime& runtime,
+    hermes::vm::Handle<hermes::vm::Callable> function,
+    const CallArguments& args
 );
 
+// Read only view of a file mapped into memory. Hermes reads bytecode straight
+// out of the mapping, so pages are only loaded when they are touched and the
+// OS can share them between every process running the same bundle.
+class MappedFileBuffer : public hermes::Buffer {
+public:
+    enum class Advice {
+        Normal,
+        // Prefetch the header, function table and string table, which are
+        // read while the RuntimeModule is created, and leave the rest lazy.
+        Startup,
+        WillNeed,
+        Random,
+    };
+
+    // returns null if the file couldn't be opened or mapped
+    static std::unique_ptr<MappedFileBuffer> open(const std::string& path);
+
+    MappedFileBuffer(const MappedFileBuffer&) = delete;
+    MappedFileBuffer& operator=(const MappedFileBuffer&) = delete;
+    ~MappedFileBuffer() override;
+
+    // hints are best effort, failures are ignored
+    void advise(size_t offset, size_t length, Advice advice) const;
+    void adviseHBC(Advice advice) const;
+
+private:
+    MappedFileBuffer(const uint8_t* data, size_t size);
+};
+
+// Maps an hbc file for executeHBCBytecode, returns null on failure.
+std::unique_ptr<hermes::Buffer> mapHBCFile(const std::string& path, bool adviseStartup);
+
+inline uint64_t peakResidentSetBytes() {
+    return hermes::oscompat::peak_rss();
+}
+
+inline uint64_t currentResidentSetBytes() {
+    return hermes::oscompat::current_rss();
+}
+
+// convert a string to UTF-8, replacing any unpaired surrogates
+std::string stringPrimitiveToUTF8(hermes::vm::Runtime& runtime, hermes::vm::Handle<hermes::vm::StringPrimitive> str);
+
+// Typed native functions. Write a plain function that takes the runtime and
+// then any argument types TypedArg supports, and TypedFunction decodes and
+// checks the arguments, calls it and encodes its result, with everything
+// picked at compile time instead of through NativeVFunction's vtable:
+//   double add(hermes::vm::Runtime& runtime, double a, double b) { return a + b; }
+//   functionDefine.setTypedFunction<add>(name);
+// An argument with the wrong type, missing ones included, throws a TypeError
+// before the function is called.
+template<typename T>
+struct TypedArg;
+
+template<>
+struct TypedArg<double> {
+    static constexpr const char* expected = "a number";
+    static bool check(hermes::vm::HermesValue value) { return value.isNumber(); }
+    static double get(hermes::vm::Runtime& runtime, hermes::vm::NativeArgs& args, unsigned index) {
+        return args.getArg(index).getNumber();
+    }
+};
+
+template<>
+struct TypedArg<bool> {
+    static constexpr const char* expected = "a boolean";
+    static bool check(hermes::vm::HermesValue value) { return value.isBool(); }
+    static bool get(hermes::vm::Runtime& runtime, hermes::vm::NativeArgs& args, unsigned index) {
+        return args.getArg(index).getBool();
+    }
+};
+
+template<>
+struct TypedArg<hermes::vm::StringView> {
+    static constexpr const char* expected = "a string";
+    static bool check(hermes::vm::HermesValue value) { return value.isString(); }
+    static hermes::vm::StringView get(hermes::vm::Runtime& runtime, hermes::vm::NativeArgs& args, unsigned index) {
+        return hermes::vm::StringPrimitive::createStringView(
+            runtime, hermes::vm::Handle<hermes::vm::StringPrimitive>::vmcast(args.getArgHandle(index)));
+    }
+};
+
+template<>
+struct TypedArg<hermes::vm::Handle<hermes::vm::BigIntPrimitive>> {
+    static constexpr const char* expected = "a BigInt";
+    static bool check(hermes::vm::HermesValue value) { return value.isBigInt(); }
+    static hermes::vm::Handle<hermes::vm::BigIntPrimitive> get(hermes::vm::Runtime& runtime, hermes::vm::NativeArgs& args, unsigned index) {
+        return hermes::vm::Handle<hermes::vm::BigIntPrimitive>::vmcast(args.getArgHandle(index));
+    }
+};
+
+// any value, not checked
+template<>
+struct TypedArg<hermes::vm::Handle<>> {
+    static constexpr const char* expected = "any value";
+    static bool check(hermes::vm::HermesValue value) { return true; }
+    static hermes::vm::Handle<> get(hermes::vm::Runtime& runtime, hermes::vm::NativeArgs& args, unsigned index) {
+        return args.getArgHandle(index);
+    }
+};
+
+template<typename T>
+struct TypedResult;
+
+template<>
+struct TypedResult<double> {
+    static hermes::vm::CallResult<hermes::vm::HermesValue> encode(double value) {
+        return hermes::vm::HermesValue::encodeUntrustedNumberValue(value);
+    }
+};
+
+template<>
+struct TypedResult<bool> {
+    static hermes::vm::CallResult<hermes::vm::HermesValue> encode(bool value) {
+        return hermes::vm::HermesValue::encodeBoolValue(value);
+    }
+};
+
+template<>
+struct TypedResult<hermes::vm::HermesValue> {
+    static hermes::vm::CallResult<hermes::vm::HermesValue> encode(hermes::vm::HermesValue value) {
+        return value;
+    }
+};
+
+// for functions that can throw
+template<>
+struct TypedResult<hermes::vm::CallResult<hermes::vm::HermesValue>> {
+    static hermes::vm::CallResult<hermes::vm::HermesValue> encode(hermes::vm::CallResult<hermes::vm::HermesValue> value) {
+        return value;
+    }
+};
+
+// index starts at 0
+hermes::vm::ExecutionStatus raiseArgumentTypeError(
+    hermes::vm::Runtime& runtime, unsigned index, const char* expected);
+
+template<auto Function>
+struct TypedFunction;
+
+template<typename R, typename... Args, R (*Function)(hermes::vm::Runtime&, Args...)>
+struct TypedFunction<Function> {
+    static constexpr unsigned paramCount = sizeof...(Args);
+    // one per function, set when it's added to a BindingTable, atomic for
+    // the same reason as FastFunctionContext's
+    static inline std::atomic<NativeCallStats*> stats{nullptr};
+
+    static hermes::vm::CallResult<hermes::vm::HermesValue> call(
+        void* context, hermes::vm::Runtime& runtime, hermes::vm::NativeArgs args
+    ) {
+        NativeCallScope scope{stats.load(std::memory_order_acquire), runtime};
+        return invoke(runtime, args, std::index_sequence_for<Args...>{});
+    }
+
+private:
+    template<size_t... I>
+    static hermes::vm::CallResult<hermes::vm::HermesValue> invoke(
+        hermes::vm::Runtime& runtime, hermes::vm::NativeArgs& args, std::index_sequence<I...>
+    ) {
+        // stops at the first argument with the wrong type
+        unsigned mismatch = paramCount;
+        (void)((TypedArg<std::decay_t<Args>>::check(args.getArg(I)) || (mismatch = I, false)) && ...);
+        if (LLVM_UNLIKELY(mismatch != paramCount)) {
+            // the null keeps the array from being empty
+            const char* expected[] = {TypedArg<std::decay_t<Args>>::expected..., nullptr};
+            return raiseArgumentTypeError(runtime, mismatch, expected[mismatch]);
+        }
+
+        hermes::vm::GCScopeMarkerRAII marker{runtime};
+        if constexpr (std::is_void_v<R>) {
+            Function(runtime, TypedArg<std::decay_t<Args>>::get(runtime, args, I)...);
+            return hermes::vm::HermesValue::encodeUndefinedValue();
+        } else {
+            return TypedResult<R>::encode(
+                Function(runtime, TypedArg<std::decay_t<Args>>::get(runtime, args, I)...));
+        }
+    }
+};
+
 hermes::vm::CallResult<hermes::vm::HermesValue> callFunctionContext(void *context, hermes::vm::Runtime &runtime, hermes::vm::NativeArgs args);
+hermes::vm::CallResult<hermes::vm::HermesValue> callFastFunctionContext(void *context, hermes::vm::Runtime &runtime, hermes::vm::NativeArgs args);
+
+// What a fast or async function added to a BindingTable is called with. The
+// table makes one per function for every runtime it's installed into, so a
+// call has its runtime's objects at hand instead of looking them up by
+// runtime, and the function object frees it once it's collected.
+struct RuntimeFunctionContext {
+    // a FastFunctionContext or an AsyncFunctionContext
+    const void* function;
+    // either can be null if the runtime has none
+    ObjectShapes* objectShapes;
+    AsyncNativeCalls* asyncCalls;
+};
+
+// context is a RuntimeFunctionContext around a FastFunctionContext
+hermes::vm::CallResult<hermes::vm::HermesValue> callRuntimeFastFunction(void *context, hermes::vm::Runtime &runtime, hermes::vm::NativeArgs args);
 
 struct NativeFunctionDefine {
     NativeFunctionDefine(
@@ -214,7 +890,8 @@ struct NativeFunctionDefine {
         runtime(_runtime),
         parentHandle(_parentHandle),
         prototypeObjectHandle(_prototypeObjectHandle),
-        functionContext(&(_context.getDefaultFunctionContext()))
+        context(const_cast<BindingsDefine::FunctionContext*>(&_context.getDefaultFunctionContext())),
+        callback(callFunctionContext)
     {};
     NativeFunctionDefine() = delete;
     
@@ -254,15 +931,34 @@ struct NativeFunctionDefine {
     ) {
         name = name_;
         paramCount = paramCount_;
-        functionContext = &function;
+        context = const_cast<BindingsDefine::FunctionContext*>(&function);
+        callback = callFunctionContext;
+    }
+
+    void setFastFunction(
+        hermes::vm::SymbolID name_,
+        const FastFunctionContext& function,
+        unsigned paramCount_
+    ) {
+        name = name_;
+        paramCount = paramCount_;
+        context = const_cast<FastFunctionContext*>(&function);
+        callback = callFastFunctionContext;
+    }
+
+    template<auto Function>
+    void setTypedFunction(hermes::vm::SymbolID name_) {
+        name = name_;
+        paramCount = TypedFunction<Function>::paramCount;
+        context = nullptr;
+        callback = TypedFunction<Function>::call;
     }
 
     bool define() const {
         auto global = runtime.getGlobal();
         auto normalFlags = hermes::vm::DefinePropertyFlags::getNewNonEnumerableFlags();
-        void * context = const_cast<BindingsDefine::FunctionContext*>(functionContext);
         auto nativeFunction = hermes::vm::NativeFunction::create(
-            runtime, parentHandle, context, callFunctionContext, name, paramCount,
+            runtime, parentHandle, context, callback, name, paramCount,
             prototypeObjectHandle, additionalSlotCount);
         auto res = hermes::vm::JSObject::defineOwnProperty(
             global, runtime, name, normalFlags, nativeFunction);
@@ -277,7 +973,10 @@ struct NativeFunctionDefine {
     unsigned additionalSlotCount = 0U;
 
 private:
-    const BindingsDefine::FunctionContext* functionContext;
+    // a FunctionContext or a FastFunctionContext depending on callback, null
+    // for typed functions
+    void* context;
+    hermes::vm::NativeFunctionPtr callback;
 };
 
 struct Value;
@@ -0,0 +1,186 @@
+#include "zygote.hpp"
+
+#include <cstdlib>
+
+#ifdef __linux__
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "unix_socket.hpp"
+#endif
+
+namespace {
+// a child that takes longer than this is killed
+constexpr unsigned kMaxRequestSeconds = 30;
+constexpr size_t kMaxRequestBytes = 1024 * 1024;
+} // namespace
+
+Zygote::Zygote(std::unique_ptr<Engine> _engine):
+  engine(std::move(_engine))
+{}
+
+std::unique_ptr<Zygote> Zygote::create(
+  std::unique_ptr<hermes::Buffer> bytes,
+  const std::string& sourceURL,
+  const BindingsDefine& bindings,
+  const RuntimeOptions& runtimeOptions
+) {
+  if (runtimeOptions.timeLimit != 0 || runtimeOptions.sampleProfiling) {
+    llvh::errs() << "Time limits and sampling use threads that don't survive fork\n";
+    return nullptr;
+  }
+  if (runtimeOptions.stopAfterInit) {
+    llvh::errs() << "A zygote has to run the bundle's top level code\n";
+    return nullptr;
+  }
+#ifdef HERMESVM_ALLOW_CONCURRENT_GC
+  // Hades marks the old generation on a background thread that a child
+  // wouldn't have, so the child's first old generation collection would
+  // wait for it forever
+  llvh::errs() << "The concurrent GC uses a thread that doesn't survive fork, "
+                  "build with SNAPIT_CONCURRENT_GC=0\n";
+  return nullptr;
+#endif
+  // Full young generation segments are handed to the old generation as they
+  // are instead of being collected, and nothing turns that off again. So a
+  // child doesn't collect, which would write mark bits and free lists into
+  // the pages it shares with the zygote, unless it reaches the max heap size.
+  RuntimeOptions zygoteOptions = runtimeOptions;
+  zygoteOptions.setAllocInYoung(false);
+  std::unique_ptr<Engine> engine = Engine::create(
+      std::move(bytes), sourceURL, bindings, zygoteOptions);
+  if (!engine) {
+    return nullptr;
+  }
+  // timers the top level code set run here, once, rather than in every child
+  if (!engine->runEventLoop()) {
+    return nullptr;
+  }
+  return std::unique_ptr<Zygote>(new Zygote(std::move(engine)));
+}
+
+#ifdef __linux__
+bool Zygote::serve(const std::string& socketPath, uint32_t maxChildren) {
+  const int listener = listenOnUnixSocket(socketPath, SOMAXCONN, "zygote");
+  if (listener < 0) {
+    return false;
+  }
+  // A full collection leaves the young generation empty and no background
+  // work in flight, so a child's first collection is a whole young
+  // generation away and the old generation pages it inherited stay shared
+  // until it writes to them.
+  engine->getRuntime().collect("zygote");
+
+  uint32_t running = 0;
+  while (true) {
+    // reap children that are done, then wait for one if there are too many,
+    // new connections queue up in the listen backlog meanwhile
+    while (running != 0 && waitpid(-1, nullptr, WNOHANG) > 0) {
+      --running;
+    }
+    while (running >= maxChildren) {
+      if (waitpid(-1, nullptr, 0) > 0) {
+        --running;
+      } else if (errno != EINTR) {
+        // there are no children left to wait for
+        running = 0;
+      }
+    }
+
+    const int connection = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (connection < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      llvh::errs() << "Failed to accept a zygote connection\n";
+      close(listener);
+      return false;
+    }
+    const pid_t child = fork();
+    if (child == 0) {
+      close(listener);
+      handleRequest(connection);
+    }
+    if (child < 0) {
+      llvh::errs() << "Failed to fork a zygote child\n";
+    } else {
+      ++running;
+    }
+    close(connection);
+  }
+}
+
+void Zygote::handleRequest(int connection) {
+  alarm(kMaxRequestSeconds);
+
+  std::string request;
+  char chunk[4096];
+  while (request.find('\n') == std::string::npos && request.size() < kMaxRequestBytes) {
+    const ssize_t count = read(connection, chunk, sizeof(chunk));
+    if (count <= 0) {
+      break;
+    }
+    request.append(chunk, count);
+  }
+  request = request.substr(0, request.find('\n'));
+
+  CallArguments args;
+  size_t end = request.find('\t');
+  const std::string exportName = request.substr(0, end);
+  while (end != std::string::npos) {
+    const size_t start = end + 1;
+    end = request.find('\t', start);
+    args.pushString(request.substr(start, end == std::string::npos ? std::string::npos : end - start));
+  }
+
+  EngineStatus status = engine->call(exportName, args);
+  if (status == EngineStatus::Returned) {
+    status = engine->awaitResult();
+  }
+  std::string response;
+  switch (status) {
+    case EngineStatus::Returned:
+      response = "ok\t" + engine->resultString();
+      break;
+    case EngineStatus::Exception:
+      response = "error\t" + engine->resultString();
+      break;
+    case EngineStatus::NotFound:
+      response = "error\t" + exportName + " is not a function";
+      break;
+    case EngineStatus::Pending:
+      response = "error\tthe result never settled";
+      break;
+    case EngineStatus::OutOfMemory:
+      response = "error\tout of memory";
+      break;
+    case EngineStatus::TimedOut:
+      response = "error\ttimed out";
+      break;
+  }
+  response += '\n';
+  size_t written = 0;
+  while (written < response.size()) {
+    const ssize_t count = write(connection, response.data() + written, response.size() - written);
+    if (count <= 0) {
+      break;
+    }
+    written += count;
+  }
+  close(connection);
+  // the heap goes away with the process, tearing it down would only dirty
+  // shared pages
+  _exit(status == EngineStatus::Returned ? 0 : 1);
+}
+#else
+bool Zygote::serve(const std::string& socketPath, uint32_t maxChildren) {
+  llvh::errs() << "Zygote mode is only supported on Linux\n";
+  return false;
+}
+
+void Zygote::handleRequest(int connection) {
+  std::abort();
+}
+#endif
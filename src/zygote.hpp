@@ -0,0 +1,46 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "wrapper.hpp"
+
+// Loads a bundle, installs its bindings and runs its top level code once,
+// then forks a child per request so that every request starts from the warm
+// heap, which the children share copy on write.
+// Requests come in over a Unix socket, one per connection: a line with the
+// export's name followed by tab separated string arguments. The child writes
+// back "ok\t<result>\n" or "error\t<exception>\n" and exits.
+// Only supported on Linux, serve() fails everywhere else. Threads don't
+// survive fork, so the zygote refuses options that start runtime threads and
+// builds with the concurrent GC, and collects before it forks so the GC has
+// no work in flight. For the same reason top level code shouldn't use
+// evalAsync or importModule, the compile threads they start wouldn't exist
+// in the children. The zygote's runtime doesn't allocate in the young
+// generation, so children don't collect at all unless they fill the heap.
+class Zygote {
+public:
+    // returns null if the bundle couldn't be loaded or its top level code threw
+    static std::unique_ptr<Zygote> create(
+        std::unique_ptr<hermes::Buffer> bytes,
+        const std::string& sourceURL,
+        const BindingsDefine& bindings,
+        const RuntimeOptions& runtimeOptions
+    );
+
+    Zygote(const Zygote&) = delete;
+    Zygote& operator=(const Zygote&) = delete;
+
+    // Accepts connections until the process is killed, with at most
+    // maxChildren children running at once. Returns false if the socket
+    // couldn't be set up.
+    bool serve(const std::string& socketPath, uint32_t maxChildren);
+
+private:
+    explicit Zygote(std::unique_ptr<Engine> engine);
+
+    // runs in the child, never returns
+    [[noreturn]] void handleRequest(int connection);
+
+    std::unique_ptr<Engine> engine;
+};